@@ -19,6 +19,8 @@
  *
  * This is a single-header library. Define CANVAS_ITY_IMPLEMENTATION in
  * exactly one C file before including this header to get the implementation.
+ * On POSIX systems, also defining CANVAS_ITY_MMAP there (along with a
+ * _POSIX_C_SOURCE of 199309L or later) adds ci_font_map_file().
  */
 
 #ifndef CANVAS_ITY_H
@@ -96,6 +98,19 @@ typedef enum ci_paint_type {
     CI_PAINT_CONIC = 4
 } ci_paint_type;
 
+typedef enum ci_clip_kind {
+    CI_CLIP_NONE = 0,
+    CI_CLIP_RECT = 1,
+    CI_CLIP_RUNS = 2
+} ci_clip_kind;
+
+typedef enum ci_segment_kind {
+    CI_SEGMENT_LINE = 0,
+    CI_SEGMENT_QUADRATIC = 1,
+    CI_SEGMENT_CUBIC = 2,
+    CI_SEGMENT_ARC = 3
+} ci_segment_kind;
+
 /* ======== BASIC TYPES ======== */
 
 typedef struct ci_xy { float x; float y; } ci_xy_t;
@@ -134,6 +149,14 @@ typedef struct ci_run_array {
     ci_pixel_run_t *data; size_t size; size_t capacity;
 } ci_run_array_t;
 
+typedef struct ci_size_array {
+    size_t *data; size_t size; size_t capacity;
+} ci_size_array_t;
+
+typedef struct ci_int_array {
+    int *data; size_t size; size_t capacity;
+} ci_int_array_t;
+
 /* ======== COMPOSITE TYPES ======== */
 
 typedef struct ci_paint_brush {
@@ -149,8 +172,56 @@ typedef struct ci_paint_brush {
     ci_repetition_style repetition;
 } ci_paint_brush_t;
 
+/* A run of characters from first through last mapped to glyphs by adding
+   delta, by adding it modulo 65536, or by reading the 16-bit glyph id at
+   font data offset delta + 2 * character; kind is 0, 1 or 2. */
+typedef struct ci_cmap_range {
+    int first;
+    int last;
+    int delta;
+    int kind;
+} ci_cmap_range_t;
+
+typedef struct ci_cmap_range_array {
+    ci_cmap_range_t *data; size_t size; size_t capacity;
+} ci_cmap_range_array_t;
+
+/* A kerning pair resolved at load time; unused hash slots have left -1. */
+typedef struct ci_kern_pair {
+    int left;
+    int right;
+    int value;
+} ci_kern_pair_t;
+
+typedef struct ci_kern_pair_array {
+    ci_kern_pair_t *data; size_t size; size_t capacity;
+} ci_kern_pair_array_t;
+
+/* A class-based kerning subtable expanded within the face's kern_table:
+   the row for each of the first lefts glyphs (-1 if not covered), the
+   column for each of the first rights glyphs (later ones take column 0),
+   and then the adjustments row by row. */
+typedef struct ci_kern_class {
+    size_t left;
+    size_t right;
+    size_t values;
+    int lefts;
+    int rights;
+    int columns;
+} ci_kern_class_t;
+
+typedef struct ci_kern_class_array {
+    ci_kern_class_t *data; size_t size; size_t capacity;
+} ci_kern_class_array_t;
+
 typedef struct ci_font_face {
     ci_uchar_array_t data;
+    ci_int_array_t cmap_direct;
+    ci_cmap_range_array_t cmap_ranges;
+    int cmap_sorted;
+    ci_kern_pair_array_t kern_pairs;
+    ci_kern_class_array_t kern_classes;
+    ci_int_array_t kern_table;
     int cmap;
     int glyf;
     int gpos;
@@ -162,11 +233,43 @@ typedef struct ci_font_face {
     int maxp;
     int os_2;
     float scale;
+    int borrowed;
 } ci_font_face_t;
 
+/* A loaded TrueType font that any number of canvases can draw text with
+   without copying it.  It is never changed after ci_font_create(), so
+   canvases on different threads may share it.  A font made from borrowed
+   or mapped bytes reads its tables from them in place. */
+typedef struct ci_font {
+    ci_font_face_t face;
+    void *mapping;
+    size_t mapping_size;
+} ci_font_t;
+
+/* Text shaped once with a font and size: the glyph for each character
+   and its kerned place along the baseline in font units, with one more
+   place at the end for the full advance.  It can be measured and drawn
+   any number of times by canvases using the font it was made with. */
+typedef struct ci_text_layout {
+    ci_int_array_t glyphs;
+    ci_int_array_t places;
+    unsigned char const *font;
+    float scale;
+} ci_text_layout_t;
+
+/* Path segments, in device space for the canvas's current path and in
+   user space for path objects.  Each segment after a subpath's first
+   point is tagged in kinds and stores its points without the shared
+   start: the end for a line, the control and end for a quadratic, both
+   controls and the end for a cubic, and for an elliptical arc its
+   center, the two axes that the cosine and sine of the angle scale, the
+   start angle and the signed sweep as a pair, and the end.  The version
+   changes with every edit. */
 typedef struct ci_bezier_path {
     ci_xy_array_t points;
+    ci_uchar_array_t kinds;
     ci_subpath_array_t subpaths;
+    unsigned long version;
 } ci_bezier_path_t;
 
 typedef struct ci_line_path {
@@ -174,6 +277,121 @@ typedef struct ci_line_path {
     ci_subpath_array_t subpaths;
 } ci_line_path_t;
 
+/* Lines flattened from a version of a path, under the forward transform
+   kept with them and with the angular tolerance used for stroking.  When
+   the lines are only kept on a second use, seen notes that the version
+   has been flattened once already. */
+typedef struct ci_flatten_cache {
+    ci_line_path_t lines;
+    ci_affine_matrix_t forward;
+    ci_affine_matrix_t inverse;
+    unsigned long version;
+    float angular;
+    int valid;
+    int seen;
+} ci_flatten_cache_t;
+
+/* A path built once in user space and drawn any number of times, like
+   an HTML5 Path2D.  Its lines are kept after filling and stroking and
+   reused while the transform stays close to the one they were made
+   under, until the path changes. */
+typedef struct ci_path2d {
+    ci_bezier_path_t path;
+    ci_flatten_cache_t fill;
+    ci_flatten_cache_t stroke;
+} ci_path2d_t;
+
+/* A blurred shadow alpha mask kept for later draws of the same shape.
+   The outline is kept relative to the anchor, the corner of its bounds
+   rounded down to the sampling grid, and rounded to steps of 1/64 pixel
+   given in those steps; the origin is the corner of the mask relative to
+   the anchor, in pixels.  Masks are chained from hash buckets and from
+   the least to the most recently used, by one more than their position
+   or 0 for none. */
+typedef struct ci_shadow_mask {
+    ci_line_path_t outline;
+    ci_float_array_t alpha;
+    unsigned long hash;
+    float blur;
+    float opacity;
+    int origin_x;
+    int origin_y;
+    size_t width;
+    size_t height;
+    int next;
+    int older;
+    int newer;
+} ci_shadow_mask_t;
+
+typedef struct ci_shadow_mask_array {
+    ci_shadow_mask_t *data; size_t size; size_t capacity;
+} ci_shadow_mask_array_t;
+
+/* The outline holds the rounded points of the current lines from the
+   last time a key was made for them. */
+typedef struct ci_shadow_cache {
+    ci_shadow_mask_array_t masks;
+    ci_int_array_t buckets;
+    ci_xy_array_t outline;
+    size_t bytes;
+    size_t limit;
+    int oldest;
+    int newest;
+} ci_shadow_cache_t;
+
+/* The decoded points of a simple glyph, in font units and shifted by its
+   left side bearing, with the on-curve flag of each point and the index
+   of the last point of each contour. */
+typedef struct ci_glyph_outline {
+    ci_xy_array_t points;
+    ci_uchar_array_t on_curve;
+    ci_int_array_t ends;
+    int glyph;
+    unsigned long used;
+} ci_glyph_outline_t;
+
+typedef struct ci_glyph_outline_array {
+    ci_glyph_outline_t *data; size_t size; size_t capacity;
+} ci_glyph_outline_array_t;
+
+/* Coverage runs of a glyph filled with the given linear transform at a
+   sub-pixel phase, in a frame where the pixel the glyph origin lands in
+   is at the origin offset.  The runs are in the cache's run pool. */
+typedef struct ci_glyph_runs {
+    float a, b, c, d;
+    int glyph;
+    int phase_x;
+    int phase_y;
+    int origin_x;
+    int origin_y;
+    size_t first;
+    size_t count;
+    int next;
+} ci_glyph_runs_t;
+
+typedef struct ci_glyph_runs_array {
+    ci_glyph_runs_t *data; size_t size; size_t capacity;
+} ci_glyph_runs_array_t;
+
+/* Outlines decoded from the current font.  The index holds one more than
+   the position of each glyph's outline, or 0 if it is not cached; glyphs
+   that are not kept are decoded into the scratch outline.  The coverage
+   runs of filled glyphs are kept too, chained from hash buckets that
+   hold one more than the position of the first entry, while the placed
+   runs collect those of a line of text in canvas space. */
+typedef struct ci_glyph_cache {
+    ci_glyph_outline_array_t outlines;
+    ci_int_array_t index;
+    ci_glyph_outline_t scratch;
+    size_t bytes;
+    size_t limit;
+    unsigned long clock;
+    ci_glyph_runs_array_t coverage;
+    ci_int_array_t buckets;
+    ci_run_array_t pool;
+    ci_run_array_t placed;
+} ci_glyph_cache_t;
+
 /* ======== BACKEND ABSTRACTION ======== */
 
 typedef struct ci_canvas ci_canvas_t;
@@ -209,6 +427,7 @@ struct ci_canvas {
     ci_rgba_t shadow_color;
     float shadow_blur;
     ci_float_array_t shadow;
+    ci_shadow_cache_t shadow_cache;
     float line_width;
     float miter_limit;
     ci_float_array_t line_dash;
@@ -216,11 +435,21 @@ struct ci_canvas {
     ci_paint_brush_t stroke_brush;
     ci_paint_brush_t image_brush;
     ci_bezier_path_t path;
+    ci_flatten_cache_t flattened[2];
     ci_line_path_t lines;
     ci_line_path_t scratch;
     ci_run_array_t runs;
+    ci_run_array_t sorted_runs;
+    ci_size_array_t run_rows;
+    ci_clip_kind clip_kind;
+    ci_xy_t clip_low;
+    ci_xy_t clip_high;
     ci_run_array_t mask;
+    ci_size_array_t mask_rows;
     ci_font_face_t face;
+    ci_glyph_cache_t glyph_cache;
+    ci_text_layout_t shaped;
+    unsigned shared;
     ci_rgba_t *bitmap;
     ci_canvas_t *saves;
 };
@@ -246,6 +475,7 @@ void ci_canvas_set_global_alpha(ci_canvas_t *ctx, float alpha);
 void ci_canvas_set_shadow_color(ci_canvas_t *ctx,
     float red, float green, float blue, float alpha);
 void ci_canvas_set_shadow_blur(ci_canvas_t *ctx, float level);
+void ci_canvas_set_shadow_cache_limit(ci_canvas_t *ctx, int bytes);
 
 void ci_canvas_set_line_width(ci_canvas_t *ctx, float width);
 void ci_canvas_set_miter_limit(ci_canvas_t *ctx, float limit);
@@ -297,6 +527,33 @@ void ci_canvas_stroke(ci_canvas_t *ctx);
 void ci_canvas_clip(ci_canvas_t *ctx);
 int ci_canvas_is_point_in_path(ci_canvas_t *ctx, float x, float y);
 
+ci_path2d_t *ci_path2d_create(void);
+void ci_path2d_destroy(ci_path2d_t *path);
+void ci_path2d_move_to(ci_path2d_t *path, float x, float y);
+void ci_path2d_close_path(ci_path2d_t *path);
+void ci_path2d_line_to(ci_path2d_t *path, float x, float y);
+void ci_path2d_quadratic_curve_to(ci_path2d_t *path,
+    float control_x, float control_y, float x, float y);
+void ci_path2d_bezier_curve_to(ci_path2d_t *path,
+    float control_1_x, float control_1_y,
+    float control_2_x, float control_2_y, float x, float y);
+void ci_path2d_arc_to(ci_path2d_t *path,
+    float vertex_x, float vertex_y,
+    float x, float y, float radius);
+void ci_path2d_arc(ci_path2d_t *path, float x, float y, float radius,
+    float start_angle, float end_angle, int counter_clockwise);
+void ci_path2d_ellipse(ci_path2d_t *path,
+    float x, float y, float radius_x, float radius_y,
+    float rotation, float start_angle, float end_angle,
+    int counter_clockwise);
+void ci_path2d_rectangle(ci_path2d_t *path,
+    float x, float y, float width, float height);
+void ci_path2d_round_rectangle(ci_path2d_t *path,
+    float x, float y, float width, float height,
+    float const *radii, int radii_count);
+void ci_canvas_fill_path(ci_canvas_t *ctx, ci_path2d_t *path);
+void ci_canvas_stroke_path(ci_canvas_t *ctx, ci_path2d_t *path);
+
 void ci_canvas_clear_rectangle(ci_canvas_t *ctx,
     float x, float y, float width, float height);
 void ci_canvas_fill_rectangle(ci_canvas_t *ctx,
@@ -306,11 +563,32 @@ void ci_canvas_stroke_rectangle(ci_canvas_t *ctx,
 
 int ci_canvas_set_font(ci_canvas_t *ctx,
     unsigned char const *font, int bytes, float size);
+ci_font_t *ci_font_create(unsigned char const *font, int bytes);
+ci_font_t *ci_font_create_borrowed(unsigned char const *font, int bytes);
+#if defined(CANVAS_ITY_MMAP)
+ci_font_t *ci_font_map_file(char const *path);
+#endif
+void ci_font_destroy(ci_font_t *font);
+int ci_canvas_set_font_object(ci_canvas_t *ctx,
+    ci_font_t const *font, float size);
+void ci_canvas_set_glyph_cache_limit(ci_canvas_t *ctx, int bytes);
 void ci_canvas_fill_text(ci_canvas_t *ctx, char const *text,
     float x, float y, float maximum_width);
 void ci_canvas_stroke_text(ci_canvas_t *ctx, char const *text,
     float x, float y, float maximum_width);
+void ci_canvas_fill_text_batch(ci_canvas_t *ctx,
+    char const *const *texts, float const *positions, int count);
 float ci_canvas_measure_text(ci_canvas_t *ctx, char const *text);
+ci_text_layout_t *ci_text_layout_create(ci_font_t const *font,
+    float size, char const *text);
+void ci_text_layout_destroy(ci_text_layout_t *layout);
+float ci_text_layout_measure(ci_text_layout_t const *layout);
+void ci_canvas_fill_text_layout(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, float x, float y,
+    float maximum_width);
+void ci_canvas_stroke_text_layout(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, float x, float y,
+    float maximum_width);
 
 void ci_canvas_draw_image(ci_canvas_t *ctx,
     unsigned char const *image, int width, int height, int stride,
@@ -335,6 +613,12 @@ void ci_canvas_restore(ci_canvas_t *ctx);
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(CANVAS_ITY_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* ======== MATH HELPERS (C89 lacks float math functions) ======== */
 
@@ -441,6 +725,14 @@ CI_ARRAY_IMPL(ci_rgba_array, ci_rgba_t)
 CI_ARRAY_IMPL(ci_uchar_array, unsigned char)
 CI_ARRAY_IMPL(ci_subpath_array, ci_subpath_data_t)
 CI_ARRAY_IMPL(ci_run_array, ci_pixel_run_t)
+CI_ARRAY_IMPL(ci_size_array, size_t)
+CI_ARRAY_IMPL(ci_int_array, int)
+CI_ARRAY_IMPL(ci_cmap_range_array, ci_cmap_range_t)
+CI_ARRAY_IMPL(ci_kern_pair_array, ci_kern_pair_t)
+CI_ARRAY_IMPL(ci_kern_class_array, ci_kern_class_t)
+CI_ARRAY_IMPL(ci_shadow_mask_array, ci_shadow_mask_t)
+CI_ARRAY_IMPL(ci_glyph_outline_array, ci_glyph_outline_t)
+CI_ARRAY_IMPL(ci_glyph_runs_array, ci_glyph_runs_t)
 
 #if defined(__GNUC__)
 #pragma GCC diagnostic pop
@@ -615,20 +907,58 @@ static void ci_paint_brush_copy(ci_paint_brush_t *dst,
     ci_float_array_copy(&dst->stops, &src->stops);
 }
 
+/* Swap a brush's borrowed arrays for a copy, or for empty ones when
+   the brush is about to be replaced. */
+static void ci_paint_brush_unshare(ci_paint_brush_t *b, int keep) {
+    ci_paint_brush_t shared = *b;
+    if (keep)
+        ci_paint_brush_copy(b, &shared);
+    else {
+        ci_rgba_array_init(&b->colors);
+        ci_float_array_init(&b->stops);
+    }
+}
+
 static void ci_font_face_init(ci_font_face_t *f) {
     memset(f, 0, sizeof(*f));
     ci_uchar_array_init(&f->data);
+    ci_int_array_init(&f->cmap_direct);
+    ci_cmap_range_array_init(&f->cmap_ranges);
+    ci_kern_pair_array_init(&f->kern_pairs);
+    ci_kern_class_array_init(&f->kern_classes);
+    ci_int_array_init(&f->kern_table);
 }
 
+/* Faces taken from a ci_font_t borrow its arrays and never free them.
+   Font data read in place has no capacity and is never ours to free. */
 static void ci_font_face_free(ci_font_face_t *f) {
-    ci_uchar_array_free(&f->data);
+    if (f->borrowed)
+        return;
+    if (f->data.capacity)
+        ci_uchar_array_free(&f->data);
+    ci_int_array_free(&f->cmap_direct);
+    ci_cmap_range_array_free(&f->cmap_ranges);
+    ci_kern_pair_array_free(&f->kern_pairs);
+    ci_kern_class_array_free(&f->kern_classes);
+    ci_int_array_free(&f->kern_table);
 }
 
 static void ci_font_face_copy(ci_font_face_t *dst,
         const ci_font_face_t *src) {
     *dst = *src;
+    dst->borrowed = 0;
     ci_uchar_array_init(&dst->data);
     ci_uchar_array_copy(&dst->data, &src->data);
+    ci_int_array_init(&dst->cmap_direct);
+    ci_int_array_copy(&dst->cmap_direct, &src->cmap_direct);
+    ci_cmap_range_array_init(&dst->cmap_ranges);
+    ci_cmap_range_array_copy(&dst->cmap_ranges, &src->cmap_ranges);
+    ci_kern_pair_array_init(&dst->kern_pairs);
+    ci_kern_pair_array_copy(&dst->kern_pairs, &src->kern_pairs);
+    ci_kern_class_array_init(&dst->kern_classes);
+    ci_kern_class_array_copy(&dst->kern_classes, &src->kern_classes);
+    ci_int_array_init(&dst->kern_table);
+    ci_int_array_copy(&dst->kern_table, &src->kern_table);
 }
 
 static void ci_line_path_init(ci_line_path_t *p) {
@@ -658,11 +988,14 @@ static void ci_line_path_copy(ci_line_path_t *dst,
 
 static void ci_bezier_path_init(ci_bezier_path_t *p) {
     ci_xy_array_init(&p->points);
+    ci_uchar_array_init(&p->kinds);
     ci_subpath_array_init(&p->subpaths);
+    p->version = 0;
 }
 
 static void ci_bezier_path_free(ci_bezier_path_t *p) {
     ci_xy_array_free(&p->points);
+    ci_uchar_array_free(&p->kinds);
     ci_subpath_array_free(&p->subpaths);
 }
 
@@ -670,28 +1003,37 @@ static void ci_bezier_path_free(ci_bezier_path_t *p) {
 /* ======== FORWARD DECLARATIONS ======== */
 
 static void ci_add_tessellation(ci_canvas_t *ctx, ci_xy_t p1, ci_xy_t c1,
-    ci_xy_t c2, ci_xy_t p2, float angular, int limit);
+    ci_xy_t c2, ci_xy_t p2, float angular);
 static void ci_add_bezier(ci_canvas_t *ctx, ci_xy_t p1, ci_xy_t c1,
     ci_xy_t c2, ci_xy_t p2, float angular);
 static void ci_path_to_lines(ci_canvas_t *ctx, int stroking);
 static void ci_add_glyph(ci_canvas_t *ctx, int glyph, float angular);
-static int ci_character_to_glyph(ci_canvas_t *ctx, char const *text,
-    int *index);
-static int ci_kern_pair_value(ci_canvas_t *ctx, int left, int right);
-static void ci_text_to_lines(ci_canvas_t *ctx, char const *text,
-    ci_xy_t position, float maximum_width, int stroking);
+static int ci_character_to_glyph(ci_font_face_t *face,
+    char const *text, int *index);
+static int ci_kern_pair_value(ci_font_face_t const *face,
+    int left, int right);
+static int ci_text_to_lines(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, ci_xy_t position,
+    float maximum_width, int stroking, int caching);
+static int ci_add_glyph_runs(ci_canvas_t *ctx, int glyph);
 static void ci_dash_lines(ci_canvas_t *ctx);
 static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
-    size_t ending, int closed);
+    size_t ending, int closed, ci_affine_matrix_t const *forward,
+    ci_affine_matrix_t const *inverse, float scale);
 static void ci_stroke_lines(ci_canvas_t *ctx);
 static void ci_add_runs(ci_canvas_t *ctx, ci_xy_t from, ci_xy_t to);
-static void ci_lines_to_runs(ci_canvas_t *ctx, ci_xy_t offset, int padding);
+static void ci_lines_to_runs(ci_canvas_t *ctx, ci_xy_t offset,
+    float scale, int padding);
 static ci_rgba_t ci_paint_pixel(ci_canvas_t *ctx, ci_xy_t point,
     ci_paint_brush_t const *brush);
-static void ci_render_shadow(ci_canvas_t *ctx,
+static float ci_paint_alpha(ci_canvas_t *ctx, ci_xy_t point,
     ci_paint_brush_t const *brush);
+static int ci_render_shadow(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush, int *shift_x, int *shift_y);
 static void ci_render_main(ci_canvas_t *ctx,
     ci_paint_brush_t const *brush);
+static void ci_render_runs(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush);
 static void ci_cpu_get_pixels(ci_canvas_t *ctx, unsigned char *image,
     int width, int height, int stride, int x, int y);
 static void ci_cpu_put_pixels(ci_canvas_t *ctx,
@@ -704,31 +1046,91 @@ static ci_backend_t const s_ci_cpu_backend = {
     ci_cpu_put_pixels
 };
 
+/* Whether drawing casts a shadow: it needs some opacity and either a
+   blur or an offset to be seen apart from the shape. */
+static int ci_shadow_visible(ci_canvas_t const *ctx)
+{
+    return ctx->shadow_color.a != 0.0f &&
+        (ctx->shadow_blur != 0.0f ||
+         ctx->shadow_offset_x != 0.0f ||
+         ctx->shadow_offset_y != 0.0f);
+}
+
 /* ======== TESSELLATION ======== */
 
+/* Most segments a single curve piece is ever flattened into. */
+#define CI_MAX_SEGMENTS (1 << 20)
+
+/* Angle with the given cosine, to within 1/10000 radian, from the
+   polynomial in Abramowitz and Stegun 4.4.45.  It is only used to
+   estimate segment counts, so it spares a call to acos(). */
+static float ci_estimate_acosf(float cosine)
+{
+    float x = ci_fabsf(CI_CLAMP(cosine, -1.0f, 1.0f));
+    float angle = ci_sqrtf(1.0f - x) * (1.5707288f + x * (-0.2121144f +
+        x * (0.0742610f - x * 0.0187293f)));
+    return cosine < 0.0f ? 3.14159265f - angle : angle;
+}
+
+/* Check that stepping along the curve in the given number of equal
+   parameter steps turns the tangent by no more than the angular limit
+   (a cosine) at any one step.  Where the tangent vanishes at an end,
+   the direction the curve leaves or arrives in is used instead. */
+static int ci_tessellation_turns(ci_xy_t cubic, ci_xy_t quadratic,
+    ci_xy_t linear, ci_xy_t leaving, ci_xy_t arriving,
+    int segments, float angular)
+{
+    float step = 1.0f / (float)segments;
+    ci_xy_t tangent = leaving, previous;
+    ci_xy_t delta = ci_xy_add(
+        ci_xy_scale(3.0f * step * step, cubic),
+        ci_xy_scale(2.0f * step, quadratic));
+    ci_xy_t delta_2 = ci_xy_scale(6.0f * step * step, cubic);
+    int index;
+    for (index = 0; index < segments; ++index) {
+        float lengths, turn;
+        previous = tangent;
+        linear = ci_xy_add(linear, delta);
+        delta = ci_xy_add(delta, delta_2);
+        tangent = index + 1 < segments ? linear : arriving;
+        lengths = ci_dot(previous, previous) * ci_dot(tangent, tangent);
+        turn = ci_dot(previous, tangent);
+        if (lengths != 0.0f &&
+            (angular < 0.0f ?
+             turn < 0.0f && turn * turn > angular * angular * lengths :
+             turn < 0.0f || turn * turn < angular * angular * lengths))
+            return 0;
+    }
+    return 1;
+}
+
+/* Flatten a curve piece without inflections into lines.  The number of
+   equal parameter steps comes up front from Wang's formula, so that the
+   lines stay within 0.125 pixels of the curve, and when stroking is also
+   raised until no step turns the tangent by more than the angular limit.
+   The points are then found by forward differencing.  Strokes also get
+   the inner control points of the first and last steps so that their
+   ends keep the exact tangents of the curve. */
 static void ci_add_tessellation(ci_canvas_t *ctx, ci_xy_t point_1,
     ci_xy_t control_1, ci_xy_t control_2, ci_xy_t point_2,
-    float angular, int limit)
+    float angular)
 {
-    float flatness = 0.125f * 0.125f;
     ci_xy_t edge_1 = ci_xy_sub(control_1, point_1);
     ci_xy_t edge_2 = ci_xy_sub(control_2, control_1);
     ci_xy_t edge_3 = ci_xy_sub(point_2, control_2);
-    ci_xy_t segment = ci_xy_sub(point_2, point_1);
+    ci_xy_t bend_1 = ci_xy_sub(edge_2, edge_1);
+    ci_xy_t bend_2 = ci_xy_sub(edge_3, edge_2);
+    ci_xy_t linear = ci_xy_scale(3.0f, edge_1);
+    ci_xy_t quadratic = ci_xy_scale(3.0f, bend_1);
+    ci_xy_t cubic = ci_xy_sub(bend_2, bend_1);
     float squared_1 = ci_dot(edge_1, edge_1);
     float squared_2 = ci_dot(edge_2, edge_2);
     float squared_3 = ci_dot(edge_3, edge_3);
-    float length_squared = CI_MAX(1.0e-4f, ci_dot(segment, segment));
-    float projection_1 = ci_dot(edge_1, segment) / length_squared;
-    float projection_2 = ci_dot(edge_3, segment) / length_squared;
-    float clamped_1 = CI_CLAMP(projection_1, 0.0f, 1.0f);
-    float clamped_2 = CI_CLAMP(projection_2, 0.0f, 1.0f);
-    ci_xy_t to_line_1 = ci_xy_sub(
-        ci_xy_add(point_1, ci_xy_scale(clamped_1, segment)), control_1);
-    ci_xy_t to_line_2 = ci_xy_sub(
-        ci_xy_sub(point_2, ci_xy_scale(clamped_2, segment)), control_2);
-    float cosine = 1.0f;
-    ci_xy_t left_1, middle, right_2, left_2, right_1, split;
+    float bend = CI_MAX(ci_dot(bend_1, bend_1), ci_dot(bend_2, bend_2));
+    float count = ci_ceilf(ci_sqrtf(6.0f * ci_sqrtf(bend)));
+    float step, cosine = 1.0f;
+    ci_xy_t point, delta, delta_2, delta_3, *out;
+    int segments, index;
     if (angular > -1.0f) {
         if (squared_1 * squared_3 != 0.0f)
             cosine = ci_dot(edge_1, edge_3) /
@@ -739,28 +1141,121 @@ static void ci_add_tessellation(ci_canvas_t *ctx, ci_xy_t point_1,
         else if (squared_2 * squared_3 != 0.0f)
             cosine = ci_dot(edge_2, edge_3) /
                 ci_sqrtf(squared_2 * squared_3);
+        count = CI_MAX(count, ci_ceilf(ci_estimate_acosf(cosine) /
+            ci_estimate_acosf(angular)));
+    }
+    segments = !(count < (float)CI_MAX_SEGMENTS) ? CI_MAX_SEGMENTS :
+        count < 1.0f ? 1 : (int)count;
+    if (angular > -1.0f)
+        while (segments < CI_MAX_SEGMENTS &&
+               !ci_tessellation_turns(cubic, quadratic, linear,
+                   squared_1 != 0.0f ? edge_1 :
+                   squared_2 != 0.0f ? edge_2 : edge_3,
+                   squared_3 != 0.0f ? edge_3 :
+                   squared_2 != 0.0f ? edge_2 : edge_1,
+                   segments, angular))
+            segments = CI_MIN(2 * segments, CI_MAX_SEGMENTS);
+    if (!ci_xy_array_ensure(&ctx->lines.points,
+            ctx->lines.points.size + (size_t)segments + 2))
+        return;
+    out = ctx->lines.points.data + ctx->lines.points.size;
+    step = 1.0f / (float)segments;
+    if (angular > -1.0f && squared_1 != 0.0f)
+        *out++ = ci_xy_add(point_1, ci_xy_scale(step, edge_1));
+    point = point_1;
+    delta = ci_xy_add(ci_xy_add(
+        ci_xy_scale(step * step * step, cubic),
+        ci_xy_scale(step * step, quadratic)),
+        ci_xy_scale(step, linear));
+    delta_3 = ci_xy_scale(6.0f * step * step * step, cubic);
+    delta_2 = ci_xy_add(delta_3,
+        ci_xy_scale(2.0f * step * step, quadratic));
+    for (index = 1; index < segments; ++index) {
+        point = ci_xy_add(point, delta);
+        delta = ci_xy_add(delta, delta_2);
+        delta_2 = ci_xy_add(delta_2, delta_3);
+        *out++ = point;
+    }
+    if (angular > -1.0f && squared_3 != 0.0f)
+        *out++ = ci_xy_sub(point_2, ci_xy_scale(step, edge_3));
+    *out++ = point_2;
+    ctx->lines.points.size = (size_t)(out - ctx->lines.points.data);
+}
+
+/* Flatten an elliptical arc, the points center + cos(t) axis_1 +
+   sin(t) axis_2 for t from the start angle through the sweep, straight
+   into lines.  The number of equal angle steps keeps the lines within
+   0.125 pixels of the arc given the sharpest curvature of the ellipse.
+   When stroking, the angular limit stands for the same tolerance on a
+   circle of half the line width, so the count is raised to keep the
+   outer edge of the stroke within it too; very thin ellipses are taken
+   as no thinner than 1/16, since the stroker treats their sharp ends as
+   joins rather than curves.  The points come from rotating the unit
+   vector by the step angle rather than calling cos() and sin() for each
+   one.  Strokes get points a third of a step along the tangent at
+   either end as for curves. */
+static void ci_add_arc(ci_canvas_t *ctx, ci_xy_t point_1, ci_xy_t center,
+    ci_xy_t axis_1, ci_xy_t axis_2, ci_xy_t angles, ci_xy_t point_2,
+    float angular)
+{
+    float squared_1 = ci_dot(axis_1, axis_1);
+    float squared_2 = ci_dot(axis_2, axis_2);
+    float cross = ci_dot(axis_1, axis_2);
+    float half = 0.5f * (squared_1 + squared_2);
+    float spread = ci_sqrtf(0.25f * (squared_1 - squared_2) *
+        (squared_1 - squared_2) + cross * cross);
+    float largest = ci_sqrtf(half + spread);
+    float smallest = ci_sqrtf(CI_MAX(half - spread, 0.0f));
+    float sweep = ci_fabsf(angles.y);
+    float bound = largest;
+    double cosine, sine, step_cosine, step_sine, rotated;
+    ci_xy_t tangent, *out;
+    float count, step;
+    int segments, index;
+    if (angular > -1.0f && largest > 0.0f) {
+        float turn = largest / CI_MAX(smallest, largest / 16.0f) /
+            ci_estimate_acosf(angular);
+        bound += turn * turn;
     }
-    if ((ci_dot(to_line_1, to_line_1) <= flatness &&
-         ci_dot(to_line_2, to_line_2) <= flatness &&
-         cosine >= angular) || !limit) {
-        if (angular > -1.0f && squared_1 != 0.0f)
-            ci_xy_array_push(&ctx->lines.points, control_1);
-        if (angular > -1.0f && squared_2 != 0.0f)
-            ci_xy_array_push(&ctx->lines.points, control_2);
-        if (angular == -1.0f || squared_3 != 0.0f)
-            ci_xy_array_push(&ctx->lines.points, point_2);
+    count = ci_ceilf(sweep * ci_sqrtf(bound));
+    segments = !(count < (float)CI_MAX_SEGMENTS) ? CI_MAX_SEGMENTS :
+        count < 1.0f ? 1 : (int)count;
+    if (!ci_xy_array_ensure(&ctx->lines.points,
+            ctx->lines.points.size + (size_t)segments + 2))
         return;
+    out = ctx->lines.points.data + ctx->lines.points.size;
+    step = angles.y / (float)segments;
+    cosine = cos((double)angles.x);
+    sine = sin((double)angles.x);
+    step_cosine = cos((double)step);
+    step_sine = sin((double)step);
+    if (angular > -1.0f) {
+        tangent = ci_xy_add(ci_xy_scale(-(float)sine, axis_1),
+            ci_xy_scale((float)cosine, axis_2));
+        if (ci_dot(tangent, tangent) != 0.0f)
+            *out++ = ci_xy_add(point_1,
+                ci_xy_scale(step / 3.0f, tangent));
     }
-    left_1 = ci_lerp_xy(point_1, control_1, 0.5f);
-    middle = ci_lerp_xy(control_1, control_2, 0.5f);
-    right_2 = ci_lerp_xy(control_2, point_2, 0.5f);
-    left_2 = ci_lerp_xy(left_1, middle, 0.5f);
-    right_1 = ci_lerp_xy(middle, right_2, 0.5f);
-    split = ci_lerp_xy(left_2, right_1, 0.5f);
-    ci_add_tessellation(ctx, point_1, left_1, left_2, split,
-        angular, limit - 1);
-    ci_add_tessellation(ctx, split, right_1, right_2, point_2,
-        angular, limit - 1);
+    for (index = 1; index < segments; ++index) {
+        rotated = cosine * step_cosine - sine * step_sine;
+        sine = sine * step_cosine + cosine * step_sine;
+        cosine = rotated;
+        *out++ = ci_xy_add(center, ci_xy_add(
+            ci_xy_scale((float)cosine, axis_1),
+            ci_xy_scale((float)sine, axis_2)));
+    }
+    if (angular > -1.0f) {
+        rotated = cosine * step_cosine - sine * step_sine;
+        sine = sine * step_cosine + cosine * step_sine;
+        cosine = rotated;
+        tangent = ci_xy_add(ci_xy_scale(-(float)sine, axis_1),
+            ci_xy_scale((float)cosine, axis_2));
+        if (ci_dot(tangent, tangent) != 0.0f)
+            *out++ = ci_xy_sub(point_2,
+                ci_xy_scale(step / 3.0f, tangent));
+    }
+    *out++ = point_2;
+    ctx->lines.points.size = (size_t)(out - ctx->lines.points.data);
 }
 
 /* ======== HIGH-LEVEL BEZIER TESSELLATION ======== */
@@ -850,47 +1345,390 @@ static void ci_add_bezier(ci_canvas_t *ctx, ci_xy_t point_1,
         sp2 = ci_lerp_xy(p4, p5, at[index + 1]);
         sc2 = ci_lerp_xy(p4, sp2, ratio);
         sc1 = ci_lerp_xy(p6, sc2, ratio);
-        ci_add_tessellation(ctx, split_point_1, sc1, sc2, sp2,
-            angular, 20);
+        ci_add_tessellation(ctx, split_point_1, sc1, sc2, sp2, angular);
         split_point_1 = sp2;
     }
 }
 
 /* ======== PATH TO LINES ======== */
 
-static void ci_path_to_lines(ci_canvas_t *ctx, int stroking)
+/* Maps a point through a transform, or leaves it as it is for none. */
+static ci_xy_t ci_affine_apply(ci_affine_matrix_t const *m, ci_xy_t v) {
+    return m ? ci_affine_mul(*m, v) : v;
+}
+
+/* Maps a direction through a transform, without its translation. */
+static ci_xy_t ci_affine_apply_vector(ci_affine_matrix_t const *m,
+    ci_xy_t v)
 {
+    return m ? ci_xy_make(m->a * v.x + m->c * v.y,
+                          m->b * v.x + m->d * v.y) : v;
+}
+
+/* Cosine of the largest turn allowed between flattened segments, or -1
+   for any turn when filling. */
+static float ci_flatten_angular(ci_canvas_t const *ctx, int stroking) {
     float ratio = 0.125f / CI_MAX(0.5f * ctx->line_width, 0.125f);
-    float angular = stroking ?
-        (ratio - 2.0f) * ratio * 2.0f + 1.0f : -1.0f;
+    return stroking ? (ratio - 2.0f) * ratio * 2.0f + 1.0f : -1.0f;
+}
+
+static void ci_bezier_to_lines(ci_canvas_t *ctx,
+    ci_bezier_path_t const *path, ci_affine_matrix_t const *transform,
+    float angular)
+{
+    ci_xy_t const *points = path->points.data;
+    unsigned char const *kinds = path->kinds.data;
     size_t index = 0;
     size_t ending = 0;
     size_t subpath;
     ci_xy_array_clear(&ctx->lines.points);
     ci_subpath_array_clear(&ctx->lines.subpaths);
-    for (subpath = 0; subpath < ctx->path.subpaths.size; ++subpath) {
+    for (subpath = 0; subpath < path->subpaths.size; ++subpath) {
         size_t first;
         ci_xy_t point_1;
-        ending += ctx->path.subpaths.data[subpath].count;
+        ending += path->subpaths.data[subpath].count;
         first = ctx->lines.points.size;
-        point_1 = ctx->path.points.data[index++];
+        point_1 = ci_affine_apply(transform, points[index++]);
         ci_xy_array_push(&ctx->lines.points, point_1);
-        for (; index < ending; index += 3) {
-            ci_xy_t c1 = ctx->path.points.data[index + 0];
-            ci_xy_t c2 = ctx->path.points.data[index + 1];
-            ci_xy_t p2 = ctx->path.points.data[index + 2];
-            ci_add_bezier(ctx, point_1, c1, c2, p2, angular);
-            point_1 = p2;
+        while (index < ending) {
+            ci_segment_kind kind = (ci_segment_kind)*kinds++;
+            if (kind == CI_SEGMENT_LINE) {
+                point_1 = ci_affine_apply(transform, points[index++]);
+                ci_xy_array_push(&ctx->lines.points, point_1);
+            } else if (kind == CI_SEGMENT_QUADRATIC) {
+                ci_xy_t control =
+                    ci_affine_apply(transform, points[index + 0]);
+                ci_xy_t p2 = ci_affine_apply(transform, points[index + 1]);
+                ci_add_bezier(ctx, point_1,
+                    ci_lerp_xy(point_1, control, 2.0f / 3.0f),
+                    ci_lerp_xy(p2, control, 2.0f / 3.0f), p2, angular);
+                point_1 = p2;
+                index += 2;
+            } else if (kind == CI_SEGMENT_CUBIC) {
+                ci_xy_t c1 = ci_affine_apply(transform, points[index + 0]);
+                ci_xy_t c2 = ci_affine_apply(transform, points[index + 1]);
+                ci_xy_t p2 = ci_affine_apply(transform, points[index + 2]);
+                ci_add_bezier(ctx, point_1, c1, c2, p2, angular);
+                point_1 = p2;
+                index += 3;
+            } else {
+                ci_xy_t center =
+                    ci_affine_apply(transform, points[index + 0]);
+                ci_xy_t axis_1 =
+                    ci_affine_apply_vector(transform, points[index + 1]);
+                ci_xy_t axis_2 =
+                    ci_affine_apply_vector(transform, points[index + 2]);
+                ci_xy_t p2 = ci_affine_apply(transform, points[index + 4]);
+                ci_add_arc(ctx, point_1, center, axis_1, axis_2,
+                    points[index + 3], p2, angular);
+                point_1 = p2;
+                index += 5;
+            }
         }
         ci_subpath_array_push(&ctx->lines.subpaths,
             ci_subpath_make(ctx->lines.points.size - first,
-                ctx->path.subpaths.data[subpath].closed));
+                path->subpaths.data[subpath].closed));
+    }
+}
+
+/* ======== FLATTEN CACHE ======== */
+
+/* Largest change in the linear part of the transform, relative to the
+   one the cached lines were flattened under, for which they are moved
+   into place instead of flattened again.  Their error from the curves
+   grows by at most about this fraction. */
+#define CI_FLATTEN_CACHE_TOLERANCE (1.0f / 64.0f)
+
+static void ci_flatten_cache_init(ci_flatten_cache_t *cache) {
+    ci_line_path_init(&cache->lines);
+    cache->valid = 0;
+    cache->seen = 0;
+}
+
+static void ci_flatten_cache_free(ci_flatten_cache_t *cache) {
+    ci_line_path_free(&cache->lines);
+    cache->valid = 0;
+}
+
+/* Finds the transform from the device space of the cached lines to the
+   one under the given forward transform, failing when it would scale,
+   skew or rotate them by too much. */
+static int ci_flatten_cache_delta(ci_flatten_cache_t const *cache,
+    ci_affine_matrix_t const *f, ci_affine_matrix_t *delta)
+{
+    ci_affine_matrix_t const *i = &cache->inverse;
+    delta->a = f->a * i->a + f->c * i->b;
+    delta->b = f->b * i->a + f->d * i->b;
+    delta->c = f->a * i->c + f->c * i->d;
+    delta->d = f->b * i->c + f->d * i->d;
+    delta->e = f->a * i->e + f->c * i->f + f->e;
+    delta->f = f->b * i->e + f->d * i->f + f->f;
+    return ci_fabsf(delta->a - 1.0f) <= CI_FLATTEN_CACHE_TOLERANCE &&
+        ci_fabsf(delta->b) <= CI_FLATTEN_CACHE_TOLERANCE &&
+        ci_fabsf(delta->c) <= CI_FLATTEN_CACHE_TOLERANCE &&
+        ci_fabsf(delta->d - 1.0f) <= CI_FLATTEN_CACHE_TOLERANCE;
+}
+
+/* Copies the cached lines into the canvas's lines when they were made
+   from this version of the path and are still close enough under the
+   transform, mapping them into place when it has moved.  Paths already
+   in device space pass no transform and only need the version to
+   match. */
+static int ci_flatten_cache_find(ci_canvas_t *ctx,
+    ci_flatten_cache_t const *cache, ci_bezier_path_t const *path,
+    ci_affine_matrix_t const *transform, float angular)
+{
+    ci_affine_matrix_t const *f = transform;
+    ci_affine_matrix_t delta;
+    size_t index;
+    if (!cache->valid || cache->version != path->version ||
+        cache->angular != angular)
+        return 0;
+    if (f && f->a == cache->forward.a && f->b == cache->forward.b &&
+        f->c == cache->forward.c && f->d == cache->forward.d &&
+        f->e == cache->forward.e && f->f == cache->forward.f)
+        f = NULL;
+    if (f && !ci_flatten_cache_delta(cache, f, &delta))
+        return 0;
+    if (!ci_xy_array_copy(&ctx->lines.points, &cache->lines.points) ||
+        !ci_subpath_array_copy(&ctx->lines.subpaths,
+            &cache->lines.subpaths))
+        return 0;
+    if (f)
+        for (index = 0; index < ctx->lines.points.size; ++index)
+            ctx->lines.points.data[index] =
+                ci_affine_mul(delta, ctx->lines.points.data[index]);
+    return 1;
+}
+
+/* Flattens a path into the canvas's lines, mapping it through the
+   transform if it is given, reusing and refreshing the cached lines.
+   Unless told to keep them at once, the lines are only copied into the
+   cache when the same version of the path is flattened a second time,
+   so that a path drawn once costs no copy. */
+static void ci_cached_path_to_lines(ci_canvas_t *ctx,
+    ci_bezier_path_t const *path, ci_affine_matrix_t const *transform,
+    ci_flatten_cache_t *cache, int stroking, int keep)
+{
+    float angular = ci_flatten_angular(ctx, stroking);
+    if (ci_flatten_cache_find(ctx, cache, path, transform, angular))
+        return;
+    ci_bezier_to_lines(ctx, path, transform, angular);
+    if (!keep && !(cache->seen && cache->version == path->version)) {
+        cache->valid = 0;
+        cache->seen = 1;
+        cache->version = path->version;
+        return;
+    }
+    cache->valid =
+        ci_xy_array_copy(&cache->lines.points, &ctx->lines.points) &&
+        ci_subpath_array_copy(&cache->lines.subpaths,
+            &ctx->lines.subpaths);
+    if (transform) {
+        cache->forward = *transform;
+        cache->inverse = ctx->inverse;
     }
+    cache->version = path->version;
+    cache->angular = angular;
 }
 
+/* The current path is kept flattened for filling and for stroking once
+   it is used twice, so that filling, clipping and hit testing it in turn
+   flatten it at most twice for each. */
+static void ci_path_to_lines(ci_canvas_t *ctx, int stroking)
+{
+    ci_cached_path_to_lines(ctx, &ctx->path, NULL,
+        &ctx->flattened[stroking != 0], stroking, 0);
+}
 
 /* ======== GLYPH RENDERING ======== */
 
+/* Default memory cap for decoded glyph outlines kept for reuse. */
+#define CI_GLYPH_CACHE_LIMIT (4 << 20)
+
+static void ci_glyph_outline_init(ci_glyph_outline_t *outline)
+{
+    ci_xy_array_init(&outline->points);
+    ci_uchar_array_init(&outline->on_curve);
+    ci_int_array_init(&outline->ends);
+}
+
+static void ci_glyph_outline_free(ci_glyph_outline_t *outline)
+{
+    ci_xy_array_free(&outline->points);
+    ci_uchar_array_free(&outline->on_curve);
+    ci_int_array_free(&outline->ends);
+}
+
+static size_t ci_glyph_outline_bytes(ci_glyph_outline_t const *outline)
+{
+    return sizeof(ci_glyph_outline_t) +
+        outline->points.capacity * sizeof(ci_xy_t) +
+        outline->on_curve.capacity +
+        outline->ends.capacity * sizeof(int);
+}
+
+static size_t ci_glyph_coverage_bytes(ci_glyph_cache_t const *cache)
+{
+    return cache->coverage.capacity * sizeof(ci_glyph_runs_t) +
+        cache->buckets.capacity * sizeof(int) +
+        cache->pool.capacity * sizeof(ci_pixel_run_t);
+}
+
+static void ci_glyph_coverage_clear(ci_glyph_cache_t *cache)
+{
+    ci_glyph_runs_array_free(&cache->coverage);
+    ci_int_array_free(&cache->buckets);
+    ci_run_array_free(&cache->pool);
+}
+
+/* Outlines and coverage runs share the memory cap.  When they are over
+   it together the coverage runs, which are many and small, are all
+   dropped at once, and then outlines are evicted least recently used
+   first. */
+static void ci_glyph_cache_evict(ci_glyph_cache_t *cache, size_t limit)
+{
+    if (cache->bytes + ci_glyph_coverage_bytes(cache) > limit)
+        ci_glyph_coverage_clear(cache);
+    while (cache->bytes > limit && cache->outlines.size) {
+        size_t oldest = 0, last = cache->outlines.size - 1, idx;
+        for (idx = 1; idx < cache->outlines.size; ++idx)
+            if (cache->outlines.data[idx].used <
+                cache->outlines.data[oldest].used)
+                oldest = idx;
+        cache->bytes -= ci_glyph_outline_bytes(
+            &cache->outlines.data[oldest]);
+        cache->index.data[cache->outlines.data[oldest].glyph] = 0;
+        ci_glyph_outline_free(&cache->outlines.data[oldest]);
+        if (oldest != last) {
+            cache->outlines.data[oldest] = cache->outlines.data[last];
+            cache->index.data[cache->outlines.data[oldest].glyph] =
+                (int)oldest + 1;
+        }
+        ci_glyph_outline_array_pop(&cache->outlines);
+    }
+}
+
+static void ci_glyph_cache_free(ci_glyph_cache_t *cache)
+{
+    ci_glyph_cache_evict(cache, 0);
+    ci_glyph_outline_array_free(&cache->outlines);
+    ci_int_array_free(&cache->index);
+    ci_glyph_outline_free(&cache->scratch);
+    ci_run_array_free(&cache->placed);
+}
+
+/* Keep the outline just decoded into the scratch space, evicting the
+   least recently used outlines to stay within the memory cap.  Returns
+   where the outline now lives. */
+static ci_glyph_outline_t *ci_glyph_cache_store(ci_glyph_cache_t *cache,
+    int glyph)
+{
+    ci_glyph_outline_t *outline;
+    size_t bytes = ci_glyph_outline_bytes(&cache->scratch);
+    if (glyph < 0 || glyph > 0xffff || bytes > cache->limit)
+        return &cache->scratch;
+    ci_glyph_cache_evict(cache, cache->limit - bytes);
+    if (((size_t)glyph >= cache->index.size &&
+         !ci_int_array_resize(&cache->index, (size_t)glyph + 1)) ||
+        !ci_glyph_outline_array_push(&cache->outlines, cache->scratch))
+        return &cache->scratch;
+    outline = &cache->outlines.data[cache->outlines.size - 1];
+    outline->glyph = glyph;
+    outline->used = ++cache->clock;
+    cache->index.data[glyph] = (int)cache->outlines.size;
+    cache->bytes += bytes;
+    ci_glyph_outline_init(&cache->scratch);
+    return outline;
+}
+
+/* Find the decoded points of a simple glyph with the given number of
+   contours at the given offset, decoding them on first use.  Returns
+   NULL if out of memory. */
+static ci_glyph_outline_t *ci_glyph_outline(ci_canvas_t *ctx,
+    int glyph, int offset, int contours)
+{
+    ci_glyph_cache_t *cache = &ctx->glyph_cache;
+    ci_glyph_outline_t *outline = &cache->scratch;
+    int hmetrics, left_side_bearing, x_min;
+    int points_count, instructions, flags_array, flags_size, x_size;
+    int x_array, y_array, x, y, flags, repeated, glyph_index;
+    int contour;
+    if (0 <= glyph && (size_t)glyph < cache->index.size &&
+        cache->index.data[glyph]) {
+        outline = &cache->outlines.data[cache->index.data[glyph] - 1];
+        outline->used = ++cache->clock;
+        return outline;
+    }
+    ci_xy_array_clear(&outline->points);
+    ci_uchar_array_clear(&outline->on_curve);
+    ci_int_array_clear(&outline->ends);
+
+    hmetrics = ci_unsigned_16(&ctx->face.data, ctx->face.hhea + 34);
+    left_side_bearing = glyph < hmetrics ?
+        ci_signed_16(&ctx->face.data, ctx->face.hmtx + glyph * 4 + 2) :
+        ci_signed_16(&ctx->face.data,
+            ctx->face.hmtx + hmetrics * 2 + glyph * 2);
+    x_min = ci_signed_16(&ctx->face.data, offset + 2);
+    points_count = ci_unsigned_16(&ctx->face.data,
+        offset + 8 + contours * 2) + 1;
+    instructions = ci_unsigned_16(&ctx->face.data,
+        offset + 10 + contours * 2);
+    flags_array = offset + 12 + contours * 2 + instructions;
+    flags_size = 0;
+    x_size = 0;
+    for (glyph_index = 0; glyph_index < points_count;) {
+        int fl = ci_unsigned_8(&ctx->face.data,
+            flags_array + flags_size++);
+        int rep = fl & 8 ? ci_unsigned_8(&ctx->face.data,
+            flags_array + flags_size++) + 1 : 1;
+        x_size += rep * (fl & 2 ? 1 : fl & 16 ? 0 : 2);
+        glyph_index += rep;
+    }
+    x_array = flags_array + flags_size;
+    y_array = x_array + x_size;
+    x = left_side_bearing - x_min;
+    y = 0;
+    flags = 0;
+    repeated = 0;
+    glyph_index = 0;
+    for (contour = 0; contour < contours; ++contour) {
+        int end_idx = ci_unsigned_16(&ctx->face.data,
+            offset + 10 + contour * 2);
+        if (!ci_int_array_push(&outline->ends, end_idx))
+            return NULL;
+        for (; glyph_index <= end_idx; ++glyph_index) {
+            unsigned char on_curve;
+            if (repeated)
+                --repeated;
+            else {
+                flags = ci_unsigned_8(&ctx->face.data, flags_array++);
+                if (flags & 8)
+                    repeated = ci_unsigned_8(
+                        &ctx->face.data, flags_array++);
+            }
+            if (flags & 2)
+                x += ci_unsigned_8(&ctx->face.data, x_array) *
+                    (flags & 16 ? 1 : -1);
+            else if (!(flags & 16))
+                x += ci_signed_16(&ctx->face.data, x_array);
+            if (flags & 4)
+                y += ci_unsigned_8(&ctx->face.data, y_array) *
+                    (flags & 32 ? 1 : -1);
+            else if (!(flags & 32))
+                y += ci_signed_16(&ctx->face.data, y_array);
+            x_array += flags & 2 ? 1 : flags & 16 ? 0 : 2;
+            y_array += flags & 4 ? 1 : flags & 32 ? 0 : 2;
+            on_curve = (unsigned char)(flags & 1);
+            if (!ci_xy_array_push(&outline->points,
+                    ci_xy_make((float)x, (float)y)) ||
+                !ci_uchar_array_push(&outline->on_curve, on_curve))
+                return NULL;
+        }
+    }
+    return ci_glyph_cache_store(cache, glyph);
+}
+
 static void ci_add_glyph(ci_canvas_t *ctx, int glyph, float angular)
 {
     int loc_format = ci_unsigned_16(&ctx->face.data,
@@ -904,10 +1742,8 @@ static void ci_add_glyph(ci_canvas_t *ctx, int glyph, float angular)
             ctx->face.loca + glyph * 4 + 4) :
         ci_unsigned_16(&ctx->face.data,
             ctx->face.loca + glyph * 2 + 2) * 2);
-    int contours, hmetrics, left_side_bearing, x_min;
-    int points_count, instructions, flags_array, flags_size, x_size;
-    int x_array, y_array, x, y, flags, repeated, glyph_index;
-    int contour;
+    ci_glyph_outline_t *outline;
+    int contours, glyph_index, contour;
     if (offset == next)
         return;
     contours = ci_signed_16(&ctx->face.data, offset);
@@ -949,69 +1785,22 @@ static void ci_add_glyph(ci_canvas_t *ctx, int glyph, float angular)
             if (!(fl & 32)) return;
         }
     }
-    hmetrics = ci_unsigned_16(&ctx->face.data, ctx->face.hhea + 34);
-    left_side_bearing = glyph < hmetrics ?
-        ci_signed_16(&ctx->face.data, ctx->face.hmtx + glyph * 4 + 2) :
-        ci_signed_16(&ctx->face.data,
-            ctx->face.hmtx + hmetrics * 2 + glyph * 2);
-    x_min = ci_signed_16(&ctx->face.data, offset + 2);
-    points_count = ci_unsigned_16(&ctx->face.data,
-        offset + 8 + contours * 2) + 1;
-    instructions = ci_unsigned_16(&ctx->face.data,
-        offset + 10 + contours * 2);
-    flags_array = offset + 12 + contours * 2 + instructions;
-    flags_size = 0;
-    x_size = 0;
-    for (glyph_index = 0; glyph_index < points_count;) {
-        int fl = ci_unsigned_8(&ctx->face.data,
-            flags_array + flags_size++);
-        int rep = fl & 8 ? ci_unsigned_8(&ctx->face.data,
-            flags_array + flags_size++) + 1 : 1;
-        x_size += rep * (fl & 2 ? 1 : fl & 16 ? 0 : 2);
-        glyph_index += rep;
-    }
-    x_array = flags_array + flags_size;
-    y_array = x_array + x_size;
-    x = left_side_bearing - x_min;
-    y = 0;
-    flags = 0;
-    repeated = 0;
+    outline = ci_glyph_outline(ctx, glyph, offset, contours);
+    if (!outline)
+        return;
     glyph_index = 0;
     for (contour = 0; contour < contours; ++contour) {
         int beginning = glyph_index;
-        int end_idx = ci_unsigned_16(&ctx->face.data,
-            offset + 10 + contour * 2);
+        int end_idx = outline->ends.data[contour];
         ci_xy_t begin_point = ci_xy_make(0.0f, 0.0f);
         int begin_on = 0;
         ci_xy_t end_point = ci_xy_make(0.0f, 0.0f);
         int end_on = 0;
         size_t first = ctx->lines.points.size;
         for (; glyph_index <= end_idx; ++glyph_index) {
-            ci_xy_t point;
-            int on_curve;
-            if (repeated)
-                --repeated;
-            else {
-                flags = ci_unsigned_8(&ctx->face.data, flags_array++);
-                if (flags & 8)
-                    repeated = ci_unsigned_8(
-                        &ctx->face.data, flags_array++);
-            }
-            if (flags & 2)
-                x += ci_unsigned_8(&ctx->face.data, x_array) *
-                    (flags & 16 ? 1 : -1);
-            else if (!(flags & 16))
-                x += ci_signed_16(&ctx->face.data, x_array);
-            if (flags & 4)
-                y += ci_unsigned_8(&ctx->face.data, y_array) *
-                    (flags & 32 ? 1 : -1);
-            else if (!(flags & 32))
-                y += ci_signed_16(&ctx->face.data, y_array);
-            x_array += flags & 2 ? 1 : flags & 16 ? 0 : 2;
-            y_array += flags & 4 ? 1 : flags & 32 ? 0 : 2;
-            point = ci_affine_mul(ctx->forward,
-                ci_xy_make((float)x, (float)y));
-            on_curve = flags & 1;
+            ci_xy_t point = ci_affine_mul(ctx->forward,
+                outline->points.data[glyph_index]);
+            int on_curve = outline->on_curve.data[glyph_index];
             if (glyph_index == beginning) {
                 begin_point = point;
                 begin_on = on_curve;
@@ -1068,87 +1857,148 @@ static void ci_add_glyph(ci_canvas_t *ctx, int glyph, float angular)
 
 /* ======== CHARACTER TO GLYPH ======== */
 
-static int ci_character_to_glyph(ci_canvas_t *ctx,
-    char const *text, int *index)
+/* Characters below this, which covers everything with a one or two byte
+   UTF-8 encoding, are looked up in a direct table built at load time. */
+#define CI_CMAP_DIRECT 0x800
+
+/* Find the glyph for a character among the ranges from the cmap.  Ranges
+   are usually sorted and disjoint and can be binary searched; if not,
+   they are scanned in font order and the first match wins, as they would
+   be in the font itself. */
+static int ci_cmap_range_glyph(ci_font_face_t *face, int codepoint)
 {
-    int bytes = ((text[*index] & 0x80) == 0x00 ? 1 :
-                 (text[*index] & 0xe0) == 0xc0 ? 2 :
-                 (text[*index] & 0xf0) == 0xe0 ? 3 :
-                 (text[*index] & 0xf8) == 0xf0 ? 4 : 0);
-    int masks[] = {0x0, 0x7f, 0x1f, 0x0f, 0x07};
-    int codepoint = bytes ? text[*index] & masks[bytes] : 0xfffd;
-    int tables, format_12, format_4, format_0, table;
-    ++(*index);
-    while (--bytes > 0)
-        if ((text[*index] & 0xc0) == 0x80)
-            codepoint = codepoint << 6 | (text[(*index)++] & 0x3f);
-        else {
-            codepoint = 0xfffd;
-            break;
+    ci_cmap_range_t const *range = NULL;
+    size_t low = 0, high = face->cmap_ranges.size;
+    if (face->cmap_sorted)
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            ci_cmap_range_t const *probe = &face->cmap_ranges.data[middle];
+            if (codepoint < probe->first)
+                high = middle;
+            else if (probe->last < codepoint)
+                low = middle + 1;
+            else {
+                range = probe;
+                break;
+            }
         }
-    if (codepoint == '\t' || codepoint == '\v' || codepoint == '\f' ||
-        codepoint == '\r' || codepoint == '\n')
-        codepoint = ' ';
-    tables = ci_unsigned_16(&ctx->face.data, ctx->face.cmap + 2);
-    format_12 = 0;
-    format_4 = 0;
-    format_0 = 0;
+    else
+        for (; low < high; ++low)
+            if (face->cmap_ranges.data[low].first <= codepoint &&
+                codepoint <= face->cmap_ranges.data[low].last) {
+                range = &face->cmap_ranges.data[low];
+                break;
+            }
+    if (!range)
+        return 0;
+    return range->kind == 0 ? codepoint + range->delta :
+        range->kind == 1 ? (codepoint + range->delta) & 0xffff :
+        ci_unsigned_16(&face->data, range->delta + codepoint * 2);
+}
+
+static void ci_cmap_add_range(ci_font_face_t *face,
+    int first, int last, int delta, int kind)
+{
+    ci_cmap_range_t range;
+    if (face->cmap_ranges.size &&
+        face->cmap_ranges.data[face->cmap_ranges.size - 1].last >= first)
+        face->cmap_sorted = 0;
+    range.first = first;
+    range.last = last;
+    range.delta = delta;
+    range.kind = kind;
+    ci_cmap_range_array_push(&face->cmap_ranges, range);
+}
+
+/* Parse the preferred cmap subtable of a newly loaded face once: a
+   format 12 table if there is one, else a format 4 or lastly a format 0
+   table.  Returns 0 if out of memory. */
+static int ci_font_face_map(ci_font_face_t *face)
+{
+    int tables = ci_unsigned_16(&face->data, face->cmap + 2);
+    int format_12 = 0, format_4 = 0, format_0 = 0;
+    int table, codepoint;
     for (table = 0; table < tables; ++table) {
-        int platform = ci_unsigned_16(&ctx->face.data,
-            ctx->face.cmap + table * 8 + 4);
-        int encoding = ci_unsigned_16(&ctx->face.data,
-            ctx->face.cmap + table * 8 + 6);
-        int off = ci_signed_32(&ctx->face.data,
-            ctx->face.cmap + table * 8 + 8);
-        int format = ci_unsigned_16(&ctx->face.data,
-            ctx->face.cmap + off);
+        int platform = ci_unsigned_16(&face->data,
+            face->cmap + table * 8 + 4);
+        int encoding = ci_unsigned_16(&face->data,
+            face->cmap + table * 8 + 6);
+        int off = ci_signed_32(&face->data,
+            face->cmap + table * 8 + 8);
+        int format = ci_unsigned_16(&face->data, face->cmap + off);
         if (platform == 3 && encoding == 10 && format == 12)
-            format_12 = ctx->face.cmap + off;
+            format_12 = face->cmap + off;
         else if (platform == 3 && encoding == 1 && format == 4)
-            format_4 = ctx->face.cmap + off;
+            format_4 = face->cmap + off;
         else if (format == 0)
-            format_0 = ctx->face.cmap + off;
+            format_0 = face->cmap + off;
     }
+    face->cmap_sorted = 1;
     if (format_12) {
-        int groups = ci_signed_32(&ctx->face.data, format_12 + 12);
+        int groups = ci_signed_32(&face->data, format_12 + 12);
         int group;
         for (group = 0; group < groups; ++group) {
-            int s = ci_signed_32(&ctx->face.data,
+            int s = ci_signed_32(&face->data,
                 format_12 + 16 + group * 12);
-            int e = ci_signed_32(&ctx->face.data,
+            int e = ci_signed_32(&face->data,
                 format_12 + 20 + group * 12);
-            int g = ci_signed_32(&ctx->face.data,
+            int g = ci_signed_32(&face->data,
                 format_12 + 24 + group * 12);
-            if (s <= codepoint && codepoint <= e)
-                return codepoint - s + g;
+            ci_cmap_add_range(face, s, e, g - s, 0);
         }
     } else if (format_4) {
-        int segments = ci_unsigned_16(&ctx->face.data,
-            format_4 + 6);
+        int segments = ci_unsigned_16(&face->data, format_4 + 6);
         int end_arr = format_4 + 14;
         int start_arr = end_arr + 2 + segments;
         int delta_arr = start_arr + segments;
         int range_arr = delta_arr + segments;
         int seg;
         for (seg = 0; seg < segments; seg += 2) {
-            int s = ci_unsigned_16(&ctx->face.data,
-                start_arr + seg);
-            int e = ci_unsigned_16(&ctx->face.data,
-                end_arr + seg);
-            int delta = ci_signed_16(&ctx->face.data,
-                delta_arr + seg);
-            int range = ci_unsigned_16(&ctx->face.data,
-                range_arr + seg);
-            if (s <= codepoint && codepoint <= e)
-                return range ?
-                    ci_unsigned_16(&ctx->face.data, range_arr +
-                        seg + (codepoint - s) * 2 + range) :
-                    (codepoint + delta) & 0xffff;
-        }
-    } else if (format_0 && 0 <= codepoint && codepoint < 256) {
-        return ci_unsigned_8(&ctx->face.data, format_0 + 6 + codepoint);
+            int s = ci_unsigned_16(&face->data, start_arr + seg);
+            int e = ci_unsigned_16(&face->data, end_arr + seg);
+            int delta = ci_signed_16(&face->data, delta_arr + seg);
+            int range = ci_unsigned_16(&face->data, range_arr + seg);
+            if (range)
+                ci_cmap_add_range(face, s, e,
+                    range_arr + seg + range - s * 2, 2);
+            else
+                ci_cmap_add_range(face, s, e, delta, 1);
+        }
     }
-    return 0;
+    if (!ci_int_array_resize(&face->cmap_direct, CI_CMAP_DIRECT))
+        return 0;
+    for (codepoint = 0; codepoint < CI_CMAP_DIRECT; ++codepoint)
+        face->cmap_direct.data[codepoint] =
+            format_12 || format_4 ?
+                ci_cmap_range_glyph(face, codepoint) :
+            format_0 && codepoint < 256 ?
+                ci_unsigned_8(&face->data, format_0 + 6 + codepoint) : 0;
+    return 1;
+}
+
+static int ci_character_to_glyph(ci_font_face_t *face,
+    char const *text, int *index)
+{
+    int bytes = ((text[*index] & 0x80) == 0x00 ? 1 :
+                 (text[*index] & 0xe0) == 0xc0 ? 2 :
+                 (text[*index] & 0xf0) == 0xe0 ? 3 :
+                 (text[*index] & 0xf8) == 0xf0 ? 4 : 0);
+    int masks[] = {0x0, 0x7f, 0x1f, 0x0f, 0x07};
+    int codepoint = bytes ? text[*index] & masks[bytes] : 0xfffd;
+    ++(*index);
+    while (--bytes > 0)
+        if ((text[*index] & 0xc0) == 0x80)
+            codepoint = codepoint << 6 | (text[(*index)++] & 0x3f);
+        else {
+            codepoint = 0xfffd;
+            break;
+        }
+    if (codepoint == '\t' || codepoint == '\v' || codepoint == '\f' ||
+        codepoint == '\r' || codepoint == '\n')
+        codepoint = ' ';
+    if (codepoint < (int)face->cmap_direct.size)
+        return face->cmap_direct.data[codepoint];
+    return ci_cmap_range_glyph(face, codepoint);
 }
 
 /* ======== GPOS PAIR POSITIONING ======== */
@@ -1233,17 +2083,42 @@ static int ci_gpos_class_value(ci_uchar_array_t *data, int offset,
     return 0;
 }
 
-static int ci_gpos_kern_value(ci_canvas_t *ctx, int left, int right)
+/* One past the largest glyph that a coverage table (or a class definition
+   table if classes is set) names; all glyphs from there on are uncovered
+   or in class 0. */
+static int ci_gpos_glyph_limit(ci_uchar_array_t *data, int offset,
+    int classes)
+{
+    int format = ci_unsigned_16(data, offset);
+    int limit = 0;
+    int count, index;
+    if (format == 1 && classes)
+        return ci_unsigned_16(data, offset + 2) +
+            ci_unsigned_16(data, offset + 4);
+    if (format != 1 && format != 2)
+        return 0;
+    count = ci_unsigned_16(data, offset + 2);
+    for (index = 0; index < count; ++index)
+        limit = CI_MAX(limit, 1 + (format == 1 ?
+            ci_unsigned_16(data, offset + 4 + index * 2) :
+            ci_unsigned_16(data, offset + 4 + index * 6 + 2)));
+    return limit;
+}
+
+/* Collect the pair adjustment subtables of the lookups under the kern
+   feature of the preferred script, in the order they apply. */
+static int ci_gpos_pair_subtables(ci_font_face_t *face,
+    ci_int_array_t *subtables)
 {
-    ci_uchar_array_t *d = &ctx->face.data;
+    ci_uchar_array_t *d = &face->data;
     int gpos, script_off, feat_off, lookup_off;
     int n_scripts, si, lang_sys, n_feat_idx, fi;
     int kern_feat, n_kern_lookups, li;
-    if (!ctx->face.gpos)
-        return 0;
-    gpos = ctx->face.gpos;
+    if (!face->gpos)
+        return 1;
+    gpos = face->gpos;
     if (ci_unsigned_16(d, gpos) != 1)
-        return 0;
+        return 1;
     script_off = gpos + ci_unsigned_16(d, gpos + 4);
     feat_off = gpos + ci_unsigned_16(d, gpos + 6);
     lookup_off = gpos + ci_unsigned_16(d, gpos + 8);
@@ -1268,7 +2143,7 @@ static int ci_gpos_kern_value(ci_canvas_t *ctx, int left, int right)
             lang_sys = scr + def_lang;
     }
     if (!lang_sys)
-        return 0;
+        return 1;
     /* find 'kern' feature index in langsys */
     kern_feat = -1;
     n_feat_idx = ci_unsigned_16(d, lang_sys + 4);
@@ -1282,7 +2157,7 @@ static int ci_gpos_kern_value(ci_canvas_t *ctx, int left, int right)
         }
     }
     if (kern_feat < 0)
-        return 0;
+        return 1;
     /* read kern feature's lookup indices */
     {
         int feat_table = feat_off +
@@ -1307,96 +2182,109 @@ static int ci_gpos_kern_value(ci_canvas_t *ctx, int left, int right)
             for (subi = 0; subi < n_sub; ++subi) {
                 int sub_off = lookup +
                     ci_unsigned_16(d, lookup + 6 + subi * 2);
-                int pos_fmt, cov_off, vf1, vf2, cov_idx;
-                int vr1_size, vr2_size;
                 /* resolve extension subtables */
                 if (ci_unsigned_16(d, lookup) == 9) {
                     int ext_off = ci_signed_32(d, sub_off + 4);
                     sub_off = sub_off + ext_off;
                 }
-                pos_fmt = ci_unsigned_16(d, sub_off);
-                cov_off = sub_off +
-                    ci_unsigned_16(d, sub_off + 2);
-                vf1 = ci_unsigned_16(d, sub_off + 4);
-                vf2 = ci_unsigned_16(d, sub_off + 6);
-                vr1_size = ci_gpos_value_size(vf1);
-                vr2_size = ci_gpos_value_size(vf2);
-                cov_idx = ci_gpos_coverage_index(d,
-                    cov_off, left);
-                if (cov_idx < 0)
-                    continue;
-                if (pos_fmt == 1) {
-                    /* format 1: individual pairs */
-                    int ps_off = sub_off +
-                        ci_unsigned_16(d,
-                            sub_off + 10 + cov_idx * 2);
-                    int n_pv = ci_unsigned_16(d, ps_off);
-                    int rec_size = 2 + vr1_size + vr2_size;
-                    int lo = 0;
-                    int hi = n_pv - 1;
-                    while (lo <= hi) {
-                        int mid = (lo + hi) / 2;
-                        int pr = ps_off + 2 + mid * rec_size;
-                        int sg = ci_unsigned_16(d, pr);
-                        if (sg == right)
-                            return ci_gpos_xadvance(d,
-                                pr + 2, vf1);
-                        if (sg < right) lo = mid + 1;
-                        else hi = mid - 1;
-                    }
-                } else if (pos_fmt == 2) {
-                    /* format 2: class-based pairs */
-                    int cd1_off = sub_off +
-                        ci_unsigned_16(d, sub_off + 8);
-                    int cd2_off = sub_off +
-                        ci_unsigned_16(d, sub_off + 10);
-                    int c1_count = ci_unsigned_16(d,
-                        sub_off + 12);
-                    int c2_count = ci_unsigned_16(d,
-                        sub_off + 14);
-                    int c1 = ci_gpos_class_value(d,
-                        cd1_off, left);
-                    int c2 = ci_gpos_class_value(d,
-                        cd2_off, right);
-                    int row_size =
-                        c2_count * (vr1_size + vr2_size);
-                    int rec_off;
-                    int val;
-                    if (c1 >= c1_count || c2 >= c2_count)
-                        continue;
-                    rec_off = sub_off + 16 +
-                        c1 * row_size +
-                        c2 * (vr1_size + vr2_size);
-                    val = ci_gpos_xadvance(d, rec_off, vf1);
-                    if (val != 0)
-                        return val;
-                }
+                if (!ci_int_array_push(subtables, sub_off))
+                    return 0;
             }
         }
     }
+    return 1;
+}
+
+static int ci_gpos_kern_value(ci_font_face_t *face,
+    ci_int_array_t const *subtables, int left, int right)
+{
+    ci_uchar_array_t *d = &face->data;
+    size_t subi;
+    for (subi = 0; subi < subtables->size; ++subi) {
+        int sub_off = subtables->data[subi];
+        int pos_fmt, cov_off, vf1, vf2, cov_idx;
+        int vr1_size, vr2_size;
+        pos_fmt = ci_unsigned_16(d, sub_off);
+        cov_off = sub_off +
+            ci_unsigned_16(d, sub_off + 2);
+        vf1 = ci_unsigned_16(d, sub_off + 4);
+        vf2 = ci_unsigned_16(d, sub_off + 6);
+        vr1_size = ci_gpos_value_size(vf1);
+        vr2_size = ci_gpos_value_size(vf2);
+        cov_idx = ci_gpos_coverage_index(d,
+            cov_off, left);
+        if (cov_idx < 0)
+            continue;
+        if (pos_fmt == 1) {
+            /* format 1: individual pairs */
+            int ps_off = sub_off +
+                ci_unsigned_16(d,
+                    sub_off + 10 + cov_idx * 2);
+            int n_pv = ci_unsigned_16(d, ps_off);
+            int rec_size = 2 + vr1_size + vr2_size;
+            int lo = 0;
+            int hi = n_pv - 1;
+            while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                int pr = ps_off + 2 + mid * rec_size;
+                int sg = ci_unsigned_16(d, pr);
+                if (sg == right)
+                    return ci_gpos_xadvance(d,
+                        pr + 2, vf1);
+                if (sg < right) lo = mid + 1;
+                else hi = mid - 1;
+            }
+        } else if (pos_fmt == 2) {
+            /* format 2: class-based pairs */
+            int cd1_off = sub_off +
+                ci_unsigned_16(d, sub_off + 8);
+            int cd2_off = sub_off +
+                ci_unsigned_16(d, sub_off + 10);
+            int c1_count = ci_unsigned_16(d,
+                sub_off + 12);
+            int c2_count = ci_unsigned_16(d,
+                sub_off + 14);
+            int c1 = ci_gpos_class_value(d,
+                cd1_off, left);
+            int c2 = ci_gpos_class_value(d,
+                cd2_off, right);
+            int row_size =
+                c2_count * (vr1_size + vr2_size);
+            int rec_off;
+            int val;
+            if (c1 >= c1_count || c2 >= c2_count)
+                continue;
+            rec_off = sub_off + 16 +
+                c1 * row_size +
+                c2 * (vr1_size + vr2_size);
+            val = ci_gpos_xadvance(d, rec_off, vf1);
+            if (val != 0)
+                return val;
+        }
+    }
     return 0;
 }
 
 /* ======== KERN PAIR LOOKUP ======== */
 
-static int ci_kern_pair_value(ci_canvas_t *ctx, int left, int right)
+/* Look up a pair in the legacy kern table, or if candidates is given,
+   list every pair that the table could adjust there instead, returning
+   -1 if out of memory. */
+static int ci_kern_table_value(ci_font_face_t *face, int left, int right,
+    ci_kern_pair_array_t *candidates)
 {
     int offset, version, n_tables, table, result;
-    /* GPOS takes precedence over legacy kern table */
-    result = ci_gpos_kern_value(ctx, left, right);
-    if (result != 0)
-        return result;
-    if (!ctx->face.kern)
+    if (!face->kern)
         return 0;
-    offset = ctx->face.kern;
-    version = ci_unsigned_16(&ctx->face.data, offset);
+    offset = face->kern;
+    version = ci_unsigned_16(&face->data, offset);
     if (version == 0) {
         /* Microsoft kern table version 0 */
-        n_tables = ci_unsigned_16(&ctx->face.data, offset + 2);
+        n_tables = ci_unsigned_16(&face->data, offset + 2);
         offset += 4;
     } else if (version == 1) {
         /* Apple AAT kern table version 1 (0x00010000) */
-        n_tables = ci_signed_32(&ctx->face.data, offset + 4);
+        n_tables = ci_signed_32(&face->data, offset + 4);
         offset += 8;
     } else {
         return 0;
@@ -1407,21 +2295,34 @@ static int ci_kern_pair_value(ci_canvas_t *ctx, int left, int right)
         int lo, hi;
         unsigned long key;
         if (version == 0) {
-            length = ci_unsigned_16(&ctx->face.data, offset + 2);
-            cov_raw = ci_unsigned_16(&ctx->face.data, offset + 4);
+            length = ci_unsigned_16(&face->data, offset + 2);
+            cov_raw = ci_unsigned_16(&face->data, offset + 4);
             format = cov_raw >> 8;
             coverage = cov_raw & 0xFF;
-            n_pairs = ci_unsigned_16(&ctx->face.data, offset + 6);
+            n_pairs = ci_unsigned_16(&face->data, offset + 6);
             pairs_off = offset + 14;
         } else {
-            length = ci_signed_32(&ctx->face.data, offset);
-            cov_raw = ci_unsigned_16(&ctx->face.data, offset + 4);
+            length = ci_signed_32(&face->data, offset);
+            cov_raw = ci_unsigned_16(&face->data, offset + 4);
             format = cov_raw & 0xFF;
             coverage = cov_raw >> 8;
-            n_pairs = ci_unsigned_16(&ctx->face.data, offset + 8);
+            n_pairs = ci_unsigned_16(&face->data, offset + 8);
             pairs_off = offset + 16;
         }
-        if (format == 0 && (coverage & 1) && !(coverage & 4)) {
+        if (format == 0 && (coverage & 1) && !(coverage & 4) &&
+            candidates) {
+            int pair;
+            for (pair = 0; pair < n_pairs; ++pair) {
+                ci_kern_pair_t entry;
+                entry.left = ci_unsigned_16(&face->data,
+                    pairs_off + pair * 6);
+                entry.right = ci_unsigned_16(&face->data,
+                    pairs_off + pair * 6 + 2);
+                entry.value = 0;
+                if (!ci_kern_pair_array_push(candidates, entry))
+                    return -1;
+            }
+        } else if (format == 0 && (coverage & 1) && !(coverage & 4)) {
             lo = 0;
             hi = n_pairs - 1;
             key = ((unsigned long)left << 16) | (unsigned long)right;
@@ -1430,12 +2331,12 @@ static int ci_kern_pair_value(ci_canvas_t *ctx, int left, int right)
                 int pair_off = pairs_off + mid * 6;
                 unsigned long pair_key =
                     ((unsigned long)ci_unsigned_16(
-                        &ctx->face.data, pair_off) << 16) |
+                        &face->data, pair_off) << 16) |
                     (unsigned long)ci_unsigned_16(
-                        &ctx->face.data, pair_off + 2);
+                        &face->data, pair_off + 2);
                 if (pair_key == key) {
                     int value = ci_signed_16(
-                        &ctx->face.data, pair_off + 4);
+                        &face->data, pair_off + 4);
                     if (coverage & 8)
                         result = value;
                     else
@@ -1453,32 +2354,234 @@ static int ci_kern_pair_value(ci_canvas_t *ctx, int left, int right)
     return result;
 }
 
+/* Mix a glyph pair into a 32-bit hash for the pair table. */
+static unsigned long ci_kern_pair_hash(int left, int right)
+{
+    unsigned long hash = ((unsigned long)left * 0x45d9f3bUL +
+        (unsigned long)right) & 0xffffffffUL;
+    hash = (hash ^ hash >> 16) * 0x45d9f3bUL & 0xffffffffUL;
+    return hash ^ hash >> 16;
+}
+
+/* Expand one class-based pair adjustment subtable into a dense matrix. */
+static int ci_kern_add_classes(ci_font_face_t *face, int sub_off)
+{
+    ci_uchar_array_t *d = &face->data;
+    int cov_off = sub_off + ci_unsigned_16(d, sub_off + 2);
+    int vf1 = ci_unsigned_16(d, sub_off + 4);
+    int record = ci_gpos_value_size(vf1) +
+        ci_gpos_value_size(ci_unsigned_16(d, sub_off + 6));
+    int cd1_off = sub_off + ci_unsigned_16(d, sub_off + 8);
+    int cd2_off = sub_off + ci_unsigned_16(d, sub_off + 10);
+    int rows = ci_unsigned_16(d, sub_off + 12);
+    int glyph, row, column;
+    int *table;
+    ci_kern_class_t matrix;
+    matrix.columns = ci_unsigned_16(d, sub_off + 14);
+    if (!(vf1 & 0x0004) || !rows || !matrix.columns)
+        return 1;
+    matrix.lefts = ci_gpos_glyph_limit(d, cov_off, 0);
+    matrix.rights = ci_gpos_glyph_limit(d, cd2_off, 1);
+    matrix.left = face->kern_table.size;
+    matrix.right = matrix.left + (size_t)matrix.lefts;
+    matrix.values = matrix.right + (size_t)matrix.rights;
+    if (!ci_int_array_resize(&face->kern_table,
+            matrix.values + (size_t)rows * (size_t)matrix.columns) ||
+        !ci_kern_class_array_push(&face->kern_classes, matrix))
+        return 0;
+    table = face->kern_table.data;
+    for (glyph = 0; glyph < matrix.lefts; ++glyph) {
+        int value = ci_gpos_coverage_index(d, cov_off, glyph) < 0 ? -1 :
+            ci_gpos_class_value(d, cd1_off, glyph);
+        table[matrix.left + glyph] = value < rows ? value : -1;
+    }
+    for (glyph = 0; glyph < matrix.rights; ++glyph) {
+        int value = ci_gpos_class_value(d, cd2_off, glyph);
+        table[matrix.right + glyph] = value < matrix.columns ? value : -1;
+    }
+    for (row = 0; row < rows; ++row)
+        for (column = 0; column < matrix.columns; ++column)
+            table[matrix.values + (size_t)row * matrix.columns + column] =
+                ci_gpos_xadvance(d, sub_off + 16 +
+                    (row * matrix.columns + column) * record, vf1);
+    return 1;
+}
+
+/* Resolve the kerning of a newly loaded face once.  Every pair named by
+   an individual pair adjustment subtable or by the kern table goes into a
+   hash table with its final value.  Class-based subtables become dense
+   class matrices, which then only need to be consulted for pairs missing
+   from the hash table.  Returns 0 if out of memory. */
+static int ci_font_face_kern(ci_font_face_t *face)
+{
+    ci_uchar_array_t *d = &face->data;
+    ci_int_array_t subtables;
+    ci_kern_pair_array_t candidates;
+    size_t index, slots;
+    int ok;
+    ci_int_array_init(&subtables);
+    ci_kern_pair_array_init(&candidates);
+    ok = ci_gpos_pair_subtables(face, &subtables);
+    for (index = 0; ok && index < subtables.size; ++index) {
+        int sub_off = subtables.data[index];
+        int cov_off = sub_off + ci_unsigned_16(d, sub_off + 2);
+        int record = 2 + ci_gpos_value_size(ci_unsigned_16(d, sub_off + 4)) +
+            ci_gpos_value_size(ci_unsigned_16(d, sub_off + 6));
+        int lefts = ci_gpos_glyph_limit(d, cov_off, 0);
+        int glyph, pair;
+        if (ci_unsigned_16(d, sub_off) == 2)
+            ok = ci_kern_add_classes(face, sub_off);
+        else if (ci_unsigned_16(d, sub_off) == 1)
+            for (glyph = 0; ok && glyph < lefts; ++glyph) {
+                int cov_idx = ci_gpos_coverage_index(d, cov_off, glyph);
+                int ps_off = sub_off + (cov_idx < 0 ? 0 :
+                    ci_unsigned_16(d, sub_off + 10 + cov_idx * 2));
+                int pairs = cov_idx < 0 ? 0 : ci_unsigned_16(d, ps_off);
+                for (pair = 0; ok && pair < pairs; ++pair) {
+                    ci_kern_pair_t entry;
+                    entry.left = glyph;
+                    entry.right = ci_unsigned_16(d,
+                        ps_off + 2 + pair * record);
+                    entry.value = 0;
+                    ok = ci_kern_pair_array_push(&candidates, entry);
+                }
+            }
+    }
+    if (ok && ci_kern_table_value(face, 0, 0, &candidates) < 0)
+        ok = 0;
+    for (slots = candidates.size ? 1 : 0; slots < candidates.size * 2; )
+        slots *= 2;
+    if (ok && !ci_kern_pair_array_resize(&face->kern_pairs, slots))
+        ok = 0;
+    for (index = 0; ok && index < slots; ++index)
+        face->kern_pairs.data[index].left = -1;
+    for (index = 0; ok && index < candidates.size; ++index) {
+        ci_kern_pair_t entry = candidates.data[index];
+        size_t slot = ci_kern_pair_hash(entry.left, entry.right) &
+            (slots - 1);
+        while (face->kern_pairs.data[slot].left >= 0 &&
+               (face->kern_pairs.data[slot].left != entry.left ||
+                face->kern_pairs.data[slot].right != entry.right))
+            slot = (slot + 1) & (slots - 1);
+        if (face->kern_pairs.data[slot].left >= 0)
+            continue;
+        entry.value = ci_gpos_kern_value(face, &subtables,
+            entry.left, entry.right);
+        if (!entry.value)
+            entry.value = ci_kern_table_value(face,
+                entry.left, entry.right, NULL);
+        face->kern_pairs.data[slot] = entry;
+    }
+    ci_int_array_free(&subtables);
+    ci_kern_pair_array_free(&candidates);
+    return ok;
+}
+
+static int ci_kern_pair_value(ci_font_face_t const *face,
+    int left, int right)
+{
+    size_t index;
+    if (face->kern_pairs.size) {
+        size_t mask = face->kern_pairs.size - 1;
+        for (index = ci_kern_pair_hash(left, right) & mask;
+             face->kern_pairs.data[index].left >= 0;
+             index = (index + 1) & mask)
+            if (face->kern_pairs.data[index].left == left &&
+                face->kern_pairs.data[index].right == right)
+                return face->kern_pairs.data[index].value;
+    }
+    for (index = 0; index < face->kern_classes.size; ++index) {
+        ci_kern_class_t const *matrix = &face->kern_classes.data[index];
+        int const *table = face->kern_table.data;
+        int row = left >= 0 && left < matrix->lefts ?
+            table[matrix->left + left] : -1;
+        int column = right >= 0 && right < matrix->rights ?
+            table[matrix->right + right] : 0;
+        int value;
+        if (row < 0 || column < 0)
+            continue;
+        value = table[matrix->values + (size_t)row * matrix->columns +
+            column];
+        if (value)
+            return value;
+    }
+    return 0;
+}
+
 /* ======== TEXT TO LINES ======== */
 
-static void ci_text_to_lines(ci_canvas_t *ctx, char const *text,
-    ci_xy_t position, float maximum_width, int stroking)
+/* Map each character of the text to its glyph with the face and place
+   it after the kerned advances of those before it.  Returns 0 if out of
+   memory. */
+static int ci_shape_text(ci_font_face_t *face, char const *text,
+    ci_text_layout_t *layout)
 {
-    float ratio = 0.125f / CI_MAX(0.5f * ctx->line_width, 0.125f);
-    float angular = stroking ?
-        (ratio - 2.0f) * ratio * 2.0f + 1.0f : -1.0f;
+    int hmetrics = ci_unsigned_16(&face->data, face->hhea + 34);
+    int index, place, prev_glyph;
+    ci_int_array_clear(&layout->glyphs);
+    ci_int_array_clear(&layout->places);
+    layout->font = face->data.data;
+    layout->scale = face->scale;
+    place = 0;
+    prev_glyph = -1;
+    for (index = 0; text[index];) {
+        int glyph = ci_character_to_glyph(face, text, &index);
+        int entry = CI_MIN(glyph, hmetrics - 1);
+        if (prev_glyph >= 0)
+            place += ci_kern_pair_value(face, prev_glyph, glyph);
+        if (!ci_int_array_push(&layout->glyphs, glyph) ||
+            !ci_int_array_push(&layout->places, place))
+            return 0;
+        place += ci_unsigned_16(&face->data, face->hmtx + entry * 4);
+        prev_glyph = glyph;
+    }
+    return ci_int_array_push(&layout->places, place);
+}
+
+/* Shape the text with the current font into the canvas's own layout.
+   Returns NULL if there is nothing to draw. */
+static ci_text_layout_t const *ci_canvas_shape(ci_canvas_t *ctx,
+    char const *text)
+{
+    if (ctx->face.data.size == 0 || !text ||
+        !ci_shape_text(&ctx->face, text, &ctx->shaped))
+        return NULL;
+    return &ctx->shaped;
+}
+
+/* Start laying out text, dropping any lines or placed runs left over. */
+static void ci_text_begin(ci_canvas_t *ctx)
+{
+    ci_xy_array_clear(&ctx->lines.points);
+    ci_subpath_array_clear(&ctx->lines.subpaths);
+    ci_run_array_clear(&ctx->glyph_cache.placed);
+}
+
+/* Add the glyphs of the shaped text to the lines.  When caching, the
+   coverage runs of each glyph are placed into the glyph cache instead;
+   this returns 0 if that fails for any of them.  A layout made with
+   another font than the current one draws nothing. */
+static int ci_text_to_lines(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, ci_xy_t position,
+    float maximum_width, int stroking, int caching)
+{
+    float angular = ci_flatten_angular(ctx, stroking);
     float width, reduction, units_per_em, ascender, descender;
     float normalize;
     ci_xy_t scaling;
     ci_affine_matrix_t saved_fwd, saved_inv;
-    int hmetrics, place, glyph_idx, prev_glyph;
-    ci_xy_array_clear(&ctx->lines.points);
-    ci_subpath_array_clear(&ctx->lines.subpaths);
-    if (ctx->face.data.size == 0 || !text || maximum_width <= 0.0f)
-        return;
-    width = (maximum_width == 1.0e30f &&
-        ctx->text_align == CI_ALIGN_LEFTWARD) ?
-        0.0f : ci_canvas_measure_text(ctx, text);
+    size_t index;
+    if (ctx->face.data.size == 0 || !layout ||
+        layout->font != ctx->face.data.data ||
+        !layout->places.size || maximum_width <= 0.0f)
+        return 1;
+    width = ci_text_layout_measure(layout);
     reduction = maximum_width / CI_MAX(maximum_width, width);
     if (ctx->text_align == CI_ALIGN_RIGHTWARD)
         position.x -= width * reduction;
     else if (ctx->text_align == CI_ALIGN_CENTER)
         position.x -= 0.5f * width * reduction;
-    scaling = ci_xy_mul(ci_xy_make(ctx->face.scale, ctx->face.scale),
+    scaling = ci_xy_mul(ci_xy_make(layout->scale, layout->scale),
         ci_xy_make(reduction, 1.0f));
     units_per_em = (float)ci_unsigned_16(&ctx->face.data,
         ctx->face.head + 18);
@@ -1486,7 +2589,7 @@ static void ci_text_to_lines(ci_canvas_t *ctx, char const *text,
         ctx->face.os_2 + 68);
     descender = (float)ci_signed_16(&ctx->face.data,
         ctx->face.os_2 + 70);
-    normalize = ctx->face.scale * units_per_em /
+    normalize = layout->scale * units_per_em /
         (ascender - descender);
     if (ctx->text_baseline == CI_BASELINE_TOP)
         position.y += ascender * normalize;
@@ -1495,33 +2598,47 @@ static void ci_text_to_lines(ci_canvas_t *ctx, char const *text,
     else if (ctx->text_baseline == CI_BASELINE_BOTTOM)
         position.y += descender * normalize;
     else if (ctx->text_baseline == CI_BASELINE_HANGING)
-        position.y += 0.6f * ctx->face.scale * units_per_em;
+        position.y += 0.6f * layout->scale * units_per_em;
     saved_fwd = ctx->forward;
     saved_inv = ctx->inverse;
-    hmetrics = ci_unsigned_16(&ctx->face.data, ctx->face.hhea + 34);
-    place = 0;
-    prev_glyph = -1;
-    for (glyph_idx = 0; text[glyph_idx];) {
-        int glyph = ci_character_to_glyph(ctx, text, &glyph_idx);
-        int entry;
-        if (prev_glyph >= 0)
-            place += ci_kern_pair_value(ctx, prev_glyph, glyph);
+    for (index = 0; index < layout->glyphs.size; ++index) {
+        int glyph = layout->glyphs.data[index];
         ctx->forward = saved_fwd;
         ci_canvas_transform(ctx, scaling.x, 0.0f, 0.0f, -scaling.y,
-            position.x + (float)place * scaling.x, position.y);
-        ci_add_glyph(ctx, glyph, angular);
-        entry = CI_MIN(glyph, hmetrics - 1);
-        place += ci_unsigned_16(&ctx->face.data,
-            ctx->face.hmtx + entry * 4);
-        prev_glyph = glyph;
+            position.x + (float)layout->places.data[index] * scaling.x,
+            position.y);
+        if (!caching)
+            ci_add_glyph(ctx, glyph, angular);
+        else if (!ci_add_glyph_runs(ctx, glyph)) {
+            ctx->forward = saved_fwd;
+            ctx->inverse = saved_inv;
+            return 0;
+        }
     }
     ctx->forward = saved_fwd;
     ctx->inverse = saved_inv;
+    return 1;
 }
 
 
 /* ======== DASH LINES ======== */
 
+static void ci_reverse_points(ci_xy_t *points, size_t count)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low + 1 < high) {
+        ci_xy_t swap = points[low];
+        points[low++] = points[--high];
+        points[high] = swap;
+    }
+}
+
+/* Split the lines into dashes.  Lengths are measured in user space, so
+   each point is mapped through the inverse once and carried over to
+   the next segment.  When a closed subpath starts and ends inside a
+   dash, the last dash is joined to the first by rotating it into place
+   with three reversals, which needs no extra buffer. */
 static void ci_dash_lines(ci_canvas_t *ctx)
 {
     float total = 0.0f;
@@ -1549,6 +2666,7 @@ static void ci_dash_lines(ci_canvas_t *ctx)
         size_t first, segment, merge_point, merge_subpath;
         int emit, merge_emit;
         float next_dash;
+        ci_xy_t user_from = ci_xy_make(0.0f, 0.0f);
         ending += ctx->scratch.subpaths.data[subpath].count;
         first = ctx->lines.points.size;
         segment = start;
@@ -1557,15 +2675,18 @@ static void ci_dash_lines(ci_canvas_t *ctx)
         merge_subpath = ctx->lines.subpaths.size;
         merge_emit = emit;
         next_dash = ctx->line_dash.data[start] - dash_offset;
+        if (index < ending)
+            user_from = ci_affine_mul(ctx->inverse,
+                ctx->scratch.points.data[index]);
         for (; index + 1 < ending; ++index) {
             ci_xy_t from = ctx->scratch.points.data[index];
             ci_xy_t to = ctx->scratch.points.data[index + 1];
+            ci_xy_t user_to = ci_affine_mul(ctx->inverse, to);
             float line_len;
             if (emit)
                 ci_xy_array_push(&ctx->lines.points, from);
-            line_len = ci_length(ci_xy_sub(
-                ci_affine_mul(ctx->inverse, to),
-                ci_affine_mul(ctx->inverse, from)));
+            line_len = ci_length(ci_xy_sub(user_to, user_from));
+            user_from = user_to;
             while (next_dash < line_len) {
                 ci_xy_array_push(&ctx->lines.points,
                     ci_lerp_xy(from, to, next_dash / line_len));
@@ -1595,25 +2716,11 @@ static void ci_dash_lines(ci_canvas_t *ctx)
                 } else {
                     size_t cnt = ctx->lines.subpaths.data[
                         ctx->lines.subpaths.size - 1].count;
-                    size_t rot_start = merge_point;
-                    size_t rot_mid = ctx->lines.points.size - cnt;
-                    size_t rot_end = ctx->lines.points.size;
-                    /* manual rotate: move last cnt elements to
-                       merge_point */
-                    size_t block = rot_end - rot_mid;
-                    size_t j;
-                    ci_xy_t *tmp = (ci_xy_t *)malloc(
-                        block * sizeof(ci_xy_t));
-                    if (tmp) {
-                        memcpy(tmp, ctx->lines.points.data + rot_mid,
-                            block * sizeof(ci_xy_t));
-                        for (j = rot_mid; j > rot_start; --j)
-                            ctx->lines.points.data[j + block - 1] =
-                                ctx->lines.points.data[j - 1];
-                        memcpy(ctx->lines.points.data + rot_start,
-                            tmp, block * sizeof(ci_xy_t));
-                        free(tmp);
-                    }
+                    ci_xy_t *merged = ctx->lines.points.data + merge_point;
+                    size_t length = ctx->lines.points.size - merge_point;
+                    ci_reverse_points(merged, length - cnt);
+                    ci_reverse_points(merged + length - cnt, cnt);
+                    ci_reverse_points(merged, length);
                     ctx->lines.subpaths.data[merge_subpath].count +=
                         cnt;
                     ci_subpath_array_pop(&ctx->lines.subpaths);
@@ -1625,24 +2732,30 @@ static void ci_dash_lines(ci_canvas_t *ctx)
 
 /* ======== HALF STROKE ======== */
 
+/* Add one side of the outline of a stroke along the lines from beginning
+   to ending, worked out in user space with the given transforms to and
+   from it.  Under a similarity both are null, and the stroke is worked
+   out directly in device space with its width and lengths scaled. */
 static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
-    size_t ending, int closed)
+    size_t ending, int closed, ci_affine_matrix_t const *forward,
+    ci_affine_matrix_t const *inverse, float scale)
 {
-    float half = ctx->line_width * 0.5f;
+    float half = ctx->line_width * 0.5f * scale;
+    float shortest = 1.0e-4f * scale;
     float ratio = ctx->miter_limit * ctx->miter_limit * half * half;
     ci_xy_t in_direction = ci_xy_make(0.0f, 0.0f);
     float in_length = 0.0f;
-    ci_xy_t point = ci_affine_mul(ctx->inverse,
+    ci_xy_t point = ci_affine_apply(inverse,
         ctx->scratch.points.data[beginning]);
     size_t finish = beginning;
     size_t index = beginning;
     do {
-        ci_xy_t next_pt = ci_affine_mul(ctx->inverse,
+        ci_xy_t next_pt = ci_affine_apply(inverse,
             ctx->scratch.points.data[index]);
         ci_xy_t out_direction = ci_normalized(
             ci_xy_sub(next_pt, point));
         float out_length = ci_length(ci_xy_sub(next_pt, point));
-        if (in_length != 0.0f && out_length >= 1.0e-4f) {
+        if (in_length != 0.0f && out_length >= shortest) {
             ci_xy_t side_in, side_out, offset_vec;
             float turn;
             int tight;
@@ -1671,18 +2784,18 @@ static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
                 in_direction = out_direction;
                 out_direction = tmp_dir;
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_out));
+                    ci_affine_apply(forward, side_out));
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, point));
+                    ci_affine_apply(forward, point));
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_in));
+                    ci_affine_apply(forward, side_in));
             }
             if ((turn > 0.0f && !tight) ||
                 (turn != 0.0f &&
                  ctx->line_join == CI_JOIN_MITER &&
                  ci_dot(offset_vec, offset_vec) <= ratio)) {
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward,
+                    ci_affine_apply(forward,
                         ci_xy_add(point, offset_vec)));
             } else if (ctx->line_join == CI_JOIN_ROUNDED) {
                 float cos_val = ci_dot(in_direction, out_direction);
@@ -1691,35 +2804,35 @@ static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
                 float alpha = 4.0f / 3.0f *
                     ci_tanf(0.25f * angle);
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_in));
+                    ci_affine_apply(forward, side_in));
                 ci_add_bezier(ctx,
-                    ci_affine_mul(ctx->forward, side_in),
-                    ci_affine_mul(ctx->forward, ci_xy_add(side_in,
+                    ci_affine_apply(forward, side_in),
+                    ci_affine_apply(forward, ci_xy_add(side_in,
                         ci_xy_scale(alpha * half, in_direction))),
-                    ci_affine_mul(ctx->forward, ci_xy_sub(side_out,
+                    ci_affine_apply(forward, ci_xy_sub(side_out,
                         ci_xy_scale(alpha * half, out_direction))),
-                    ci_affine_mul(ctx->forward, side_out),
+                    ci_affine_apply(forward, side_out),
                     -1.0f);
             } else {
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_in));
+                    ci_affine_apply(forward, side_in));
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_out));
+                    ci_affine_apply(forward, side_out));
             }
             if (turn > 0.0f && tight) {
                 ci_xy_t tmp_dir;
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_out));
+                    ci_affine_apply(forward, side_out));
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, point));
+                    ci_affine_apply(forward, point));
                 ci_xy_array_push(&ctx->lines.points,
-                    ci_affine_mul(ctx->forward, side_in));
+                    ci_affine_apply(forward, side_in));
                 tmp_dir = in_direction;
                 in_direction = out_direction;
                 out_direction = tmp_dir;
             }
         }
-        if (out_length >= 1.0e-4f) {
+        if (out_length >= shortest) {
             in_direction = out_direction;
             in_length = out_length;
             point = next_pt;
@@ -1734,45 +2847,45 @@ static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
         ci_xy_t side = ci_perpendicular(ahead);
         if (ctx->line_cap == CI_CAP_BUTT) {
             ci_xy_array_push(&ctx->lines.points,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(point, side)));
             ci_xy_array_push(&ctx->lines.points,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_sub(point, side)));
         } else if (ctx->line_cap == CI_CAP_SQUARE) {
             ci_xy_array_push(&ctx->lines.points,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(ci_xy_add(point, ahead), side)));
             ci_xy_array_push(&ctx->lines.points,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_sub(ci_xy_add(point, ahead), side)));
         } else if (ctx->line_cap == CI_CAP_CIRCLE) {
             float alpha_cap = 0.55228475f;
             ci_xy_array_push(&ctx->lines.points,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(point, side)));
             ci_add_bezier(ctx,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(point, side)),
-                ci_affine_mul(ctx->forward, ci_xy_add(
+                ci_affine_apply(forward, ci_xy_add(
                     ci_xy_add(point, side),
                     ci_xy_scale(alpha_cap, ahead))),
-                ci_affine_mul(ctx->forward, ci_xy_add(
+                ci_affine_apply(forward, ci_xy_add(
                     ci_xy_add(point, ahead),
                     ci_xy_scale(alpha_cap, side))),
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(point, ahead)),
                 -1.0f);
             ci_add_bezier(ctx,
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_add(point, ahead)),
-                ci_affine_mul(ctx->forward, ci_xy_sub(
+                ci_affine_apply(forward, ci_xy_sub(
                     ci_xy_add(point, ahead),
                     ci_xy_scale(alpha_cap, side))),
-                ci_affine_mul(ctx->forward, ci_xy_add(
+                ci_affine_apply(forward, ci_xy_add(
                     ci_xy_sub(point, side),
                     ci_xy_scale(alpha_cap, ahead))),
-                ci_affine_mul(ctx->forward,
+                ci_affine_apply(forward,
                     ci_xy_sub(point, side)),
                 -1.0f);
         }
@@ -1781,19 +2894,137 @@ static void ci_add_half_stroke(ci_canvas_t *ctx, size_t beginning,
 
 /* ======== STROKE LINES ======== */
 
+/* Whether a transform only rotates, scales uniformly and translates, so
+   that it keeps angles and scales every length by the same amount. */
+static int ci_affine_is_similarity(ci_affine_matrix_t const *m)
+{
+    float size = ci_fabsf(m->a) + ci_fabsf(m->b);
+    return ci_fabsf(m->a - m->d) + ci_fabsf(m->b + m->c) <=
+        1.0e-6f * size;
+}
+
+/* Square of the most that a transform stretches any length by. */
+static float ci_affine_squared_stretch(ci_affine_matrix_t const *m)
+{
+    float sum = m->a * m->a + m->b * m->b + m->c * m->c + m->d * m->d;
+    float det = m->a * m->d - m->b * m->c;
+    return 0.5f * (sum + ci_sqrtf(CI_MAX(0.0f,
+        sum * sum - 4.0f * det * det)));
+}
+
+/* Whether a segment lies wholly to one side of a box. */
+static int ci_segment_outside(ci_xy_t from, ci_xy_t to,
+    ci_xy_t low, ci_xy_t high)
+{
+    return (from.x < low.x && to.x < low.x) ||
+           (from.x > high.x && to.x > high.x) ||
+           (from.y < low.y && to.y < low.y) ||
+           (from.y > high.y && to.y > high.y);
+}
+
+/* Move the lines to ctx->scratch, leaving out the segments that lie
+   farther than reach outside the clip bounds.  The rest of a subpath
+   around such a gap is kept as open pieces, whose new ends are out of
+   reach too, so that their caps are never seen. */
+static void ci_cull_lines(ci_canvas_t *ctx, float reach)
+{
+    ci_xy_t low = ci_xy_make(ctx->clip_low.x - reach,
+                             ctx->clip_low.y - reach);
+    ci_xy_t high = ci_xy_make(ctx->clip_high.x + reach,
+                              ctx->clip_high.y + reach);
+    ci_xy_t const *points = ctx->lines.points.data;
+    size_t ending = 0;
+    size_t subpath;
+    ci_xy_array_clear(&ctx->scratch.points);
+    ci_subpath_array_clear(&ctx->scratch.subpaths);
+    for (subpath = 0; subpath < ctx->lines.subpaths.size; ++subpath) {
+        size_t beginning = ending;
+        size_t count = ctx->lines.subpaths.data[subpath].count;
+        int closed = ctx->lines.subpaths.data[subpath].closed;
+        size_t edges = closed ? count : count - 1;
+        size_t first = 0;
+        size_t start, edge, step;
+        int open = 0;
+        ending += count;
+        if (count < 2)
+            continue;
+        for (edge = 0; edge < edges; ++edge) {
+            ci_xy_t from = points[beginning + edge];
+            ci_xy_t to = points[beginning + (edge + 1) % count];
+            if (ci_segment_outside(from, to, low, high))
+                break;
+        }
+        if (edge == edges) {
+            for (step = beginning; step < ending; ++step)
+                ci_xy_array_push(&ctx->scratch.points, points[step]);
+            ci_subpath_array_push(&ctx->scratch.subpaths,
+                ctx->lines.subpaths.data[subpath]);
+            continue;
+        }
+        /* A closed subpath is walked from just past a gap so that the
+           piece across its closing point stays whole. */
+        start = closed ? edge + 1 : 0;
+        for (step = 0; step < edges; ++step) {
+            size_t at = (start + step) % count;
+            ci_xy_t from = points[beginning + at];
+            ci_xy_t to = points[beginning + (at + 1) % count];
+            if (ci_segment_outside(from, to, low, high)) {
+                if (open)
+                    ci_subpath_array_push(&ctx->scratch.subpaths,
+                        ci_subpath_make(
+                            ctx->scratch.points.size - first, 0));
+                open = 0;
+                continue;
+            }
+            if (!open) {
+                first = ctx->scratch.points.size;
+                ci_xy_array_push(&ctx->scratch.points, from);
+                open = 1;
+            }
+            ci_xy_array_push(&ctx->scratch.points, to);
+        }
+        if (open)
+            ci_subpath_array_push(&ctx->scratch.subpaths,
+                ci_subpath_make(ctx->scratch.points.size - first, 0));
+    }
+    ci_xy_array_clear(&ctx->lines.points);
+    ci_subpath_array_clear(&ctx->lines.subpaths);
+}
+
 static void ci_stroke_lines(ci_canvas_t *ctx)
 {
+    ci_affine_matrix_t const *forward = &ctx->forward;
+    ci_affine_matrix_t const *inverse = &ctx->inverse;
+    float scale = 1.0f;
     size_t ending = 0;
     size_t subpath;
     if (ctx->forward.a * ctx->forward.d -
         ctx->forward.b * ctx->forward.c == 0.0f)
         return;
+    if (ci_affine_is_similarity(&ctx->forward)) {
+        forward = NULL;
+        inverse = NULL;
+        scale = ci_sqrtf(ctx->forward.a * ctx->forward.a +
+                         ctx->forward.b * ctx->forward.b);
+    }
     ci_dash_lines(ctx);
-    ci_xy_array_swap(&ctx->lines.points, &ctx->scratch.points);
-    ci_xy_array_clear(&ctx->lines.points);
-    ci_subpath_array_swap(&ctx->lines.subpaths,
-        &ctx->scratch.subpaths);
-    ci_subpath_array_clear(&ctx->lines.subpaths);
+    if (!ci_shadow_visible(ctx)) {
+        /* How far the outline can reach from the lines, with a pixel
+           to spare for antialiasing.  Shadows may reach farther. */
+        float reach = ctx->line_join == CI_JOIN_MITER ?
+            CI_MAX(ctx->miter_limit, 1.0f) : 1.0f;
+        if (ctx->line_cap == CI_CAP_SQUARE)
+            reach = CI_MAX(reach, 1.4142136f);
+        reach = reach * 0.5f * ctx->line_width *
+            ci_sqrtf(ci_affine_squared_stretch(&ctx->forward)) + 1.0f;
+        ci_cull_lines(ctx, reach);
+    } else {
+        ci_xy_array_swap(&ctx->lines.points, &ctx->scratch.points);
+        ci_xy_array_clear(&ctx->lines.points);
+        ci_subpath_array_swap(&ctx->lines.subpaths,
+            &ctx->scratch.subpaths);
+        ci_subpath_array_clear(&ctx->lines.subpaths);
+    }
     for (subpath = 0; subpath < ctx->scratch.subpaths.size;
          ++subpath) {
         size_t beginning = ending;
@@ -1803,7 +3034,8 @@ static void ci_stroke_lines(ci_canvas_t *ctx)
             continue;
         first = ctx->lines.points.size;
         ci_add_half_stroke(ctx, beginning, ending - 1,
-            ctx->scratch.subpaths.data[subpath].closed);
+            ctx->scratch.subpaths.data[subpath].closed,
+            forward, inverse, scale);
         if (ctx->scratch.subpaths.data[subpath].closed) {
             ci_subpath_array_push(&ctx->lines.subpaths,
                 ci_subpath_make(
@@ -1811,7 +3043,8 @@ static void ci_stroke_lines(ci_canvas_t *ctx)
             first = ctx->lines.points.size;
         }
         ci_add_half_stroke(ctx, ending - 1, beginning,
-            ctx->scratch.subpaths.data[subpath].closed);
+            ctx->scratch.subpaths.data[subpath].closed,
+            forward, inverse, scale);
         ci_subpath_array_push(&ctx->lines.subpaths,
             ci_subpath_make(ctx->lines.points.size - first, 1));
     }
@@ -1894,13 +3127,88 @@ static int ci_run_compare(const void *a, const void *b)
     return 0;
 }
 
+/* Sort the runs by row with a counting pass, then sort within each row,
+   which is cheap since rows hold few runs and these often come in order
+   already, as do the runs of glyphs set side by side.  A row whose
+   insertion sort moves runs more than a few times per run is finished
+   with qsort() instead, and without the memory for the counting pass
+   the runs are all sorted at once. */
+static void ci_sort_runs(ci_canvas_t *ctx)
+{
+    size_t size = ctx->runs.size;
+    size_t rows = 0;
+    size_t index, row;
+    ci_run_array_t sorted;
+    for (index = 0; index < size; ++index)
+        rows = CI_MAX(rows, (size_t)ctx->runs.data[index].y + 1);
+    if (!ci_size_array_resize(&ctx->run_rows, rows + 1) ||
+        !ci_run_array_ensure(&ctx->sorted_runs, size)) {
+        qsort(ctx->runs.data, size, sizeof(ci_pixel_run_t),
+            ci_run_compare);
+        return;
+    }
+    memset(ctx->run_rows.data, 0, (rows + 1) * sizeof(size_t));
+    for (index = 0; index < size; ++index)
+        ++ctx->run_rows.data[ctx->runs.data[index].y + 1];
+    for (row = 1; row <= rows; ++row)
+        ctx->run_rows.data[row] += ctx->run_rows.data[row - 1];
+    for (index = 0; index < size; ++index)
+        ctx->sorted_runs.data[ctx->run_rows.data[
+            ctx->runs.data[index].y]++] = ctx->runs.data[index];
+    sorted = ctx->sorted_runs;
+    ctx->sorted_runs = ctx->runs;
+    ctx->runs = sorted;
+    ctx->runs.size = size;
+    for (row = 0, index = 0; row < rows; ++row) {
+        size_t ending = ctx->run_rows.data[row];
+        size_t budget = 4 * (ending - index) + 64;
+        size_t place;
+        for (place = index + 1; place < ending; ++place) {
+            ci_pixel_run_t run = ctx->runs.data[place];
+            size_t slot = place;
+            while (slot > index && budget &&
+                   ci_run_compare(&run, &ctx->runs.data[slot - 1]) < 0) {
+                ctx->runs.data[slot] = ctx->runs.data[slot - 1];
+                --slot;
+                --budget;
+            }
+            ctx->runs.data[slot] = run;
+            if (!budget) {
+                qsort(ctx->runs.data + index, ending - index,
+                    sizeof(ci_pixel_run_t), ci_run_compare);
+                break;
+            }
+        }
+        index = ending;
+    }
+}
+
+/* Sort the runs and sum those that land on the same pixel. */
+static void ci_merge_runs(ci_canvas_t *ctx)
+{
+    size_t from, to = 0;
+    if (ctx->runs.size == 0)
+        return;
+    ci_sort_runs(ctx);
+    for (from = 1; from < ctx->runs.size; ++from)
+        if (ctx->runs.data[from].x == ctx->runs.data[to].x &&
+            ctx->runs.data[from].y == ctx->runs.data[to].y)
+            ctx->runs.data[to].delta += ctx->runs.data[from].delta;
+        else if (ctx->runs.data[from].delta != 0.0f)
+            ctx->runs.data[++to] = ctx->runs.data[from];
+    ctx->runs.size = to + 1;
+}
+
+/* Scan convert the lines into sorted runs, with each point moved by the
+   offset and then multiplied by the scale.  Runs are clipped to the
+   canvas grown by the padding, in the same scaled units. */
 static void ci_lines_to_runs(ci_canvas_t *ctx, ci_xy_t offset,
-    int padding)
+    float scale, int padding)
 {
-    float width = (float)(ctx->size_x + padding);
-    float height = (float)(ctx->size_y + padding);
+    float width = (float)(ctx->size_x + padding) * scale;
+    float height = (float)(ctx->size_y + padding) * scale;
     size_t ending = 0;
-    size_t subpath, to;
+    size_t subpath;
     ci_run_array_clear(&ctx->runs);
     for (subpath = 0; subpath < ctx->lines.subpaths.size; ++subpath) {
         size_t beginning = ending;
@@ -1910,7 +3218,8 @@ static void ci_lines_to_runs(ci_canvas_t *ctx, ci_xy_t offset,
         ci_xy_array_clear(&ctx->scratch.points);
         for (index = beginning; index < ending; ++index)
             ci_xy_array_push(&ctx->scratch.points,
-                ci_xy_add(offset, ctx->lines.points.data[index]));
+                ci_xy_scale(scale,
+                    ci_xy_add(offset, ctx->lines.points.data[index])));
         for (edge = 0; edge < 4; ++edge) {
             ci_xy_t normal = ci_xy_make(
                 edge == 0 ? 1.0f : edge == 2 ? -1.0f : 0.0f,
@@ -1945,248 +3254,1221 @@ static void ci_lines_to_runs(ci_canvas_t *ctx, ci_xy_t offset,
                            CI_CLAMP(to_pt.y, 0.0f, height)));
         }
     }
-    if (ctx->runs.size == 0)
-        return;
-    qsort(ctx->runs.data, ctx->runs.size, sizeof(ci_pixel_run_t),
-        ci_run_compare);
-    to = 0;
-    {
-        size_t from;
-        for (from = 1; from < ctx->runs.size; ++from)
-            if (ctx->runs.data[from].x == ctx->runs.data[to].x &&
-                ctx->runs.data[from].y == ctx->runs.data[to].y)
-                ctx->runs.data[to].delta +=
-                    ctx->runs.data[from].delta;
-            else if (ctx->runs.data[from].delta != 0.0f)
-                ctx->runs.data[++to] = ctx->runs.data[from];
+    ci_merge_runs(ctx);
+}
+
+/* Move sorted runs by whole pixels into canvas space.  Rows outside the
+   canvas are dropped and runs beyond its left or right edge fold onto
+   that edge, which leaves the coverage of every visible pixel as though
+   the lines had been scan converted in place. */
+static void ci_translate_runs(ci_canvas_t *ctx, int shift_x, int shift_y)
+{
+    size_t from, to = 0;
+    for (from = 0; from < ctx->runs.size; ++from) {
+        ci_pixel_run_t run = ctx->runs.data[from];
+        int x = CI_CLAMP((int)run.x + shift_x, 0, ctx->size_x);
+        int y = (int)run.y + shift_y;
+        if (y < 0 || y >= ctx->size_y)
+            continue;
+        if (to && ctx->runs.data[to - 1].y == y &&
+            ctx->runs.data[to - 1].x == x)
+            ctx->runs.data[to - 1].delta += run.delta;
+        else
+            ctx->runs.data[to++] = ci_run_make(
+                (unsigned short)x, (unsigned short)y, run.delta);
     }
-    ctx->runs.size = to + 1;
+    ctx->runs.size = to;
 }
 
 
-/* ======== PAINT PIXEL ======== */
+/* ======== HAIRLINE STROKES ======== */
 
-static ci_rgba_t ci_paint_pixel(ci_canvas_t *ctx, ci_xy_t point,
-    ci_paint_brush_t const *brush)
+/* Strokes no wider than a device pixel skip the stroke outline.  Their
+   coverage comes straight from the centerline instead, one column (or
+   row, for steep segments) at a time, which matches the scan converted
+   outline to within a small part of a pixel near the joins. */
+static int ci_hairline_usable(ci_canvas_t const *ctx)
 {
-    if (brush->colors.size == 0)
-        return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
-    if (brush->type == CI_PAINT_COLOR)
-        return brush->colors.data[0];
-    point = ci_affine_mul(ctx->inverse, point);
-    if (brush->type == CI_PAINT_PATTERN) {
-        float w = (float)brush->width;
-        float h = (float)brush->height;
-        float scale_x, scale_y, reciprocal_x, reciprocal_y;
-        int left, top_val, right, bottom_val, pattern_y;
-        ci_rgba_t total_color;
-        float total_weight;
-        int is_image = (brush == &ctx->image_brush);
-        if (((brush->repetition & 2) &&
-             (point.x < 0.0f || w <= point.x)) ||
-            ((brush->repetition & 1) &&
-             (point.y < 0.0f || h <= point.y)))
-            return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
-        scale_x = ci_fabsf(ctx->inverse.a) +
-            ci_fabsf(ctx->inverse.c);
-        scale_y = ci_fabsf(ctx->inverse.b) +
-            ci_fabsf(ctx->inverse.d);
-        scale_x = CI_MAX(1.0f, CI_MIN(scale_x, w * 0.25f));
-        scale_y = CI_MAX(1.0f, CI_MIN(scale_y, h * 0.25f));
-        reciprocal_x = 1.0f / scale_x;
-        reciprocal_y = 1.0f / scale_y;
-        point = ci_xy_sub(point, ci_xy_make(0.5f, 0.5f));
-        left = (int)ci_ceilf(point.x - scale_x * 2.0f);
-        top_val = (int)ci_ceilf(point.y - scale_y * 2.0f);
-        right = (int)ci_ceilf(point.x + scale_x * 2.0f);
-        bottom_val = (int)ci_ceilf(point.y + scale_y * 2.0f);
-        total_color = ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
-        total_weight = 0.0f;
-        for (pattern_y = top_val; pattern_y < bottom_val;
-             ++pattern_y) {
-            float yf = ci_fabsf(reciprocal_y *
-                ((float)pattern_y - point.y));
-            float weight_y = yf < 1.0f ?
-                (1.5f * yf - 2.5f) * yf * yf + 1.0f :
-                ((-0.5f * yf + 2.5f) * yf - 4.0f) * yf + 2.0f;
-            int wrapped_y = pattern_y % brush->height;
-            int pattern_x;
-            if (wrapped_y < 0)
-                wrapped_y += brush->height;
-            if (is_image)
-                wrapped_y = CI_CLAMP(pattern_y, 0,
-                    brush->height - 1);
-            for (pattern_x = left; pattern_x < right; ++pattern_x) {
-                float xf = ci_fabsf(reciprocal_x *
-                    ((float)pattern_x - point.x));
-                float weight_x = xf < 1.0f ?
-                    (1.5f * xf - 2.5f) * xf * xf + 1.0f :
-                    ((-0.5f * xf + 2.5f) * xf - 4.0f) * xf + 2.0f;
-                int wrapped_x = pattern_x % brush->width;
-                float weight;
-                size_t idx;
-                if (wrapped_x < 0)
-                    wrapped_x += brush->width;
-                if (is_image)
-                    wrapped_x = CI_CLAMP(pattern_x, 0,
-                        brush->width - 1);
-                weight = weight_x * weight_y;
-                idx = (size_t)(wrapped_y * brush->width + wrapped_x);
-                total_color = ci_rgba_add(total_color,
-                    ci_rgba_scale(weight,
-                        brush->colors.data[idx]));
-                total_weight += weight;
-            }
-        }
-        return ci_rgba_scale(1.0f / total_weight, total_color);
+    if (ctx->backend != &s_ci_cpu_backend ||
+        ctx->fill_rule != CI_FILL_NONZERO ||
+        ci_shadow_visible(ctx))
+        return 0;
+    if (ctx->forward.a * ctx->forward.d -
+        ctx->forward.b * ctx->forward.c == 0.0f)
+        return 0;
+    return ctx->line_width * ctx->line_width *
+        ci_affine_squared_stretch(&ctx->forward) <= 1.0f;
+}
+
+/* Integral of a value clamped to between 0 and 1, from 0 up to t. */
+static float ci_ramp_integral(float t)
+{
+    return t <= 0.0f ? 0.0f : t <= 1.0f ? 0.5f * t * t : t - 0.5f;
+}
+
+/* Area within a pixel high row, over the given width, of a band that
+   reaches half its thickness either side of a line running from start to
+   end, measured from the top of the row.  This is the difference of the
+   areas under two ramps clamped to between 0 and 1. */
+static float ci_band_area(float start, float end, float half, float width)
+{
+    float spread = end - start;
+    if (ci_fabsf(spread) < 1.0e-4f) {
+        float middle = 0.5f * (start + end);
+        return width * (CI_CLAMP(middle + half, 0.0f, 1.0f) -
+                        CI_CLAMP(middle - half, 0.0f, 1.0f));
     }
-    /* gradient */
-    {
-        float grad_offset;
-        ci_xy_t relative = ci_xy_sub(point, brush->start);
-        ci_xy_t line = ci_xy_sub(brush->end, brush->start);
-        float gradient = ci_dot(relative, line);
-        float span = ci_dot(line, line);
-        size_t idx;
-        float mix;
-        ci_rgba_t delta;
-        if (brush->type == CI_PAINT_CONIC) {
-            float dx = point.x - brush->start.x;
-            float dy = point.y - brush->start.y;
-            float angle = ci_atan2f(dy, dx) - brush->start_radius;
-            grad_offset = angle / 6.28318531f;
-            grad_offset = grad_offset - ci_floorf(grad_offset);
-        } else if (brush->type == CI_PAINT_LINEAR) {
-            if (span == 0.0f)
-                return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
-            grad_offset = gradient / span;
-        } else {
-            float initial = brush->start_radius;
-            float change = brush->end_radius - initial;
-            float a_coeff = span - change * change;
-            float b_coeff = -2.0f * (gradient + initial * change);
-            float c_coeff = ci_dot(relative, relative) -
-                initial * initial;
-            float disc = b_coeff * b_coeff -
-                4.0f * a_coeff * c_coeff;
-            float root, recip, off1, off2, r1, r2;
-            if (disc < 0.0f || (span == 0.0f && change == 0.0f))
-                return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
-            root = ci_sqrtf(disc);
-            recip = 1.0f / (2.0f * a_coeff);
-            off1 = (-b_coeff - root) * recip;
-            off2 = (-b_coeff + root) * recip;
-            r1 = initial + change * off1;
-            r2 = initial + change * off2;
-            if (r2 >= 0.0f)
-                grad_offset = off2;
-            else if (r1 >= 0.0f)
-                grad_offset = off1;
-            else
-                return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
+    return width / spread *
+        (ci_ramp_integral(end + half) - ci_ramp_integral(start + half) -
+         ci_ramp_integral(end - half) + ci_ramp_integral(start - half));
+}
+
+/* Add coverage runs for a band of the given thickness across the minor
+   axis, centered on a segment given as (major, minor) with the major
+   running from the first point to the second.  The swap flag says
+   whether the major axis is y.  The coverage of each pixel is the exact
+   area of the band within it, which is what scan converting the band as
+   a polygon would give.  Runs only mark where the coverage changes
+   along a row, so that a band along a row needs few of them. */
+static void ci_add_hairline(ci_canvas_t *ctx, ci_xy_t from, ci_xy_t to,
+    float thickness, int swap)
+{
+    float size_major = (float)(swap ? ctx->size_y : ctx->size_x);
+    float size_minor = (float)(swap ? ctx->size_x : ctx->size_y);
+    float slope = (to.y - from.y) / (to.x - from.x);
+    float half = 0.5f * thickness;
+    float low = CI_MAX(from.x, 0.0f);
+    float high = CI_MIN(to.x, size_major);
+    float previous[4], column[4];
+    int previous_first = 0, previous_count = 0;
+    int major, row;
+    if (slope != 0.0f) {
+        float enter = from.x + (-half - from.y) / slope;
+        float leave = from.x + (size_minor + half - from.y) / slope;
+        low = CI_MAX(low, CI_MIN(enter, leave));
+        high = CI_MIN(high, CI_MAX(enter, leave));
+    }
+    if (!(low < high))
+        return;
+    for (major = (int)ci_floorf(low); (float)major < high; ++major) {
+        float left, right, start, end, top, bottom, last;
+        int first, count, minor;
+        if (!swap && slope == 0.0f && (float)major - 1.0f >= low &&
+            (float)major + 1.0f <= high) {
+            /* Whole columns along a row match the one before. */
+            major = (int)ci_floorf(high) - 1;
+            continue;
         }
-        /* binary search (upper_bound) */
-        {
-            size_t lo = 0, hi = brush->stops.size;
-            while (lo < hi) {
-                size_t mid = lo + (hi - lo) / 2;
-                if (brush->stops.data[mid] <= grad_offset)
-                    lo = mid + 1;
-                else
-                    hi = mid;
+        left = CI_MAX(low, (float)major);
+        right = CI_MIN(high, (float)major + 1.0f);
+        start = from.y + slope * (left - from.x);
+        end = from.y + slope * (right - from.x);
+        top = CI_MIN(start, end) - half;
+        bottom = CI_MAX(start, end) + half;
+        last = 0.0f;
+        first = (int)ci_floorf(CI_CLAMP(top, 0.0f, size_minor));
+        count = 0;
+        for (minor = first; (float)minor < bottom &&
+             (float)minor < size_minor && count < 4; ++minor, ++count) {
+            float place = (float)minor;
+            float cover = ci_band_area(start - place, end - place,
+                half, right - left);
+            if (swap) {
+                ci_run_array_push(&ctx->runs, ci_run_make(
+                    (unsigned short)minor, (unsigned short)major,
+                    cover - last));
+                last = cover;
+            } else {
+                column[count] = cover;
             }
-            idx = lo;
         }
-        if (idx == 0)
-            return ci_premultiplied(brush->colors.data[0]);
-        if (idx == brush->stops.size)
-            return ci_premultiplied(
-                brush->colors.data[brush->stops.size - 1]);
-        mix = (grad_offset - brush->stops.data[idx - 1]) /
-              (brush->stops.data[idx] - brush->stops.data[idx - 1]);
-        delta = ci_rgba_sub(brush->colors.data[idx],
-            brush->colors.data[idx - 1]);
-        return ci_premultiplied(ci_rgba_add(
-            brush->colors.data[idx - 1],
-            ci_rgba_scale(mix, delta)));
+        if (swap) {
+            if (count)
+                ci_run_array_push(&ctx->runs, ci_run_make(
+                    (unsigned short)minor, (unsigned short)major, -last));
+            continue;
+        }
+        for (row = CI_MIN(first, previous_first);
+             row < CI_MAX(first + count, previous_first + previous_count);
+             ++row) {
+            float delta =
+                (row >= first && row < first + count ?
+                 column[row - first] : 0.0f) -
+                (row >= previous_first &&
+                 row < previous_first + previous_count ?
+                 previous[row - previous_first] : 0.0f);
+            if (delta != 0.0f)
+                ci_run_array_push(&ctx->runs, ci_run_make(
+                    (unsigned short)major, (unsigned short)row, delta));
+        }
+        memcpy(previous, column, sizeof(float) * (size_t)count);
+        previous_first = first;
+        previous_count = count;
     }
+    for (row = 0; row < previous_count; ++row)
+        ci_run_array_push(&ctx->runs, ci_run_make(
+            (unsigned short)major, (unsigned short)(previous_first + row),
+            -previous[row]));
 }
 
-/* ======== RENDER SHADOW ======== */
+/* Scan convert a triangle given in device space, clamped to the canvas
+   and wound so that its coverage adds to that of the hairlines when the
+   sign is positive, or takes away from it when negative. */
+static void ci_add_hairline_triangle(ci_canvas_t *ctx,
+    ci_xy_t a, ci_xy_t b, ci_xy_t c, int sign)
+{
+    float width = (float)ctx->size_x;
+    float height = (float)ctx->size_y;
+    float winding;
+    a = ci_xy_make(CI_CLAMP(a.x, 0.0f, width), CI_CLAMP(a.y, 0.0f, height));
+    b = ci_xy_make(CI_CLAMP(b.x, 0.0f, width), CI_CLAMP(b.y, 0.0f, height));
+    c = ci_xy_make(CI_CLAMP(c.x, 0.0f, width), CI_CLAMP(c.y, 0.0f, height));
+    winding = ci_dot(ci_perpendicular(ci_xy_sub(b, a)), ci_xy_sub(c, a));
+    if (sign > 0 ? winding > 0.0f : winding < 0.0f) {
+        ci_xy_t tmp = b; b = c; c = tmp;
+    }
+    ci_add_runs(ctx, a, b);
+    ci_add_runs(ctx, b, c);
+    ci_add_runs(ctx, c, a);
+}
 
-static void ci_render_shadow(ci_canvas_t *ctx,
-    ci_paint_brush_t const *brush)
+/* A band ends square to its major axis, while the stroke ends square to
+   the segment.  Trade the difference between the two at an end, given
+   the device direction into the band and the device offset across it to
+   one edge of the stroke. */
+static void ci_add_hairline_end(ci_canvas_t *ctx, ci_xy_t point,
+    ci_xy_t inward, ci_xy_t across, int swap)
 {
-    float sigma_squared;
-    size_t radius;
-    int border;
-    ci_xy_t offset;
-    int left_val, right_val, top_val, bottom_val;
-    size_t w, h, working;
-    float alpha_val, divisor, weight_1, weight_2;
-    size_t y_idx;
-    int operation, x_var, y_var;
-    float sum;
-    size_t idx;
-    if (ctx->shadow_color.a == 0.0f ||
-        (ctx->shadow_blur == 0.0f &&
-         ctx->shadow_offset_x == 0.0f &&
-         ctx->shadow_offset_y == 0.0f))
+    float along = swap ? inward.y : inward.x;
+    int side;
+    for (side = 0; side < 2; ++side) {
+        ci_xy_t edge = side ? ci_xy_sub(point, across) :
+            ci_xy_add(point, across);
+        float major = swap ? edge.y - point.y : edge.x - point.x;
+        if (major == 0.0f)
+            continue;
+        ci_add_hairline_triangle(ctx, point, edge,
+            ci_xy_sub(edge, ci_xy_scale(major / along, inward)),
+            major * along < 0.0f ? 1 : -1);
+    }
+}
+
+/* Fan out triangles from a point around an arc, for round caps and
+   joins.  The arc starts at the given device offset and turns by the
+   angle toward the normal, an offset of the same length a right angle
+   on, in steps of no more than a sixteenth of a turn. */
+static void ci_add_hairline_fan(ci_canvas_t *ctx, ci_xy_t point,
+    ci_xy_t start, ci_xy_t normal, float angle)
+{
+    int steps = (int)ci_ceilf(angle * (8.0f / 3.14159265f));
+    ci_xy_t from = ci_xy_add(point, start);
+    int step;
+    for (step = 1; step <= steps; ++step) {
+        float turn = angle * (float)step / (float)steps;
+        ci_xy_t to = ci_xy_add(point, ci_xy_add(
+            ci_xy_scale(ci_cosf(turn), start),
+            ci_xy_scale(ci_sinf(turn), normal)));
+        ci_add_hairline_triangle(ctx, point, from, to, 1);
+        from = to;
+    }
+}
+
+/* Edge of a subpath in the lines, as its device space endpoints, with
+   its vector in user space returned. */
+static ci_xy_t ci_hairline_edge(ci_canvas_t *ctx, size_t beginning,
+    size_t count, size_t edge, ci_xy_t *from, ci_xy_t *to)
+{
+    *from = ctx->lines.points.data[beginning + edge];
+    *to = ctx->lines.points.data[
+        beginning + (edge + 1 < count ? edge + 1 : 0)];
+    return ci_affine_apply_vector(&ctx->inverse, ci_xy_sub(*to, *from));
+}
+
+/* Turn the centerlines in ctx->lines into sorted coverage runs for a
+   hairline stroke.  Each segment becomes a band, and where two bands
+   meet square to the same axis with only a gentle turn between them
+   they already fit together closely.  Elsewhere the band ends are
+   squared off to the segments, the overlap on the inside of a join is
+   taken away and the wedge on the outside is added, so that the pieces
+   sum to the outline that ci_stroke_lines would give.  Square caps
+   lengthen the end segments and round ones are fanned out from them. */
+static void ci_hairline_to_runs(ci_canvas_t *ctx)
+{
+    float half = ctx->line_width * 0.5f;
+    float ratio = ctx->miter_limit * ctx->miter_limit * half * half;
+    float stretch = ci_fabsf(ctx->forward.a * ctx->forward.d -
+                             ctx->forward.b * ctx->forward.c);
+    float cap = ctx->line_cap == CI_CAP_SQUARE ? half : 0.0f;
+    size_t ending = 0;
+    size_t subpath;
+    ci_run_array_clear(&ctx->runs);
+    for (subpath = 0; subpath < ctx->lines.subpaths.size; ++subpath) {
+        size_t beginning = ending;
+        size_t count = ctx->lines.subpaths.data[subpath].count;
+        int closed = ctx->lines.subpaths.data[subpath].closed;
+        size_t edges, edge, last;
+        ci_xy_t from, to, in_direction, in_device, in_across;
+        float in_length = 0.0f;
+        int in_swap = 0, joined = 0;
+        ending += count;
+        if (count < 2)
+            continue;
+        edges = closed ? count : count - 1;
+        for (last = edges; last > 0; --last) {
+            ci_xy_t user = ci_hairline_edge(ctx, beginning, count,
+                last - 1, &from, &to);
+            in_length = ci_length(user);
+            if (in_length >= 1.0e-4f) {
+                in_direction = ci_xy_scale(1.0f / in_length, user);
+                in_device = ci_xy_sub(to, from);
+                in_across = ci_affine_apply_vector(&ctx->forward,
+                    ci_xy_scale(half, ci_perpendicular(in_direction)));
+                in_swap = ci_fabsf(in_device.y) > ci_fabsf(in_device.x);
+                joined = closed;
+                break;
+            }
+        }
+        if (last == 0)
+            continue;
+        for (edge = 0; edge < edges; ++edge) {
+            ci_xy_t user = ci_hairline_edge(ctx, beginning, count, edge,
+                &from, &to);
+            ci_xy_t device = ci_xy_sub(to, from);
+            ci_xy_t out_direction, across, low, high;
+            float length = ci_length(user);
+            float cosine, turn;
+            int swap;
+            if (length < 1.0e-4f)
+                continue;
+            out_direction = ci_xy_scale(1.0f / length, user);
+            across = ci_affine_apply_vector(&ctx->forward,
+                ci_xy_scale(half, ci_perpendicular(out_direction)));
+            swap = ci_fabsf(device.y) > ci_fabsf(device.x);
+            cosine = ci_dot(in_direction, out_direction);
+            turn = ci_dot(ci_perpendicular(in_direction), out_direction);
+            if (joined && (in_swap != swap || cosine < 0.8660254f)) {
+                ci_add_hairline_end(ctx, from,
+                    ci_xy_scale(-1.0f, in_device), in_across, in_swap);
+                ci_add_hairline_end(ctx, from, device, across, swap);
+                if (ci_fabsf(turn) >= 1.0e-4f) {
+                    float outer = turn < 0.0f ? 1.0f : -1.0f;
+                    ci_xy_t tip = ci_xy_scale(half / ci_fabsf(turn),
+                        ci_xy_sub(in_direction, out_direction));
+                    ci_xy_t side_in = ci_xy_scale(outer, in_across);
+                    ci_xy_t side_out = ci_xy_scale(outer, across);
+                    ci_xy_t bend = ci_affine_apply_vector(&ctx->forward,
+                        tip);
+                    float reach = ci_dot(tip, in_direction);
+                    if (ctx->line_join == CI_JOIN_ROUNDED) {
+                        ci_add_hairline_fan(ctx, from, side_in,
+                            ci_xy_scale(half / in_length, in_device),
+                            ci_acosf(CI_CLAMP(cosine, -1.0f, 1.0f)));
+                    } else {
+                        ci_add_hairline_triangle(ctx, from,
+                            ci_xy_add(from, side_in),
+                            ci_xy_add(from, side_out), 1);
+                        if (ctx->line_join == CI_JOIN_MITER &&
+                            ci_dot(tip, tip) <= ratio)
+                            ci_add_hairline_triangle(ctx,
+                                ci_xy_add(from, side_in),
+                                ci_xy_add(from, bend),
+                                ci_xy_add(from, side_out), 1);
+                    }
+                    if (reach <= in_length && reach <= length) {
+                        ci_xy_t inner = ci_xy_sub(from, bend);
+                        ci_add_hairline_triangle(ctx, from,
+                            ci_xy_sub(from, side_in), inner, -1);
+                        ci_add_hairline_triangle(ctx, from,
+                            inner, ci_xy_sub(from, side_out), -1);
+                    }
+                }
+            }
+            low = from;
+            high = to;
+            if (!closed) {
+                ci_xy_t extend = ci_xy_scale(cap / length, device);
+                ci_xy_t ahead = ci_xy_scale(half / length, device);
+                if (!joined) {
+                    low = ci_xy_sub(from, extend);
+                    ci_add_hairline_end(ctx, low, device, across, swap);
+                    if (ctx->line_cap == CI_CAP_CIRCLE)
+                        ci_add_hairline_fan(ctx, from, across,
+                            ci_xy_scale(-1.0f, ahead), 3.14159265f);
+                }
+                if (edge + 1 == last) {
+                    high = ci_xy_add(to, extend);
+                    ci_add_hairline_end(ctx, high,
+                        ci_xy_scale(-1.0f, device), across, swap);
+                    if (ctx->line_cap == CI_CAP_CIRCLE)
+                        ci_add_hairline_fan(ctx, to, across, ahead,
+                            3.14159265f);
+                }
+            }
+            if (swap) {
+                low = ci_xy_make(low.y, low.x);
+                high = ci_xy_make(high.y, high.x);
+            }
+            if (low.x > high.x) {
+                ci_xy_t tmp = low; low = high; high = tmp;
+            }
+            ci_add_hairline(ctx, low, high,
+                ctx->line_width * stretch * length / (high.x - low.x),
+                swap);
+            in_direction = out_direction;
+            in_device = device;
+            in_across = across;
+            in_length = length;
+            in_swap = swap;
+            joined = 1;
+        }
+    }
+    ci_merge_runs(ctx);
+}
+
+/* Render a stroke of the path in ctx->lines, as a hairline when it is
+   thin enough, or else by way of its outline. */
+static void ci_render_stroke(ci_canvas_t *ctx)
+{
+    if (ci_hairline_usable(ctx)) {
+        ci_dash_lines(ctx);
+        ci_hairline_to_runs(ctx);
+        ci_render_runs(ctx, &ctx->stroke_brush);
         return;
-    sigma_squared = 0.25f * ctx->shadow_blur * ctx->shadow_blur;
-    radius = (size_t)(0.5f * ci_sqrtf(
-        4.0f * sigma_squared + 1.0f) - 0.5f);
-    border = 3 * ((int)radius + 1);
-    offset = ci_xy_make((float)border + ctx->shadow_offset_x,
-                        (float)border + ctx->shadow_offset_y);
-    ci_lines_to_runs(ctx, offset, 2 * border);
-    left_val = ctx->size_x + 2 * border;
-    right_val = 0;
-    top_val = ctx->size_y + 2 * border;
-    bottom_val = 0;
-    for (idx = 0; idx < ctx->runs.size; ++idx) {
-        left_val = CI_MIN(left_val, (int)ctx->runs.data[idx].x);
-        right_val = CI_MAX(right_val, (int)ctx->runs.data[idx].x);
-        top_val = CI_MIN(top_val, (int)ctx->runs.data[idx].y);
-        bottom_val = CI_MAX(bottom_val, (int)ctx->runs.data[idx].y);
     }
-    left_val = CI_MAX(left_val - border, 0);
-    right_val = CI_MIN(right_val + border,
-        ctx->size_x + 2 * border) + 1;
-    top_val = CI_MAX(top_val - border, 0);
-    bottom_val = CI_MIN(bottom_val + border,
-        ctx->size_y + 2 * border);
-    w = (size_t)CI_MAX(right_val - left_val, 0);
-    h = (size_t)CI_MAX(bottom_val - top_val, 0);
-    working = w * h;
-    ci_float_array_clear(&ctx->shadow);
-    ci_float_array_resize(&ctx->shadow,
-        working + CI_MAX(w, h));
-    /* rasterize alpha */
+    ci_stroke_lines(ctx);
+    ctx->backend->render(ctx, &ctx->stroke_brush);
+}
+
+/* ======== GLYPH COVERAGE CACHE ======== */
+
+/* Sub-pixel steps per pixel at which the coverage of filled glyphs is
+   cached.  Each glyph is drawn at the nearest step, within 1/32 pixel of
+   its exact place. */
+#define CI_GLYPH_PHASES 16
+
+/* Filled text can be assembled from cached glyph coverage when it goes
+   to the built-in renderer without a shadow, which needs the lines. */
+static int ci_glyph_runs_usable(ci_canvas_t const *ctx)
+{
+    return ctx->backend == &s_ci_cpu_backend &&
+        ctx->glyph_cache.limit != 0 &&
+        !ci_shadow_visible(ctx) &&
+        ctx->forward.a * ctx->forward.d -
+        ctx->forward.b * ctx->forward.c != 0.0f;
+}
+
+static unsigned long ci_glyph_runs_hash(ci_glyph_runs_t const *key)
+{
+    float linear[4];
+    unsigned char const *bytes = (unsigned char const *)linear;
+    unsigned long hash = 2166136261UL;
+    size_t index;
+    linear[0] = key->a;
+    linear[1] = key->b;
+    linear[2] = key->c;
+    linear[3] = key->d;
+    hash = ((hash ^ (unsigned long)key->glyph) * 16777619UL) & 0xffffffffUL;
+    hash = ((hash ^ (unsigned long)key->phase_x) * 16777619UL) & 0xffffffffUL;
+    hash = ((hash ^ (unsigned long)key->phase_y) * 16777619UL) & 0xffffffffUL;
+    for (index = 0; index < sizeof(linear); ++index)
+        hash = ((hash ^ bytes[index]) * 16777619UL) & 0xffffffffUL;
+    return hash;
+}
+
+static ci_glyph_runs_t *ci_glyph_runs_find(ci_glyph_cache_t *cache,
+    ci_glyph_runs_t const *key, unsigned long hash)
+{
+    int index;
+    if (!cache->buckets.size)
+        return NULL;
+    for (index = cache->buckets.data[hash & (cache->buckets.size - 1)];
+         index; index = cache->coverage.data[index - 1].next) {
+        ci_glyph_runs_t *entry = &cache->coverage.data[index - 1];
+        if (entry->glyph == key->glyph &&
+            entry->phase_x == key->phase_x &&
+            entry->phase_y == key->phase_y &&
+            entry->a == key->a && entry->b == key->b &&
+            entry->c == key->c && entry->d == key->d)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Scan convert a glyph at the phase and with the linear transform of the
+   key into ctx->runs, in a frame just large enough to hold it, and note
+   the offset of that frame in the key.  Returns 0 if the glyph is too
+   large or too far out to be placed that way. */
+static int ci_glyph_runs_rasterize(ci_canvas_t *ctx, ci_glyph_runs_t *key)
+{
+    ci_affine_matrix_t saved = ctx->forward;
+    ci_xy_t low, high;
+    size_t index;
+    int extent;
+    ctx->forward.e = (float)key->phase_x / (float)CI_GLYPH_PHASES;
+    ctx->forward.f = (float)key->phase_y / (float)CI_GLYPH_PHASES;
+    ci_xy_array_clear(&ctx->lines.points);
+    ci_subpath_array_clear(&ctx->lines.subpaths);
+    ci_add_glyph(ctx, key->glyph, -1.0f);
+    ctx->forward = saved;
+    ci_run_array_clear(&ctx->runs);
+    key->origin_x = 0;
+    key->origin_y = 0;
+    if (!ctx->lines.points.size)
+        return 1;
+    low = high = ctx->lines.points.data[0];
+    for (index = 1; index < ctx->lines.points.size; ++index) {
+        ci_xy_t point = ctx->lines.points.data[index];
+        low = ci_xy_make(CI_MIN(low.x, point.x), CI_MIN(low.y, point.y));
+        high = ci_xy_make(CI_MAX(high.x, point.x),
+                          CI_MAX(high.y, point.y));
+    }
+    if (!(-16384.0f < low.x && high.x < 16384.0f &&
+          -16384.0f < low.y && high.y < 16384.0f))
+        return 0;
+    key->origin_x = 1 - (int)ci_floorf(low.x);
+    key->origin_y = 1 - (int)ci_floorf(low.y);
+    extent = CI_MAX((int)ci_floorf(high.x) + key->origin_x,
+                    (int)ci_floorf(high.y) + key->origin_y) + 2;
+    ci_lines_to_runs(ctx,
+        ci_xy_make((float)key->origin_x, (float)key->origin_y), 1.0f,
+        extent - CI_MIN(ctx->size_x, ctx->size_y));
+    return 1;
+}
+
+/* Keep a copy of the runs just made for the key, making room for it
+   under the memory cap first.  Should the arrays have grown past the cap
+   in taking it, all of the cached coverage is dropped again. */
+static void ci_glyph_runs_store(ci_glyph_cache_t *cache,
+    ci_glyph_runs_t *key, unsigned long hash, ci_run_array_t const *runs)
+{
+    size_t bytes = sizeof(ci_glyph_runs_t) + sizeof(int) +
+        runs->size * sizeof(ci_pixel_run_t);
+    size_t index, slot;
+    if (bytes > cache->limit)
+        return;
+    ci_glyph_cache_evict(cache, cache->limit - bytes);
+    if (cache->coverage.size >= cache->buckets.size) {
+        size_t buckets = cache->buckets.size ?
+            cache->buckets.size * 2 : 64;
+        ci_int_array_clear(&cache->buckets);
+        if (!ci_int_array_resize(&cache->buckets, buckets)) {
+            ci_glyph_coverage_clear(cache);
+            return;
+        }
+        for (index = 0; index < cache->coverage.size; ++index) {
+            slot = ci_glyph_runs_hash(&cache->coverage.data[index]) &
+                (buckets - 1);
+            cache->coverage.data[index].next = cache->buckets.data[slot];
+            cache->buckets.data[slot] = (int)index + 1;
+        }
+    }
+    key->first = cache->pool.size;
+    key->count = runs->size;
+    slot = hash & (cache->buckets.size - 1);
+    key->next = cache->buckets.data[slot];
+    if (!ci_run_array_append(&cache->pool, runs->data, runs->size) ||
+        !ci_glyph_runs_array_push(&cache->coverage, *key)) {
+        cache->pool.size = key->first;
+        return;
+    }
+    cache->buckets.data[slot] = (int)cache->coverage.size;
+    if (cache->bytes + ci_glyph_coverage_bytes(cache) > cache->limit)
+        ci_glyph_coverage_clear(cache);
+}
+
+/* Add the coverage runs of a glyph filled with the current transform to
+   the placed runs, moved into canvas space the way ci_translate_runs()
+   moves them.  Returns 0 if they cannot be had from the cache. */
+static int ci_add_glyph_runs(ci_canvas_t *ctx, int glyph)
+{
+    ci_glyph_cache_t *cache = &ctx->glyph_cache;
+    float steps_x = ci_floorf(ctx->forward.e * (float)CI_GLYPH_PHASES +
+        0.5f);
+    float steps_y = ci_floorf(ctx->forward.f * (float)CI_GLYPH_PHASES +
+        0.5f);
+    ci_glyph_runs_t key, *found;
+    ci_pixel_run_t const *runs;
+    unsigned long hash;
+    size_t index, count;
+    int shift_x, shift_y;
+    if (!(ci_fabsf(steps_x) < 1.0e6f && ci_fabsf(steps_y) < 1.0e6f))
+        return 0;
+    shift_x = (int)ci_floorf(steps_x / (float)CI_GLYPH_PHASES);
+    shift_y = (int)ci_floorf(steps_y / (float)CI_GLYPH_PHASES);
+    key.a = ctx->forward.a;
+    key.b = ctx->forward.b;
+    key.c = ctx->forward.c;
+    key.d = ctx->forward.d;
+    key.glyph = glyph;
+    key.phase_x = (int)steps_x - shift_x * CI_GLYPH_PHASES;
+    key.phase_y = (int)steps_y - shift_y * CI_GLYPH_PHASES;
+    hash = ci_glyph_runs_hash(&key);
+    found = ci_glyph_runs_find(cache, &key, hash);
+    if (found) {
+        key = *found;
+        runs = cache->pool.data + found->first;
+        count = found->count;
+    } else {
+        if (!ci_glyph_runs_rasterize(ctx, &key))
+            return 0;
+        ci_glyph_runs_store(cache, &key, hash, &ctx->runs);
+        runs = ctx->runs.data;
+        count = ctx->runs.size;
+    }
+    shift_x -= key.origin_x;
+    shift_y -= key.origin_y;
+    if (!ci_run_array_ensure(&cache->placed, cache->placed.size + count))
+        return 0;
+    for (index = 0; index < count; ++index) {
+        int x = CI_CLAMP((int)runs[index].x + shift_x, 0, ctx->size_x);
+        int y = (int)runs[index].y + shift_y;
+        if (0 <= y && y < ctx->size_y)
+            cache->placed.data[cache->placed.size++] = ci_run_make(
+                (unsigned short)x, (unsigned short)y, runs[index].delta);
+    }
+    return 1;
+}
+
+/* Sort the placed runs of all the glyphs together into ctx->runs and sum
+   those at the same pixel, as scan converting their lines would. */
+static void ci_place_glyph_runs(ci_canvas_t *ctx)
+{
+    ci_run_array_clear(&ctx->runs);
+    ci_run_array_swap(&ctx->runs, &ctx->glyph_cache.placed);
+    ci_merge_runs(ctx);
+}
+
+/* ======== CLIP MASK ======== */
+
+/* Walks the clip mask as sorted runs.  While the clip is still an
+   axis-aligned rectangle (or absent, and so the whole canvas) it is kept
+   as device space bounds and the runs for each row are made only as the
+   walk reaches it.  General clips have theirs stored in ctx->mask, with
+   the rows between clip_low.y and clip_high.y indexed by mask_rows so
+   that a walk can begin at any row. */
+typedef struct ci_clip_cursor {
+    ci_pixel_run_t row[4];
+    size_t count;
+    size_t index;
+    int y;
+    int bottom;
+} ci_clip_cursor_t;
+
+/* Make the runs for one row of a rectangular clip, giving each pixel the
+   fraction of its area inside the bounds.  Returns the number of runs. */
+static size_t ci_clip_row(ci_canvas_t const *ctx, int y,
+    ci_pixel_run_t *row)
+{
+    float low_x = ctx->clip_low.x;
+    float high_x = ctx->clip_high.x;
+    float cover = CI_MIN(ctx->clip_high.y, (float)(y + 1)) -
+        CI_MAX(ctx->clip_low.y, (float)y);
+    int left = (int)ci_floorf(low_x);
+    int right = (int)ci_floorf(high_x);
+    unsigned short row_y = (unsigned short)y;
+    size_t count = 0;
+    float edge;
+    if (cover <= 0.0f || high_x <= low_x)
+        return 0;
+    if (left == right) {
+        edge = cover * (high_x - low_x);
+        row[count++] = ci_run_make((unsigned short)left, row_y, edge);
+        row[count++] = ci_run_make((unsigned short)(left + 1), row_y,
+            -edge);
+        return count;
+    }
+    edge = cover * ((float)(left + 1) - low_x);
+    row[count++] = ci_run_make((unsigned short)left, row_y, edge);
+    if (edge != cover)
+        row[count++] = ci_run_make((unsigned short)(left + 1), row_y,
+            cover - edge);
+    edge = cover * (high_x - (float)right);
+    row[count++] = ci_run_make((unsigned short)right, row_y,
+        edge - cover);
+    if (edge != 0.0f)
+        row[count++] = ci_run_make((unsigned short)(right + 1), row_y,
+            -edge);
+    return count;
+}
+
+/* Begin a walk over the clip runs of rows top through bottom - 1. */
+static void ci_clip_start(ci_canvas_t const *ctx, ci_clip_cursor_t *cursor,
+    int top, int bottom)
+{
+    int first = (int)ci_floorf(ctx->clip_low.y);
+    cursor->y = CI_MAX(top, first);
+    cursor->bottom = CI_MIN(bottom, (int)ci_ceilf(ctx->clip_high.y));
+    cursor->count = 0;
+    cursor->index = 0;
+    if (ctx->clip_kind == CI_CLIP_RUNS && cursor->y < cursor->bottom) {
+        cursor->index = ctx->mask_rows.data[cursor->y - first];
+        cursor->count = ctx->mask_rows.data[cursor->bottom - first];
+    }
+}
+
+/* Get the next clip run without consuming it, or NULL at the end. */
+static ci_pixel_run_t const *ci_clip_peek(ci_canvas_t const *ctx,
+    ci_clip_cursor_t *cursor)
+{
+    if (ctx->clip_kind == CI_CLIP_RUNS)
+        return cursor->index < cursor->count ?
+            &ctx->mask.data[cursor->index] : NULL;
+    while (cursor->index == cursor->count) {
+        if (cursor->y >= cursor->bottom)
+            return NULL;
+        cursor->count = ci_clip_row(ctx, cursor->y++, cursor->row);
+        cursor->index = 0;
+    }
+    return &cursor->row[cursor->index];
+}
+
+/* Find whether the lines enclose a single axis-aligned rectangle, and if
+   so get its bounds clamped to the canvas.  Subpaths of a lone point,
+   such as the one left open by closing a path, enclose nothing. */
+static int ci_lines_rectangle(ci_canvas_t const *ctx,
+    ci_xy_t *low, ci_xy_t *high)
+{
+    ci_xy_t const *corner = NULL;
+    size_t subpath, index = 0, count = 0;
+    float w = (float)ctx->size_x;
+    float h = (float)ctx->size_y;
+    for (subpath = 0; subpath < ctx->lines.subpaths.size; ++subpath) {
+        size_t points = ctx->lines.subpaths.data[subpath].count;
+        if (points > 1) {
+            if (corner)
+                return 0;
+            corner = &ctx->lines.points.data[index];
+            count = points;
+        }
+        index += points;
+    }
+    if (!corner || (count != 4 && count != 5) ||
+        (count == 5 && (corner[4].x != corner[0].x ||
+                        corner[4].y != corner[0].y)))
+        return 0;
+    if (!((corner[0].x == corner[1].x && corner[1].y == corner[2].y &&
+           corner[2].x == corner[3].x && corner[3].y == corner[0].y) ||
+          (corner[0].y == corner[1].y && corner[1].x == corner[2].x &&
+           corner[2].y == corner[3].y && corner[3].x == corner[0].x)))
+        return 0;
+    low->x = CI_CLAMP(CI_MIN(corner[0].x, corner[2].x), 0.0f, w);
+    low->y = CI_CLAMP(CI_MIN(corner[0].y, corner[2].y), 0.0f, h);
+    high->x = CI_CLAMP(CI_MAX(corner[0].x, corner[2].x), 0.0f, w);
+    high->y = CI_CLAMP(CI_MAX(corner[0].y, corner[2].y), 0.0f, h);
+    return 1;
+}
+
+
+/* ======== PAINT PIXEL ======== */
+
+/* Footprint of the bicubic resampling filter for a pattern sample. */
+typedef struct ci_pattern_window {
+    ci_xy_t point;
+    float reciprocal_x, reciprocal_y;
+    int left, top, right, bottom;
+} ci_pattern_window_t;
+
+/* Set up the filter footprint for a pattern sample at a point already in
+   pattern space.  Returns 0 when the point falls outside a non-repeating
+   pattern and the sample is transparent. */
+static int ci_pattern_window(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush, ci_xy_t point,
+    ci_pattern_window_t *window)
+{
+    float w = (float)brush->width;
+    float h = (float)brush->height;
+    float scale_x, scale_y;
+    if (((brush->repetition & 2) &&
+         (point.x < 0.0f || w <= point.x)) ||
+        ((brush->repetition & 1) &&
+         (point.y < 0.0f || h <= point.y)))
+        return 0;
+    scale_x = ci_fabsf(ctx->inverse.a) +
+        ci_fabsf(ctx->inverse.c);
+    scale_y = ci_fabsf(ctx->inverse.b) +
+        ci_fabsf(ctx->inverse.d);
+    scale_x = CI_MAX(1.0f, CI_MIN(scale_x, w * 0.25f));
+    scale_y = CI_MAX(1.0f, CI_MIN(scale_y, h * 0.25f));
+    window->reciprocal_x = 1.0f / scale_x;
+    window->reciprocal_y = 1.0f / scale_y;
+    point = ci_xy_sub(point, ci_xy_make(0.5f, 0.5f));
+    window->point = point;
+    window->left = (int)ci_ceilf(point.x - scale_x * 2.0f);
+    window->top = (int)ci_ceilf(point.y - scale_y * 2.0f);
+    window->right = (int)ci_ceilf(point.x + scale_x * 2.0f);
+    window->bottom = (int)ci_ceilf(point.y + scale_y * 2.0f);
+    return 1;
+}
+
+/* Bicubic (a = -0.5) filter weight at a distance in texels. */
+static float ci_bicubic_weight(float distance)
+{
+    return distance < 1.0f ?
+        (1.5f * distance - 2.5f) * distance * distance + 1.0f :
+        ((-0.5f * distance + 2.5f) * distance - 4.0f) * distance + 2.0f;
+}
+
+/* Map a texel coordinate into the pattern, wrapping for repeating
+   patterns or clamping to the edge for drawn images. */
+static int ci_pattern_texel(int coordinate, int size, int is_image)
+{
+    int wrapped = coordinate % size;
+    if (wrapped < 0)
+        wrapped += size;
+    if (is_image)
+        wrapped = CI_CLAMP(coordinate, 0, size - 1);
+    return wrapped;
+}
+
+/* Compute the gradient offset for a point already in brush space.
+   Returns 0 when the gradient is undefined there and the sample is
+   transparent. */
+static int ci_gradient_offset(ci_paint_brush_t const *brush,
+    ci_xy_t point, float *grad_offset)
+{
+    ci_xy_t relative = ci_xy_sub(point, brush->start);
+    ci_xy_t line = ci_xy_sub(brush->end, brush->start);
+    float gradient = ci_dot(relative, line);
+    float span = ci_dot(line, line);
+    if (brush->type == CI_PAINT_CONIC) {
+        float dx = point.x - brush->start.x;
+        float dy = point.y - brush->start.y;
+        float angle = ci_atan2f(dy, dx) - brush->start_radius;
+        *grad_offset = angle / 6.28318531f;
+        *grad_offset = *grad_offset - ci_floorf(*grad_offset);
+    } else if (brush->type == CI_PAINT_LINEAR) {
+        if (span == 0.0f)
+            return 0;
+        *grad_offset = gradient / span;
+    } else {
+        float initial = brush->start_radius;
+        float change = brush->end_radius - initial;
+        float a_coeff = span - change * change;
+        float b_coeff = -2.0f * (gradient + initial * change);
+        float c_coeff = ci_dot(relative, relative) -
+            initial * initial;
+        float disc = b_coeff * b_coeff -
+            4.0f * a_coeff * c_coeff;
+        float root, recip, off1, off2, r1, r2;
+        if (disc < 0.0f || (span == 0.0f && change == 0.0f))
+            return 0;
+        root = ci_sqrtf(disc);
+        recip = 1.0f / (2.0f * a_coeff);
+        off1 = (-b_coeff - root) * recip;
+        off2 = (-b_coeff + root) * recip;
+        r1 = initial + change * off1;
+        r2 = initial + change * off2;
+        if (r2 >= 0.0f)
+            *grad_offset = off2;
+        else if (r1 >= 0.0f)
+            *grad_offset = off1;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+/* Index of the first color stop strictly after the offset. */
+static size_t ci_gradient_stop(ci_paint_brush_t const *brush,
+    float grad_offset)
+{
+    size_t lo = 0, hi = brush->stops.size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (brush->stops.data[mid] <= grad_offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static ci_rgba_t ci_paint_pixel(ci_canvas_t *ctx, ci_xy_t point,
+    ci_paint_brush_t const *brush)
+{
+    if (brush->colors.size == 0)
+        return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
+    if (brush->type == CI_PAINT_COLOR)
+        return brush->colors.data[0];
+    point = ci_affine_mul(ctx->inverse, point);
+    if (brush->type == CI_PAINT_PATTERN) {
+        ci_pattern_window_t window;
+        int pattern_y;
+        ci_rgba_t total_color;
+        float total_weight;
+        int is_image = (brush == &ctx->image_brush);
+        if (!ci_pattern_window(ctx, brush, point, &window))
+            return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
+        total_color = ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
+        total_weight = 0.0f;
+        for (pattern_y = window.top; pattern_y < window.bottom;
+             ++pattern_y) {
+            float weight_y = ci_bicubic_weight(ci_fabsf(
+                window.reciprocal_y * ((float)pattern_y - window.point.y)));
+            int wrapped_y = ci_pattern_texel(pattern_y, brush->height,
+                is_image);
+            int pattern_x;
+            for (pattern_x = window.left; pattern_x < window.right;
+                 ++pattern_x) {
+                float weight_x = ci_bicubic_weight(ci_fabsf(
+                    window.reciprocal_x *
+                    ((float)pattern_x - window.point.x)));
+                int wrapped_x = ci_pattern_texel(pattern_x, brush->width,
+                    is_image);
+                float weight = weight_x * weight_y;
+                size_t idx = (size_t)(wrapped_y * brush->width +
+                    wrapped_x);
+                total_color = ci_rgba_add(total_color,
+                    ci_rgba_scale(weight,
+                        brush->colors.data[idx]));
+                total_weight += weight;
+            }
+        }
+        return ci_rgba_scale(1.0f / total_weight, total_color);
+    }
+    /* gradient */
     {
-        int rx = -1, ry = -1;
-        float rsum = 0.0f;
-        for (idx = 0; idx < ctx->runs.size; ++idx) {
-            ci_pixel_run_t nxt = ctx->runs.data[idx];
-            float coverage = CI_MIN(ci_fabsf(rsum), 1.0f);
-            int rto = nxt.y == ry ? nxt.x : rx + 1;
-            if (coverage >= 1.0f / 8160.0f)
-                for (; rx < rto; ++rx)
-                    ctx->shadow.data[
-                        (size_t)(ry - top_val) * w +
-                        (size_t)(rx - left_val)] = coverage *
-                        ci_paint_pixel(ctx,
-                            ci_xy_sub(ci_xy_make(
-                                (float)rx + 0.5f,
-                                (float)ry + 0.5f), offset),
-                            brush).a;
-            if (nxt.y != ry) rsum = 0.0f;
-            rx = nxt.x;
-            ry = nxt.y;
-            rsum += nxt.delta;
+        float grad_offset, mix;
+        size_t idx;
+        ci_rgba_t delta;
+        if (!ci_gradient_offset(brush, point, &grad_offset))
+            return ci_rgba_make(0.0f, 0.0f, 0.0f, 0.0f);
+        idx = ci_gradient_stop(brush, grad_offset);
+        if (idx == 0)
+            return ci_premultiplied(brush->colors.data[0]);
+        if (idx == brush->stops.size)
+            return ci_premultiplied(
+                brush->colors.data[brush->stops.size - 1]);
+        mix = (grad_offset - brush->stops.data[idx - 1]) /
+              (brush->stops.data[idx] - brush->stops.data[idx - 1]);
+        delta = ci_rgba_sub(brush->colors.data[idx],
+            brush->colors.data[idx - 1]);
+        return ci_premultiplied(ci_rgba_add(
+            brush->colors.data[idx - 1],
+            ci_rgba_scale(mix, delta)));
+    }
+}
+
+/* Alpha-only counterpart of ci_paint_pixel() for the shadow pass, which
+   needs nothing but the alpha channel.  Produces exactly the .a of the
+   full evaluation while skipping the color channels. */
+static float ci_paint_alpha(ci_canvas_t *ctx, ci_xy_t point,
+    ci_paint_brush_t const *brush)
+{
+    if (brush->colors.size == 0)
+        return 0.0f;
+    if (brush->type == CI_PAINT_COLOR)
+        return brush->colors.data[0].a;
+    point = ci_affine_mul(ctx->inverse, point);
+    if (brush->type == CI_PAINT_PATTERN) {
+        ci_pattern_window_t window;
+        int pattern_y;
+        float total_alpha, total_weight;
+        int is_image = (brush == &ctx->image_brush);
+        if (!ci_pattern_window(ctx, brush, point, &window))
+            return 0.0f;
+        total_alpha = 0.0f;
+        total_weight = 0.0f;
+        for (pattern_y = window.top; pattern_y < window.bottom;
+             ++pattern_y) {
+            float weight_y = ci_bicubic_weight(ci_fabsf(
+                window.reciprocal_y * ((float)pattern_y - window.point.y)));
+            size_t row = (size_t)(ci_pattern_texel(pattern_y,
+                brush->height, is_image) * brush->width);
+            int pattern_x;
+            for (pattern_x = window.left; pattern_x < window.right;
+                 ++pattern_x) {
+                float weight = ci_bicubic_weight(ci_fabsf(
+                    window.reciprocal_x *
+                    ((float)pattern_x - window.point.x))) * weight_y;
+                total_alpha += weight * brush->colors.data[row +
+                    (size_t)ci_pattern_texel(pattern_x, brush->width,
+                        is_image)].a;
+                total_weight += weight;
+            }
+        }
+        return (1.0f / total_weight) * total_alpha;
+    }
+    /* gradient */
+    {
+        float grad_offset, mix;
+        size_t idx;
+        if (!ci_gradient_offset(brush, point, &grad_offset))
+            return 0.0f;
+        idx = ci_gradient_stop(brush, grad_offset);
+        if (idx == 0)
+            return brush->colors.data[0].a;
+        if (idx == brush->stops.size)
+            return brush->colors.data[brush->stops.size - 1].a;
+        mix = (grad_offset - brush->stops.data[idx - 1]) /
+              (brush->stops.data[idx] - brush->stops.data[idx - 1]);
+        return brush->colors.data[idx - 1].a + mix *
+            (brush->colors.data[idx].a - brush->colors.data[idx - 1].a);
+    }
+}
+
+/* ======== SHADOW CACHE ======== */
+
+/* Default memory cap for blurred shadow masks kept for reuse. */
+#define CI_SHADOW_CACHE_LIMIT (4 << 20)
+
+/* Steps per pixel to which outline points are rounded before they are
+   compared, so that shapes that come out the same after a translation
+   but for rounding share a mask.  Points closer than this to the same
+   step may still round apart, and only miss the cache. */
+#define CI_SHADOW_CACHE_STEPS 64.0f
+
+static size_t ci_shadow_mask_bytes(ci_shadow_mask_t const *mask)
+{
+    return sizeof(ci_shadow_mask_t) + sizeof(int) +
+        mask->outline.points.size * sizeof(ci_xy_t) +
+        mask->outline.subpaths.size * sizeof(ci_subpath_data_t) +
+        mask->alpha.size * sizeof(float);
+}
+
+/* Take a mask out of the chain from least to most recently used. */
+static void ci_shadow_mask_unlink(ci_shadow_cache_t *cache, int index)
+{
+    ci_shadow_mask_t *mask = &cache->masks.data[index - 1];
+    if (mask->older)
+        cache->masks.data[mask->older - 1].newer = mask->newer;
+    else
+        cache->oldest = mask->newer;
+    if (mask->newer)
+        cache->masks.data[mask->newer - 1].older = mask->older;
+    else
+        cache->newest = mask->older;
+}
+
+/* Put a mask at the most recently used end of the chain. */
+static void ci_shadow_mask_touch(ci_shadow_cache_t *cache, int index)
+{
+    ci_shadow_mask_t *mask = &cache->masks.data[index - 1];
+    mask->older = cache->newest;
+    mask->newer = 0;
+    if (cache->newest)
+        cache->masks.data[cache->newest - 1].newer = index;
+    else
+        cache->oldest = index;
+    cache->newest = index;
+}
+
+/* Find the link in the hash chains that points at the given mask. */
+static int *ci_shadow_mask_link(ci_shadow_cache_t *cache, int index)
+{
+    int *link = &cache->buckets.data[cache->masks.data[index - 1].hash &
+        (cache->buckets.size - 1)];
+    while (*link != index)
+        link = &cache->masks.data[*link - 1].next;
+    return link;
+}
+
+/* Evict the least recently used masks until the rest fit in the limit.
+   The last mask is moved into the place of each one evicted. */
+static void ci_shadow_cache_evict(ci_shadow_cache_t *cache, size_t limit)
+{
+    while (cache->bytes > limit && cache->oldest) {
+        int oldest = cache->oldest;
+        int last = (int)cache->masks.size;
+        ci_shadow_mask_t *mask = &cache->masks.data[oldest - 1];
+        cache->bytes -= ci_shadow_mask_bytes(mask);
+        ci_shadow_mask_unlink(cache, oldest);
+        *ci_shadow_mask_link(cache, oldest) = mask->next;
+        ci_line_path_free(&mask->outline);
+        ci_float_array_free(&mask->alpha);
+        if (oldest != last) {
+            ci_shadow_mask_t *moved = &cache->masks.data[last - 1];
+            *ci_shadow_mask_link(cache, last) = oldest;
+            if (moved->older)
+                cache->masks.data[moved->older - 1].newer = oldest;
+            else
+                cache->oldest = oldest;
+            if (moved->newer)
+                cache->masks.data[moved->newer - 1].older = oldest;
+            else
+                cache->newest = oldest;
+            *mask = *moved;
+        }
+        ci_shadow_mask_array_pop(&cache->masks);
+    }
+}
+
+/* Drop every mask at once, without following the chains. */
+static void ci_shadow_cache_clear(ci_shadow_cache_t *cache)
+{
+    size_t idx;
+    for (idx = 0; idx < cache->masks.size; ++idx) {
+        ci_line_path_free(&cache->masks.data[idx].outline);
+        ci_float_array_free(&cache->masks.data[idx].alpha);
+    }
+    ci_shadow_mask_array_clear(&cache->masks);
+    ci_int_array_clear(&cache->buckets);
+    cache->bytes = 0;
+    cache->oldest = 0;
+    cache->newest = 0;
+}
+
+static void ci_shadow_cache_free(ci_shadow_cache_t *cache)
+{
+    ci_shadow_cache_clear(cache);
+    ci_shadow_mask_array_free(&cache->masks);
+    ci_int_array_free(&cache->buckets);
+    ci_xy_array_free(&cache->outline);
+}
+
+/* Find the anchor for the current lines, the corner of the bounds of
+   their shadow rounded down to the sampling grid, round their points
+   relative to it into the cache's outline and hash those along with
+   the subpath counts.  Only solid brushes qualify, since their alpha is
+   baked into the mask.  Returns 0 when not cacheable. */
+static int ci_shadow_cache_key(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush, int factor,
+    int *anchor_x, int *anchor_y, unsigned long *hash)
+{
+    ci_shadow_cache_t *cache = &ctx->shadow_cache;
+    ci_xy_t low, high, shift;
+    size_t idx, byte;
+    if (cache->limit == 0 || brush->type != CI_PAINT_COLOR ||
+        ctx->lines.points.size == 0)
+        return 0;
+    low = high = ctx->lines.points.data[0];
+    for (idx = 1; idx < ctx->lines.points.size; ++idx) {
+        ci_xy_t point = ctx->lines.points.data[idx];
+        low = ci_xy_make(CI_MIN(low.x, point.x), CI_MIN(low.y, point.y));
+        high = ci_xy_make(CI_MAX(high.x, point.x),
+                          CI_MAX(high.y, point.y));
+    }
+    shift = ci_xy_make(ctx->shadow_offset_x, ctx->shadow_offset_y);
+    low = ci_xy_add(low, shift);
+    high = ci_xy_add(high, shift);
+    if (!(-1.0e6f < low.x && low.x < 1.0e6f &&
+          -1.0e6f < low.y && low.y < 1.0e6f &&
+          high.x - low.x < 32768.0f && high.y - low.y < 32768.0f) ||
+        !ci_xy_array_ensure(&cache->outline, ctx->lines.points.size))
+        return 0;
+    cache->outline.size = ctx->lines.points.size;
+    *anchor_x = (int)ci_floorf(low.x / (float)factor) * factor;
+    *anchor_y = (int)ci_floorf(low.y / (float)factor) * factor;
+    shift = ci_xy_make(ctx->shadow_offset_x - (float)*anchor_x,
+                       ctx->shadow_offset_y - (float)*anchor_y);
+    *hash = 2166136261UL;
+    for (idx = 0; idx < ctx->lines.subpaths.size; ++idx)
+        *hash = ((*hash ^ (unsigned long)
+            ctx->lines.subpaths.data[idx].count) * 16777619UL) &
+            0xffffffffUL;
+    for (idx = 0; idx < ctx->lines.points.size; ++idx) {
+        ci_xy_t point = ci_xy_scale(CI_SHADOW_CACHE_STEPS,
+            ci_xy_add(ctx->lines.points.data[idx], shift));
+        unsigned char const *bytes;
+        point = ci_xy_make(ci_floorf(point.x + 0.5f),
+                           ci_floorf(point.y + 0.5f));
+        cache->outline.data[idx] = point;
+        bytes = (unsigned char const *)&cache->outline.data[idx];
+        for (byte = 0; byte < sizeof(ci_xy_t); ++byte)
+            *hash = ((*hash ^ bytes[byte]) * 16777619UL) & 0xffffffffUL;
+    }
+    return 1;
+}
+
+/* Find a mask made from the same rounded outline as the key just made,
+   with the same blur and opacity. */
+static ci_shadow_mask_t *ci_shadow_cache_find(ci_canvas_t *ctx,
+    unsigned long hash, float opacity)
+{
+    ci_shadow_cache_t *cache = &ctx->shadow_cache;
+    int index;
+    if (!cache->buckets.size)
+        return NULL;
+    for (index = cache->buckets.data[hash & (cache->buckets.size - 1)];
+         index; index = cache->masks.data[index - 1].next) {
+        ci_shadow_mask_t *mask = &cache->masks.data[index - 1];
+        if (mask->hash != hash ||
+            mask->blur != ctx->shadow_blur ||
+            mask->opacity != opacity ||
+            mask->outline.points.size != cache->outline.size ||
+            mask->outline.subpaths.size != ctx->lines.subpaths.size ||
+            memcmp(mask->outline.subpaths.data, ctx->lines.subpaths.data,
+                ctx->lines.subpaths.size * sizeof(ci_subpath_data_t)) ||
+            memcmp(mask->outline.points.data, cache->outline.data,
+                cache->outline.size * sizeof(ci_xy_t)))
+            continue;
+        ci_shadow_mask_unlink(cache, index);
+        ci_shadow_mask_touch(cache, index);
+        return mask;
+    }
+    return NULL;
+}
+
+/* Keep a copy of the freshly blurred w by h shadow buffer along with the
+   rounded outline that produced it, evicting the least recently used
+   masks to stay within the memory cap. */
+static void ci_shadow_cache_store(ci_canvas_t *ctx, unsigned long hash,
+    float opacity, int origin_x, int origin_y, size_t w, size_t h)
+{
+    ci_shadow_cache_t *cache = &ctx->shadow_cache;
+    ci_shadow_mask_t mask;
+    size_t bytes = sizeof(ci_shadow_mask_t) + sizeof(int) +
+        cache->outline.size * sizeof(ci_xy_t) +
+        ctx->lines.subpaths.size * sizeof(ci_subpath_data_t) +
+        w * h * sizeof(float);
+    size_t idx, slot;
+    if (bytes > cache->limit)
+        return;
+    ci_shadow_cache_evict(cache, cache->limit - bytes);
+    if (cache->masks.size >= cache->buckets.size) {
+        size_t buckets = cache->buckets.size ?
+            cache->buckets.size * 2 : 16;
+        ci_int_array_clear(&cache->buckets);
+        if (!ci_int_array_resize(&cache->buckets, buckets)) {
+            ci_shadow_cache_clear(cache);
+            return;
+        }
+        for (idx = 0; idx < cache->masks.size; ++idx) {
+            slot = cache->masks.data[idx].hash & (buckets - 1);
+            cache->masks.data[idx].next = cache->buckets.data[slot];
+            cache->buckets.data[slot] = (int)idx + 1;
         }
     }
-    /* box blur */
+    ci_line_path_init(&mask.outline);
+    ci_float_array_init(&mask.alpha);
+    if (!ci_subpath_array_copy(&mask.outline.subpaths,
+            &ctx->lines.subpaths) ||
+        !ci_xy_array_copy(&mask.outline.points, &cache->outline) ||
+        !ci_float_array_append(&mask.alpha, ctx->shadow.data, w * h) ||
+        !ci_shadow_mask_array_push(&cache->masks, mask)) {
+        ci_line_path_free(&mask.outline);
+        ci_float_array_free(&mask.alpha);
+        return;
+    }
+    slot = hash & (cache->buckets.size - 1);
+    mask.hash = hash;
+    mask.blur = ctx->shadow_blur;
+    mask.opacity = opacity;
+    mask.origin_x = origin_x;
+    mask.origin_y = origin_y;
+    mask.width = w;
+    mask.height = h;
+    mask.next = cache->buckets.data[slot];
+    cache->masks.data[cache->masks.size - 1] = mask;
+    cache->buckets.data[slot] = (int)cache->masks.size;
+    ci_shadow_mask_touch(cache, (int)cache->masks.size);
+    cache->bytes += ci_shadow_mask_bytes(&mask);
+}
+
+/* ======== RENDER SHADOW ======== */
+
+/* Number of adjacent columns blurred together by the vertical passes. */
+#define CI_SHADOW_BLOCK 16
+
+/* Approximate a gaussian of the given variance over the w by h alpha
+   buffer with three box blurs in each direction.  The buffer is followed
+   by enough scratch space for one row or one block of columns. */
+static void ci_blur_shadow(ci_canvas_t *ctx, size_t w, size_t h,
+    float sigma_squared, size_t radius)
+{
+    size_t working = w * h;
+    float alpha_val, divisor, weight_1, weight_2;
+    size_t y_idx;
     alpha_val = (float)(2 * radius + 1) *
         ((float)(radius * (radius + 1)) - sigma_squared) /
         (2.0f * sigma_squared -
@@ -2229,65 +4511,133 @@ static void ci_render_shadow(ci_canvas_t *ctx,
             }
         }
     }
+    /* The vertical passes work on blocks of adjacent columns so that each
+       row access touches one contiguous span instead of striding through
+       the whole buffer once per column.  A partial last block is padded
+       with zeros so the inner loops always run the full block width. */
     {
-        size_t x_idx;
-        for (x_idx = 0; x_idx < w; ++x_idx) {
+        size_t x_base;
+        float *tail = ctx->shadow.data + working;
+        for (x_base = 0; x_base < w; x_base += CI_SHADOW_BLOCK) {
+            size_t lanes = CI_MIN(w - x_base, (size_t)CI_SHADOW_BLOCK);
             int pass;
             for (pass = 0; pass < 3; ++pass) {
-                float running;
-                for (y_idx = 0; y_idx < h; ++y_idx)
-                    ctx->shadow.data[working + y_idx] =
-                        ctx->shadow.data[y_idx * w + x_idx];
-                running = weight_1 *
-                    ctx->shadow.data[working + radius + 1];
+                float running[CI_SHADOW_BLOCK];
+                size_t lane;
+                for (y_idx = 0; y_idx < h; ++y_idx) {
+                    float *out = tail + y_idx * CI_SHADOW_BLOCK;
+                    memcpy(out, ctx->shadow.data + y_idx * w + x_base,
+                        lanes * sizeof(float));
+                    for (lane = lanes; lane < CI_SHADOW_BLOCK; ++lane)
+                        out[lane] = 0.0f;
+                }
+                for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                    running[lane] = weight_1 *
+                        tail[(radius + 1) * CI_SHADOW_BLOCK + lane];
                 for (y_idx = 0; y_idx <= radius; ++y_idx)
-                    running += (weight_1 + weight_2) *
-                        ctx->shadow.data[working + y_idx];
-                ctx->shadow.data[x_idx] = running;
+                    for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                        running[lane] += (weight_1 + weight_2) *
+                            tail[y_idx * CI_SHADOW_BLOCK + lane];
+                memcpy(ctx->shadow.data + x_base, running,
+                    lanes * sizeof(float));
                 for (y_idx = 1; y_idx < h; ++y_idx) {
-                    if (y_idx >= radius + 1)
-                        running -= weight_2 *
-                            ctx->shadow.data[
-                                working + y_idx - radius - 1];
-                    if (y_idx >= radius + 2)
-                        running -= weight_1 *
-                            ctx->shadow.data[
-                                working + y_idx - radius - 2];
-                    if (y_idx + radius < h)
-                        running += weight_2 *
-                            ctx->shadow.data[
-                                working + y_idx + radius];
-                    if (y_idx + radius + 1 < h)
-                        running += weight_1 *
-                            ctx->shadow.data[
-                                working + y_idx + radius + 1];
-                    ctx->shadow.data[y_idx * w + x_idx] = running;
+                    float const *in;
+                    if (y_idx >= radius + 1) {
+                        in = tail + (y_idx - radius - 1) * CI_SHADOW_BLOCK;
+                        for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                            running[lane] -= weight_2 * in[lane];
+                    }
+                    if (y_idx >= radius + 2) {
+                        in = tail + (y_idx - radius - 2) * CI_SHADOW_BLOCK;
+                        for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                            running[lane] -= weight_1 * in[lane];
+                    }
+                    if (y_idx + radius < h) {
+                        in = tail + (y_idx + radius) * CI_SHADOW_BLOCK;
+                        for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                            running[lane] += weight_2 * in[lane];
+                    }
+                    if (y_idx + radius + 1 < h) {
+                        in = tail + (y_idx + radius + 1) * CI_SHADOW_BLOCK;
+                        for (lane = 0; lane < CI_SHADOW_BLOCK; ++lane)
+                            running[lane] += weight_1 * in[lane];
+                    }
+                    memcpy(ctx->shadow.data + y_idx * w + x_base, running,
+                        lanes * sizeof(float));
                 }
             }
         }
     }
-    /* composite shadow */
-    operation = (int)ctx->global_composite_operation;
-    x_var = -1;
-    y_var = -1;
-    sum = 0.0f;
-    for (idx = 0; idx < ctx->mask.size; ++idx) {
-        ci_pixel_run_t nxt = ctx->mask.data[idx];
+}
+
+/* Rebuild one full-resolution row of a shadow blurred at reduced
+   resolution by bilinear interpolation, treating samples beyond the
+   reduced buffer as transparent.  Uses w floats of scratch for the
+   vertically interpolated row. */
+static void ci_upsample_shadow_row(float const *reduced, size_t w,
+    size_t h, int factor, int row, float *scratch,
+    float *out, size_t out_w)
+{
+    float inverse = 1.0f / (float)factor;
+    float v = ((float)row + 0.5f) * inverse - 0.5f;
+    int above = (int)ci_floorf(v);
+    float mix_y = v - (float)above;
+    size_t idx;
+    for (idx = 0; idx < w; ++idx) {
+        float upper = above >= 0 && above < (int)h ?
+            reduced[(size_t)above * w + idx] : 0.0f;
+        float lower = above + 1 >= 0 && above + 1 < (int)h ?
+            reduced[(size_t)(above + 1) * w + idx] : 0.0f;
+        scratch[idx] = upper + mix_y * (lower - upper);
+    }
+    for (idx = 0; idx < out_w; ++idx) {
+        float u = ((float)idx + 0.5f) * inverse - 0.5f;
+        int left = (int)ci_floorf(u);
+        float mix_x = u - (float)left;
+        float near_val = left >= 0 ? scratch[left] : 0.0f;
+        float far_val = left + 1 < (int)w ? scratch[left + 1] : 0.0f;
+        out[idx] = near_val + mix_x * (far_val - near_val);
+    }
+}
+
+/* Composite a blurred shadow buffer of w by h samples, each covering
+   factor by factor pixels with its corner at pixel (left, top), through
+   the clip mask.  Reduced buffers need w * (factor + 1) floats of
+   scratch for upsampling. */
+static void ci_composite_shadow(ci_canvas_t *ctx, float const *source,
+    size_t w, size_t h, int factor, int left, int top, float *scratch)
+{
+    int right = left + (int)w * factor;
+    int bottom = top + (int)h * factor;
+    int operation = (int)ctx->global_composite_operation;
+    int x_var = -1, y_var = -1, row_y = -1;
+    float const *row = source;
+    float sum = 0.0f;
+    ci_clip_cursor_t cursor;
+    ci_pixel_run_t const *clip;
+    ci_clip_start(ctx, &cursor, top, bottom);
+    while ((clip = ci_clip_peek(ctx, &cursor)) != NULL) {
+        ci_pixel_run_t nxt = *clip;
         float visibility = CI_MIN(ci_fabsf(sum), 1.0f);
-        int to_x = CI_MIN(
-            nxt.y == y_var ? nxt.x : x_var + 1,
-            right_val - border);
+        int to_x = CI_MIN(nxt.y == y_var ? nxt.x : x_var + 1, right);
         if (visibility >= 1.0f / 8160.0f &&
-            top_val <= y_var + border &&
-            y_var + border < bottom_val)
+            top <= y_var && y_var < bottom) {
+            if (row_y != y_var) {
+                row_y = y_var;
+                if (factor == 1)
+                    row = source + (size_t)(y_var - top) * w;
+                else {
+                    ci_upsample_shadow_row(source, w, h, factor,
+                        y_var - top, scratch, scratch + w,
+                        w * (size_t)factor);
+                    row = scratch + w;
+                }
+            }
             for (; x_var < to_x; ++x_var) {
                 ci_rgba_t *back = &ctx->bitmap[
                     y_var * ctx->size_x + x_var];
                 ci_rgba_t fore = ci_rgba_scale(
-                    ctx->global_alpha *
-                    ctx->shadow.data[
-                        (size_t)(y_var + border - top_val) * w +
-                        (size_t)(x_var + border - left_val)],
+                    ctx->global_alpha * row[x_var - left],
                     ctx->shadow_color);
                 float mix_fore = operation & 1 ? back->a : 0.0f;
                 float mix_back = operation & 4 ? fore.a : 0.0f;
@@ -2300,11 +4650,153 @@ static void ci_render_shadow(ci_canvas_t *ctx,
                 *back = ci_rgba_add(ci_rgba_scale(visibility, blend),
                     ci_rgba_scale(1.0f - visibility, *back));
             }
+        }
         if (nxt.y != y_var) sum = 0.0f;
-        x_var = CI_MAX((int)nxt.x, left_val - border);
+        x_var = CI_MAX((int)nxt.x, left);
         y_var = nxt.y;
         sum += nxt.delta;
+        ++cursor.index;
+    }
+}
+
+/* Wide shadows are rasterized and blurred at 1/2 or 1/4 resolution and
+   bilinearly upsampled while compositing.  The box average of the
+   reduced rasterization and the bilinear reconstruction add a variance
+   of factor^2 / 4 between them, which is taken back out of the blur so
+   the overall spread matches.  The remaining error against a full
+   resolution blur stays below 1/255 of the shadow alpha for the sigma
+   at which each factor starts (8 and 16 pixels).
+
+   Shadows of solid brushes that lie fully inside the canvas are kept in
+   the shadow cache, so a repeat of the same outline at a translation by
+   whole sampling steps reuses the blurred mask.
+
+   Returns 1 when the runs left behind are the main pass's runs moved by
+   a whole number of pixels, given as the shift back to canvas space,
+   so that the lines need not be scan converted a second time. */
+static int ci_render_shadow(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush, int *shift_x, int *shift_y)
+{
+    float sigma_squared, opacity;
+    size_t radius;
+    int factor, border, margin, extent_x, extent_y;
+    int cacheable, anchor_x = 0, anchor_y = 0;
+    unsigned long hash = 0;
+    ci_shadow_mask_t const *cached;
+    ci_xy_t offset;
+    int left_val, right_val, top_val, bottom_val;
+    size_t w, h, working;
+    size_t idx;
+    if (!ci_shadow_visible(ctx))
+        return 0;
+    sigma_squared = 0.25f * ctx->shadow_blur * ctx->shadow_blur;
+    factor = sigma_squared >= 256.0f ? 4 :
+        sigma_squared >= 64.0f ? 2 : 1;
+    opacity = brush->colors.size ? brush->colors.data[0].a : 0.0f;
+    cacheable = ci_shadow_cache_key(ctx, brush, factor,
+        &anchor_x, &anchor_y, &hash);
+    cached = cacheable ?
+        ci_shadow_cache_find(ctx, hash, opacity) : NULL;
+    if (cached) {
+        ci_float_array_resize(&ctx->shadow,
+            cached->width * (size_t)(factor + 1));
+        ci_composite_shadow(ctx, cached->alpha.data,
+            cached->width, cached->height, factor,
+            anchor_x + cached->origin_x, anchor_y + cached->origin_y,
+            ctx->shadow.data);
+        return 0;
+    }
+    if (factor > 1)
+        sigma_squared = (sigma_squared -
+            0.25f * (float)(factor * factor)) /
+            (float)(factor * factor);
+    radius = (size_t)(0.5f * ci_sqrtf(
+        4.0f * sigma_squared + 1.0f) - 0.5f);
+    border = 3 * ((int)radius + 1);
+    margin = factor * border;
+    extent_x = (ctx->size_x + 2 * margin + factor - 1) / factor;
+    extent_y = (ctx->size_y + 2 * margin + factor - 1) / factor;
+    offset = ci_xy_make((float)margin + ctx->shadow_offset_x,
+                        (float)margin + ctx->shadow_offset_y);
+    ci_lines_to_runs(ctx, offset, 1.0f / (float)factor, 2 * margin);
+    left_val = extent_x;
+    right_val = 0;
+    top_val = extent_y;
+    bottom_val = 0;
+    for (idx = 0; idx < ctx->runs.size; ++idx) {
+        left_val = CI_MIN(left_val, (int)ctx->runs.data[idx].x);
+        right_val = CI_MAX(right_val, (int)ctx->runs.data[idx].x);
+        top_val = CI_MIN(top_val, (int)ctx->runs.data[idx].y);
+        bottom_val = CI_MAX(bottom_val, (int)ctx->runs.data[idx].y);
+    }
+    /* a mask cut off by the edge of the domain is not reusable */
+    if (left_val < border || right_val + border >= extent_x ||
+        top_val < border || bottom_val + border >= extent_y)
+        cacheable = 0;
+    left_val = CI_MAX(left_val - border, 0);
+    right_val = CI_MIN(right_val + border, extent_x) + 1;
+    top_val = CI_MAX(top_val - border, 0);
+    bottom_val = CI_MIN(bottom_val + border, extent_y);
+    w = (size_t)CI_MAX(right_val - left_val, 0);
+    h = (size_t)CI_MAX(bottom_val - top_val, 0);
+    working = w * h;
+    ci_float_array_clear(&ctx->shadow);
+    ci_float_array_resize(&ctx->shadow, working +
+        CI_MAX(CI_MAX(w, h * CI_SHADOW_BLOCK), w * (size_t)(factor + 1)));
+    /* rasterize alpha; a solid brush has the same alpha everywhere, so
+       only gradients and patterns need evaluating per pixel */
+    {
+        int rx = -1, ry = -1;
+        float rsum = 0.0f;
+        float scale = (float)factor;
+        int solid = brush->type == CI_PAINT_COLOR;
+        for (idx = 0; idx < ctx->runs.size; ++idx) {
+            ci_pixel_run_t nxt = ctx->runs.data[idx];
+            float coverage = CI_MIN(ci_fabsf(rsum), 1.0f);
+            int rto = nxt.y == ry ? nxt.x : rx + 1;
+            if (coverage >= 1.0f / 8160.0f) {
+                float *out = ctx->shadow.data +
+                    (size_t)(ry - top_val) * w;
+                if (solid)
+                    for (; rx < rto; ++rx)
+                        out[rx - left_val] = coverage * opacity;
+                else
+                    for (; rx < rto; ++rx)
+                        out[rx - left_val] = coverage *
+                            ci_paint_alpha(ctx,
+                                ci_xy_sub(ci_xy_make(
+                                    ((float)rx + 0.5f) * scale,
+                                    ((float)ry + 0.5f) * scale), offset),
+                                brush);
+            }
+            if (nxt.y != ry) rsum = 0.0f;
+            rx = nxt.x;
+            ry = nxt.y;
+            rsum += nxt.delta;
+        }
     }
+    /* a zero blur leaves the buffer unchanged, so an offset-only shadow
+       goes straight to compositing */
+    if (ctx->shadow_blur > 0.0f)
+        ci_blur_shadow(ctx, w, h, sigma_squared, radius);
+    if (cacheable && working)
+        ci_shadow_cache_store(ctx, hash, opacity,
+            left_val * factor - margin - anchor_x,
+            top_val * factor - margin - anchor_y, w, h);
+    ci_composite_shadow(ctx, ctx->shadow.data, w, h, factor,
+        left_val * factor - margin, top_val * factor - margin,
+        ctx->shadow.data + working);
+    /* the shadow domain covers the whole canvas when the offset is no
+       larger than the border */
+    if (factor == 1 &&
+        offset.x == ci_floorf(offset.x) && offset.y == ci_floorf(offset.y) &&
+        0.0f <= offset.x && offset.x <= (float)(2 * margin) &&
+        0.0f <= offset.y && offset.y <= (float)(2 * margin)) {
+        *shift_x = -(int)offset.x;
+        *shift_y = -(int)offset.y;
+        return 1;
+    }
+    return 0;
 }
 
 /* ======== FILL RULE COVERAGE ======== */
@@ -2324,50 +4816,111 @@ static float ci_fill_coverage(float sum, ci_fill_rule_t rule)
 
 /* ======== RENDER MAIN ======== */
 
-static void ci_render_main(ci_canvas_t *ctx,
+/* Paint pixels from_x through to_x - 1 of a row with the brush at the
+   given path coverage, blended in by the clip visibility. */
+static void ci_render_span(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush, int y, int from_x, int to_x,
+    float coverage, float visibility)
+{
+    int operation = (int)ctx->global_composite_operation;
+    for (; from_x < to_x; ++from_x) {
+        ci_rgba_t *back = &ctx->bitmap[y * ctx->size_x + from_x];
+        ci_rgba_t fore = ci_rgba_scale(
+            coverage * ctx->global_alpha,
+            ci_paint_pixel(ctx,
+                ci_xy_make((float)from_x + 0.5f, (float)y + 0.5f),
+                brush));
+        float mix_fore = operation & 1 ? back->a : 0.0f;
+        float mix_back = operation & 4 ? fore.a : 0.0f;
+        ci_rgba_t blend;
+        if (operation & 2) mix_fore = 1.0f - mix_fore;
+        if (operation & 8) mix_back = 1.0f - mix_back;
+        blend = ci_rgba_add(ci_rgba_scale(mix_fore, fore),
+            ci_rgba_scale(mix_back, *back));
+        blend.a = CI_MIN(blend.a, 1.0f);
+        *back = ci_rgba_add(ci_rgba_scale(visibility, blend),
+            ci_rgba_scale(1.0f - visibility, *back));
+    }
+}
+
+/* With no clip and an operation that leaves uncovered pixels alone,
+   only the path runs need walking.  Spans run on to the right edge at
+   the end of each row, as they would against the full canvas clip. */
+static void ci_render_unclipped(ci_canvas_t *ctx,
     ci_paint_brush_t const *brush)
 {
-    int operation;
     int x_var = -1, y_var = -1;
-    float path_sum = 0.0f, clip_sum = 0.0f;
-    size_t path_index = 0, clip_index = 0;
+    float path_sum = 0.0f, coverage;
+    size_t index;
+    for (index = 0; index < ctx->runs.size; ++index) {
+        ci_pixel_run_t nxt = ctx->runs.data[index];
+        int to_x = nxt.y == y_var ? nxt.x : ctx->size_x;
+        coverage = ci_fill_coverage(path_sum, ctx->fill_rule);
+        if (coverage >= 1.0f / 8160.0f)
+            ci_render_span(ctx, brush, y_var, x_var, to_x,
+                coverage, 1.0f);
+        x_var = nxt.x;
+        if (nxt.y != y_var) {
+            y_var = nxt.y;
+            path_sum = 0.0f;
+        }
+        path_sum += nxt.delta;
+    }
+    coverage = ci_fill_coverage(path_sum, ctx->fill_rule);
+    if (coverage >= 1.0f / 8160.0f)
+        ci_render_span(ctx, brush, y_var, x_var, ctx->size_x,
+            coverage, 1.0f);
+}
+
+static void ci_render_main(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush)
+{
+    int shift_x, shift_y;
     if (ctx->forward.a * ctx->forward.d -
         ctx->forward.b * ctx->forward.c == 0.0f)
         return;
-    ci_render_shadow(ctx, brush);
-    ci_lines_to_runs(ctx, ci_xy_make(0.0f, 0.0f), 0);
+    if (ci_render_shadow(ctx, brush, &shift_x, &shift_y))
+        ci_translate_runs(ctx, shift_x, shift_y);
+    else
+        ci_lines_to_runs(ctx, ci_xy_make(0.0f, 0.0f), 1.0f, 0);
+    ci_render_runs(ctx, brush);
+}
+
+/* Paint the brush through the sorted runs in ctx->runs and the clip. */
+static void ci_render_runs(ci_canvas_t *ctx,
+    ci_paint_brush_t const *brush)
+{
+    int operation, top, bottom;
+    int x_var = -1, y_var = -1;
+    float path_sum = 0.0f, clip_sum = 0.0f;
+    size_t path_index = 0;
+    ci_clip_cursor_t cursor;
+    ci_pixel_run_t const *clip;
     operation = (int)ctx->global_composite_operation;
-    while (clip_index < ctx->mask.size) {
+    if (ctx->clip_kind == CI_CLIP_NONE && operation & 8) {
+        ci_render_unclipped(ctx, brush);
+        return;
+    }
+    top = 0;
+    bottom = ctx->size_y;
+    if (operation & 8) {
+        if (!ctx->runs.size)
+            return;
+        top = ctx->runs.data[0].y;
+        bottom = ctx->runs.data[ctx->runs.size - 1].y + 1;
+    }
+    ci_clip_start(ctx, &cursor, top, bottom);
+    while ((clip = ci_clip_peek(ctx, &cursor)) != NULL) {
         int which = (path_index < ctx->runs.size &&
-            ci_run_compare(&ctx->runs.data[path_index],
-                &ctx->mask.data[clip_index]) < 0);
-        ci_pixel_run_t nxt = which ?
-            ctx->runs.data[path_index] :
-            ctx->mask.data[clip_index];
+            ci_run_compare(&ctx->runs.data[path_index], clip) < 0);
+        ci_pixel_run_t nxt = which ? ctx->runs.data[path_index] : *clip;
         float coverage = ci_fill_coverage(path_sum, ctx->fill_rule);
         float visibility = CI_MIN(ci_fabsf(clip_sum), 1.0f);
         int to_x = nxt.y == y_var ? nxt.x : x_var + 1;
         if ((coverage >= 1.0f / 8160.0f || ~operation & 8) &&
             visibility >= 1.0f / 8160.0f)
-            for (; x_var < to_x; ++x_var) {
-                ci_rgba_t *back = &ctx->bitmap[
-                    y_var * ctx->size_x + x_var];
-                ci_rgba_t fore = ci_rgba_scale(
-                    coverage * ctx->global_alpha,
-                    ci_paint_pixel(ctx,
-                        ci_xy_make((float)x_var + 0.5f,
-                                   (float)y_var + 0.5f), brush));
-                float mix_fore = operation & 1 ? back->a : 0.0f;
-                float mix_back = operation & 4 ? fore.a : 0.0f;
-                ci_rgba_t blend;
-                if (operation & 2) mix_fore = 1.0f - mix_fore;
-                if (operation & 8) mix_back = 1.0f - mix_back;
-                blend = ci_rgba_add(ci_rgba_scale(mix_fore, fore),
-                    ci_rgba_scale(mix_back, *back));
-                blend.a = CI_MIN(blend.a, 1.0f);
-                *back = ci_rgba_add(ci_rgba_scale(visibility, blend),
-                    ci_rgba_scale(1.0f - visibility, *back));
-            }
+            ci_render_span(ctx, brush, y_var, x_var, to_x,
+                coverage, visibility);
         x_var = nxt.x;
         if (nxt.y != y_var) {
             y_var = nxt.y;
@@ -2376,27 +4929,93 @@ static void ci_render_main(ci_canvas_t *ctx,
         }
         if (which)
             path_sum += ctx->runs.data[path_index++].delta;
-        else
-            clip_sum += ctx->mask.data[clip_index++].delta;
+        else {
+            clip_sum += clip->delta;
+            ++cursor.index;
+        }
     }
 }
 
 
 /* ======== CANVAS LIFECYCLE ======== */
 
+/* Parts of the drawing state whose arrays a save leaves shared between
+   the canvas and the new top of the save stack.  Whichever of them is
+   older owns the arrays and the newer only borrows them, so shared parts
+   are never freed by the borrower and are copied before it changes them.
+   Since saves nest, the owner always outlives its borrowers. */
+#define CI_SHARED_LINE_DASH 1u
+#define CI_SHARED_FILL 2u
+#define CI_SHARED_STROKE 4u
+#define CI_SHARED_CLIP 8u
+#define CI_SHARED_FACE 16u
+#define CI_SHARED_ALL 31u
+
+/* Give the canvas its own arrays for the given parts of its state before
+   it changes them.  Parts that are about to be rebuilt from scratch are
+   just dropped rather than copied. */
+static void ci_canvas_unshare(ci_canvas_t *ctx, unsigned parts,
+    int keep)
+{
+    parts &= ctx->shared;
+    ctx->shared &= ~parts;
+    if (parts & CI_SHARED_LINE_DASH) {
+        ci_float_array_t dash = ctx->line_dash;
+        ci_float_array_init(&ctx->line_dash);
+        if (keep)
+            ci_float_array_copy(&ctx->line_dash, &dash);
+    }
+    if (parts & CI_SHARED_FILL)
+        ci_paint_brush_unshare(&ctx->fill_brush, keep);
+    if (parts & CI_SHARED_STROKE)
+        ci_paint_brush_unshare(&ctx->stroke_brush, keep);
+    if (parts & CI_SHARED_CLIP) {
+        ci_run_array_t mask = ctx->mask;
+        ci_size_array_t rows = ctx->mask_rows;
+        ci_run_array_init(&ctx->mask);
+        ci_size_array_init(&ctx->mask_rows);
+        if (keep) {
+            ci_run_array_copy(&ctx->mask, &mask);
+            ci_size_array_copy(&ctx->mask_rows, &rows);
+        }
+    }
+    if (parts & CI_SHARED_FACE) {
+        ci_font_face_t face = ctx->face;
+        if (keep)
+            ci_font_face_copy(&ctx->face, &face);
+        else
+            ci_font_face_init(&ctx->face);
+    }
+}
+
 static void ci_canvas_free_internals(ci_canvas_t *ctx)
 {
     ci_float_array_free(&ctx->shadow);
-    ci_float_array_free(&ctx->line_dash);
-    ci_paint_brush_free(&ctx->fill_brush);
-    ci_paint_brush_free(&ctx->stroke_brush);
+    ci_shadow_cache_free(&ctx->shadow_cache);
+    if (!(ctx->shared & CI_SHARED_LINE_DASH))
+        ci_float_array_free(&ctx->line_dash);
+    if (!(ctx->shared & CI_SHARED_FILL))
+        ci_paint_brush_free(&ctx->fill_brush);
+    if (!(ctx->shared & CI_SHARED_STROKE))
+        ci_paint_brush_free(&ctx->stroke_brush);
     ci_paint_brush_free(&ctx->image_brush);
     ci_bezier_path_free(&ctx->path);
+    ci_flatten_cache_free(&ctx->flattened[0]);
+    ci_flatten_cache_free(&ctx->flattened[1]);
     ci_line_path_free(&ctx->lines);
     ci_line_path_free(&ctx->scratch);
     ci_run_array_free(&ctx->runs);
-    ci_run_array_free(&ctx->mask);
-    ci_font_face_free(&ctx->face);
+    ci_run_array_free(&ctx->sorted_runs);
+    ci_size_array_free(&ctx->run_rows);
+    if (!(ctx->shared & CI_SHARED_CLIP)) {
+        ci_run_array_free(&ctx->mask);
+        ci_size_array_free(&ctx->mask_rows);
+    }
+    if (!(ctx->shared & CI_SHARED_FACE))
+        ci_font_face_free(&ctx->face);
+    ci_glyph_cache_free(&ctx->glyph_cache);
+    ci_int_array_free(&ctx->shaped.glyphs);
+    ci_int_array_free(&ctx->shaped.places);
 }
 
 ci_backend_t const *ci_canvas_cpu_backend(void)
@@ -2415,7 +5034,6 @@ ci_canvas_t *ci_canvas_create_with_backend(int width, int height,
 {
     ci_canvas_t *ctx;
     ci_affine_matrix_t identity;
-    unsigned short y;
     if (width < 1 || width > 32768 || height < 1 || height > 32768)
         return NULL;
     if (!backend) return NULL;
@@ -2443,15 +5061,28 @@ ci_canvas_t *ci_canvas_create_with_backend(int width, int height,
     ctx->line_width = 1.0f;
     ctx->miter_limit = 10.0f;
     ci_float_array_init(&ctx->shadow);
+    ctx->shadow_cache.limit = CI_SHADOW_CACHE_LIMIT;
+    ci_glyph_outline_init(&ctx->glyph_cache.scratch);
+    ctx->glyph_cache.limit = CI_GLYPH_CACHE_LIMIT;
+    ci_int_array_init(&ctx->shaped.glyphs);
+    ci_int_array_init(&ctx->shaped.places);
     ci_float_array_init(&ctx->line_dash);
     ci_paint_brush_init(&ctx->fill_brush);
     ci_paint_brush_init(&ctx->stroke_brush);
     ci_paint_brush_init(&ctx->image_brush);
     ci_bezier_path_init(&ctx->path);
+    ci_flatten_cache_init(&ctx->flattened[0]);
+    ci_flatten_cache_init(&ctx->flattened[1]);
     ci_line_path_init(&ctx->lines);
     ci_line_path_init(&ctx->scratch);
     ci_run_array_init(&ctx->runs);
+    ci_run_array_init(&ctx->sorted_runs);
+    ci_size_array_init(&ctx->run_rows);
+    ctx->clip_kind = CI_CLIP_NONE;
+    ctx->clip_low = ci_xy_make(0.0f, 0.0f);
+    ctx->clip_high = ci_xy_make((float)width, (float)height);
     ci_run_array_init(&ctx->mask);
+    ci_size_array_init(&ctx->mask_rows);
     ci_font_face_init(&ctx->face);
     ctx->bitmap = (ci_rgba_t *)calloc(
         (size_t)(width * height), sizeof(ci_rgba_t));
@@ -2465,12 +5096,6 @@ ci_canvas_t *ci_canvas_create_with_backend(int width, int height,
         0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_color(ctx, CI_STROKE_STYLE,
         0.0f, 0.0f, 0.0f, 1.0f);
-    for (y = 0; y < ctx->size_y; ++y) {
-        ci_run_array_push(&ctx->mask,
-            ci_run_make(0, y, 1.0f));
-        ci_run_array_push(&ctx->mask,
-            ci_run_make((unsigned short)ctx->size_x, y, -1.0f));
-    }
     return ctx;
 }
 
@@ -2560,6 +5185,14 @@ void ci_canvas_set_shadow_blur(ci_canvas_t *ctx, float level)
         ctx->shadow_blur = level;
 }
 
+void ci_canvas_set_shadow_cache_limit(ci_canvas_t *ctx, int bytes)
+{
+    if (bytes < 0)
+        return;
+    ctx->shadow_cache.limit = (size_t)bytes;
+    ci_shadow_cache_evict(&ctx->shadow_cache, (size_t)bytes);
+}
+
 /* ======== LINE STYLES ======== */
 
 void ci_canvas_set_line_width(ci_canvas_t *ctx, float width)
@@ -2581,6 +5214,7 @@ void ci_canvas_set_line_dash(ci_canvas_t *ctx,
     for (index = 0; index < count; ++index)
         if (segments && segments[index] < 0.0f)
             return;
+    ci_canvas_unshare(ctx, CI_SHARED_LINE_DASH, 0);
     ci_float_array_clear(&ctx->line_dash);
     if (!segments) return;
     for (index = 0; index < count; ++index)
@@ -2592,11 +5226,23 @@ void ci_canvas_set_line_dash(ci_canvas_t *ctx,
 
 /* ======== FILL AND STROKE STYLES ======== */
 
+/* Get the fill or stroke brush ready to be changed, keeping its current
+   colors and stops only when the change builds on them. */
+static ci_paint_brush_t *ci_canvas_brush(ci_canvas_t *ctx,
+    ci_brush_type type, int keep)
+{
+    if (type == CI_FILL_STYLE) {
+        ci_canvas_unshare(ctx, CI_SHARED_FILL, keep);
+        return &ctx->fill_brush;
+    }
+    ci_canvas_unshare(ctx, CI_SHARED_STROKE, keep);
+    return &ctx->stroke_brush;
+}
+
 void ci_canvas_set_color(ci_canvas_t *ctx, ci_brush_type type,
     float red, float green, float blue, float alpha)
 {
-    ci_paint_brush_t *br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
+    ci_paint_brush_t *br = ci_canvas_brush(ctx, type, 0);
     br->type = CI_PAINT_COLOR;
     ci_rgba_array_clear(&br->colors);
     ci_rgba_array_push(&br->colors,
@@ -2608,8 +5254,7 @@ void ci_canvas_set_linear_gradient(ci_canvas_t *ctx,
     ci_brush_type type, float start_x, float start_y,
     float end_x, float end_y)
 {
-    ci_paint_brush_t *br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
+    ci_paint_brush_t *br = ci_canvas_brush(ctx, type, 0);
     br->type = CI_PAINT_LINEAR;
     ci_rgba_array_clear(&br->colors);
     ci_float_array_clear(&br->stops);
@@ -2625,8 +5270,7 @@ void ci_canvas_set_radial_gradient(ci_canvas_t *ctx,
     ci_paint_brush_t *br;
     if (start_radius < 0.0f || end_radius < 0.0f)
         return;
-    br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
+    br = ci_canvas_brush(ctx, type, 0);
     br->type = CI_PAINT_RADIAL;
     ci_rgba_array_clear(&br->colors);
     ci_float_array_clear(&br->stops);
@@ -2640,8 +5284,7 @@ void ci_canvas_set_conic_gradient(ci_canvas_t *ctx,
     ci_brush_type type, float start_angle,
     float center_x, float center_y)
 {
-    ci_paint_brush_t *br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
+    ci_paint_brush_t *br = ci_canvas_brush(ctx, type, 0);
     br->type = CI_PAINT_CONIC;
     ci_rgba_array_clear(&br->colors);
     ci_float_array_clear(&br->stops);
@@ -2652,8 +5295,7 @@ void ci_canvas_set_conic_gradient(ci_canvas_t *ctx,
 void ci_canvas_add_color_stop(ci_canvas_t *ctx, ci_brush_type type,
     float offset, float red, float green, float blue, float alpha)
 {
-    ci_paint_brush_t *br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
+    ci_paint_brush_t *br = ci_canvas_brush(ctx, type, 1);
     ci_rgba_t color;
     /* binary search for insertion point */
     size_t lo = 0, hi = br->stops.size;
@@ -2677,16 +5319,11 @@ void ci_canvas_add_color_stop(ci_canvas_t *ctx, ci_brush_type type,
     ci_float_array_insert(&br->stops, idx, offset);
 }
 
-void ci_canvas_set_pattern(ci_canvas_t *ctx, ci_brush_type type,
+static void ci_paint_brush_set_pattern(ci_paint_brush_t *br,
     unsigned char const *image, int width, int height,
     int stride, ci_repetition_style repetition)
 {
-    ci_paint_brush_t *br;
     int y, x;
-    if (!image || width <= 0 || height <= 0)
-        return;
-    br = type == CI_FILL_STYLE ?
-        &ctx->fill_brush : &ctx->stroke_brush;
     br->type = CI_PAINT_PATTERN;
     ci_rgba_array_clear(&br->colors);
     for (y = 0; y < height; ++y)
@@ -2705,136 +5342,140 @@ void ci_canvas_set_pattern(ci_canvas_t *ctx, ci_brush_type type,
     br->repetition = repetition;
 }
 
+void ci_canvas_set_pattern(ci_canvas_t *ctx, ci_brush_type type,
+    unsigned char const *image, int width, int height,
+    int stride, ci_repetition_style repetition)
+{
+    if (!image || width <= 0 || height <= 0)
+        return;
+    ci_paint_brush_set_pattern(ci_canvas_brush(ctx, type, 0),
+        image, width, height, stride, repetition);
+}
+
 
 /* ---- Path building ---- */
 
-void ci_canvas_begin_path(ci_canvas_t *ctx) {
-    ci_xy_array_clear(&ctx->path.points);
-    ci_subpath_array_clear(&ctx->path.subpaths);
+/* Builders shared by the canvas's current path, which they map into
+   device space, and path objects, which pass no transforms and keep
+   user space. */
+
+static void ci_path_clear(ci_bezier_path_t *path) {
+    ci_xy_array_clear(&path->points);
+    ci_uchar_array_clear(&path->kinds);
+    ci_subpath_array_clear(&path->subpaths);
+    ++path->version;
 }
 
-void ci_canvas_move_to(ci_canvas_t *ctx, float x, float y) {
+static void ci_path_move_to(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward, float x, float y)
+{
     ci_xy_t pt;
     ci_subpath_data_t sp;
-    if (ctx->path.subpaths.size > 0 &&
-        ctx->path.subpaths.data[ctx->path.subpaths.size - 1].count == 1) {
-        ctx->path.points.data[ctx->path.points.size - 1] =
-            ci_affine_mul(ctx->forward, ci_xy_make(x, y));
+    ++path->version;
+    if (path->subpaths.size > 0 &&
+        path->subpaths.data[path->subpaths.size - 1].count == 1) {
+        path->points.data[path->points.size - 1] =
+            ci_affine_apply(forward, ci_xy_make(x, y));
         return;
     }
-    pt = ci_affine_mul(ctx->forward, ci_xy_make(x, y));
+    pt = ci_affine_apply(forward, ci_xy_make(x, y));
     sp = ci_subpath_make(1, 0);
-    ci_xy_array_push(&ctx->path.points, pt);
-    ci_subpath_array_push(&ctx->path.subpaths, sp);
-}
-
-void ci_canvas_close_path(ci_canvas_t *ctx) {
-    ci_xy_t first;
-    ci_affine_matrix_t saved_fwd;
-    ci_affine_matrix_t identity;
-    size_t back_count;
-    if (ctx->path.subpaths.size == 0)
-        return;
-    back_count =
-        ctx->path.subpaths.data[ctx->path.subpaths.size - 1].count;
-    first = ctx->path.points.data[ctx->path.points.size - back_count];
-    saved_fwd = ctx->forward;
-    identity.a = 1.0f; identity.b = 0.0f;
-    identity.c = 0.0f; identity.d = 1.0f;
-    identity.e = 0.0f; identity.f = 0.0f;
-    ctx->forward = identity;
-    ci_canvas_line_to(ctx, first.x, first.y);
-    ctx->path.subpaths.data[ctx->path.subpaths.size - 1].closed = 1;
-    ci_canvas_move_to(ctx, first.x, first.y);
-    ctx->forward = saved_fwd;
+    ci_xy_array_push(&path->points, pt);
+    ci_subpath_array_push(&path->subpaths, sp);
 }
 
-void ci_canvas_line_to(ci_canvas_t *ctx, float x, float y) {
+static void ci_path_line_to(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward, float x, float y)
+{
     ci_xy_t point_1, point_2, diff;
-    if (ctx->path.subpaths.size == 0) {
-        ci_canvas_move_to(ctx, x, y);
+    if (path->subpaths.size == 0) {
+        ci_path_move_to(path, forward, x, y);
         return;
     }
-    point_1 = ctx->path.points.data[ctx->path.points.size - 1];
-    point_2 = ci_affine_mul(ctx->forward, ci_xy_make(x, y));
+    point_1 = path->points.data[path->points.size - 1];
+    point_2 = ci_affine_apply(forward, ci_xy_make(x, y));
     diff = ci_xy_sub(point_2, point_1);
     if (ci_dot(diff, diff) == 0.0f)
         return;
-    ci_xy_array_push(&ctx->path.points, point_1);
-    ci_xy_array_push(&ctx->path.points, point_2);
-    ci_xy_array_push(&ctx->path.points, point_2);
-    ctx->path.subpaths.data[ctx->path.subpaths.size - 1].count += 3;
+    ++path->version;
+    ci_xy_array_push(&path->points, point_2);
+    ci_uchar_array_push(&path->kinds, CI_SEGMENT_LINE);
+    path->subpaths.data[path->subpaths.size - 1].count += 1;
 }
 
-void ci_canvas_quadratic_curve_to(ci_canvas_t *ctx,
+static void ci_path_close(ci_bezier_path_t *path) {
+    ci_xy_t first;
+    size_t back_count;
+    if (path->subpaths.size == 0)
+        return;
+    back_count =
+        path->subpaths.data[path->subpaths.size - 1].count;
+    first = path->points.data[path->points.size - back_count];
+    ci_path_line_to(path, NULL, first.x, first.y);
+    path->subpaths.data[path->subpaths.size - 1].closed = 1;
+    ++path->version;
+    ci_path_move_to(path, NULL, first.x, first.y);
+}
+
+static void ci_path_quadratic_curve_to(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward,
     float cx, float cy, float x, float y)
 {
-    ci_xy_t point_1, control, point_2, control_1, control_2;
-    if (ctx->path.subpaths.size == 0)
-        ci_canvas_move_to(ctx, cx, cy);
-    point_1 = ctx->path.points.data[ctx->path.points.size - 1];
-    control = ci_affine_mul(ctx->forward, ci_xy_make(cx, cy));
-    point_2 = ci_affine_mul(ctx->forward, ci_xy_make(x, y));
-    control_1 = ci_lerp_xy(point_1, control, 2.0f / 3.0f);
-    control_2 = ci_lerp_xy(point_2, control, 2.0f / 3.0f);
-    ci_xy_array_push(&ctx->path.points, control_1);
-    ci_xy_array_push(&ctx->path.points, control_2);
-    ci_xy_array_push(&ctx->path.points, point_2);
-    ctx->path.subpaths.data[ctx->path.subpaths.size - 1].count += 3;
+    ci_xy_t control, point_2;
+    if (path->subpaths.size == 0)
+        ci_path_move_to(path, forward, cx, cy);
+    control = ci_affine_apply(forward, ci_xy_make(cx, cy));
+    point_2 = ci_affine_apply(forward, ci_xy_make(x, y));
+    ++path->version;
+    ci_xy_array_push(&path->points, control);
+    ci_xy_array_push(&path->points, point_2);
+    ci_uchar_array_push(&path->kinds, CI_SEGMENT_QUADRATIC);
+    path->subpaths.data[path->subpaths.size - 1].count += 2;
 }
 
-void ci_canvas_bezier_curve_to(ci_canvas_t *ctx,
-    float c1x, float c1y, float c2x, float c2y,
-    float x, float y)
+static void ci_path_bezier_curve_to(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward,
+    float c1x, float c1y, float c2x, float c2y, float x, float y)
 {
     ci_xy_t ctrl_1, ctrl_2, point_2;
-    if (ctx->path.subpaths.size == 0)
-        ci_canvas_move_to(ctx, c1x, c1y);
-    ctrl_1 = ci_affine_mul(ctx->forward, ci_xy_make(c1x, c1y));
-    ctrl_2 = ci_affine_mul(ctx->forward, ci_xy_make(c2x, c2y));
-    point_2 = ci_affine_mul(ctx->forward, ci_xy_make(x, y));
-    ci_xy_array_push(&ctx->path.points, ctrl_1);
-    ci_xy_array_push(&ctx->path.points, ctrl_2);
-    ci_xy_array_push(&ctx->path.points, point_2);
-    ctx->path.subpaths.data[ctx->path.subpaths.size - 1].count += 3;
+    if (path->subpaths.size == 0)
+        ci_path_move_to(path, forward, c1x, c1y);
+    ctrl_1 = ci_affine_apply(forward, ci_xy_make(c1x, c1y));
+    ctrl_2 = ci_affine_apply(forward, ci_xy_make(c2x, c2y));
+    point_2 = ci_affine_apply(forward, ci_xy_make(x, y));
+    ++path->version;
+    ci_xy_array_push(&path->points, ctrl_1);
+    ci_xy_array_push(&path->points, ctrl_2);
+    ci_xy_array_push(&path->points, point_2);
+    ci_uchar_array_push(&path->kinds, CI_SEGMENT_CUBIC);
+    path->subpaths.data[path->subpaths.size - 1].count += 3;
 }
 
-void ci_canvas_arc_to(ci_canvas_t *ctx,
-    float vx, float vy, float x, float y, float radius)
+/* Adds an elliptical arc from the current point, which must be where
+   it starts, mapping its center and axes into device space. */
+static void ci_path_sweep(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward, ci_xy_t center,
+    ci_xy_t axis_1, ci_xy_t axis_2, float from, float span)
 {
-    ci_xy_t point_1, vertex, point_2, edge_1, edge_2, offset, center;
-    float sine, angle_1, angle_2;
-    int reverse;
-    static float const epsilon = 1.0e-4f;
-    float det = ctx->forward.a * ctx->forward.d -
-                ctx->forward.b * ctx->forward.c;
-    if (radius < 0.0f || det == 0.0f)
-        return;
-    if (ctx->path.subpaths.size == 0)
-        ci_canvas_move_to(ctx, vx, vy);
-    point_1 = ci_affine_mul(ctx->inverse,
-        ctx->path.points.data[ctx->path.points.size - 1]);
-    vertex = ci_xy_make(vx, vy);
-    point_2 = ci_xy_make(x, y);
-    edge_1 = ci_normalized(ci_xy_sub(point_1, vertex));
-    edge_2 = ci_normalized(ci_xy_sub(point_2, vertex));
-    sine = (float)fabs((double)ci_dot(ci_perpendicular(edge_1), edge_2));
-    if (sine < epsilon) {
-        ci_canvas_line_to(ctx, vx, vy);
-        return;
-    }
-    offset = ci_xy_scale(radius / sine, ci_xy_add(edge_1, edge_2));
-    center = ci_xy_add(vertex, offset);
-    angle_1 = ci_direction(ci_xy_sub(
-        ci_xy_scale(ci_dot(offset, edge_1), edge_1), offset));
-    angle_2 = ci_direction(ci_xy_sub(
-        ci_xy_scale(ci_dot(offset, edge_2), edge_2), offset));
-    reverse = (int)ci_floorf((angle_2 - angle_1) / 3.14159265f) & 1;
-    ci_canvas_arc(ctx, center.x, center.y, radius,
-        angle_1, angle_2, reverse);
+    ci_xy_t end;
+    center = ci_affine_apply(forward, center);
+    axis_1 = ci_affine_apply_vector(forward, axis_1);
+    axis_2 = ci_affine_apply_vector(forward, axis_2);
+    end = ci_xy_add(center, ci_xy_add(
+        ci_xy_scale(ci_cosf(from + span), axis_1),
+        ci_xy_scale(ci_sinf(from + span), axis_2)));
+    ++path->version;
+    ci_xy_array_push(&path->points, center);
+    ci_xy_array_push(&path->points, axis_1);
+    ci_xy_array_push(&path->points, axis_2);
+    ci_xy_array_push(&path->points, ci_xy_make(from, span));
+    ci_xy_array_push(&path->points, end);
+    ci_uchar_array_push(&path->kinds, CI_SEGMENT_ARC);
+    path->subpaths.data[path->subpaths.size - 1].count += 5;
 }
 
-void ci_canvas_arc(ci_canvas_t *ctx,
+static void ci_path_arc(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward,
     float x, float y, float radius,
     float start_angle, float end_angle,
     int counter_clockwise)
@@ -2844,8 +5485,6 @@ void ci_canvas_arc(ci_canvas_t *ctx,
     float from = ci_fmodf(start_angle, tau);
     float span = ci_fmodf(end_angle, tau) - from;
     ci_xy_t centered_1;
-    int steps, step;
-    float segment, alpha;
     if (radius < 0.0f)
         return;
     if ((end_angle - start_angle) * winding >= tau)
@@ -2854,30 +5493,51 @@ void ci_canvas_arc(ci_canvas_t *ctx,
         span += tau * winding;
     centered_1 = ci_xy_scale(radius,
         ci_xy_make(ci_cosf(from), ci_sinf(from)));
-    ci_canvas_line_to(ctx, x + centered_1.x, y + centered_1.y);
+    ci_path_line_to(path, forward, x + centered_1.x, y + centered_1.y);
     if (span == 0.0f)
         return;
-    steps = (int)CI_MAX(1.0f,
-        ci_roundf(16.0f / tau * span * winding));
-    segment = span / (float)steps;
-    alpha = 4.0f / 3.0f * ci_tanf(0.25f * segment);
-    for (step = 0; step < steps; ++step) {
-        float angle = from + (float)(step + 1) * segment;
-        ci_xy_t centered_2 = ci_xy_scale(radius,
-            ci_xy_make(ci_cosf(angle), ci_sinf(angle)));
-        ci_xy_t pt1 = ci_xy_add(ci_xy_make(x, y), centered_1);
-        ci_xy_t pt2 = ci_xy_add(ci_xy_make(x, y), centered_2);
-        ci_xy_t c1 = ci_xy_add(pt1,
-            ci_xy_scale(alpha, ci_perpendicular(centered_1)));
-        ci_xy_t c2 = ci_xy_sub(pt2,
-            ci_xy_scale(alpha, ci_perpendicular(centered_2)));
-        ci_canvas_bezier_curve_to(ctx,
-            c1.x, c1.y, c2.x, c2.y, pt2.x, pt2.y);
-        centered_1 = centered_2;
+    ci_path_sweep(path, forward, ci_xy_make(x, y),
+        ci_xy_make(radius, 0.0f), ci_xy_make(0.0f, radius), from, span);
+}
+
+static void ci_path_arc_to(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward, ci_affine_matrix_t const *inverse,
+    float vx, float vy, float x, float y, float radius)
+{
+    ci_xy_t point_1, vertex, point_2, edge_1, edge_2, offset, center;
+    float sine, angle_1, angle_2;
+    int reverse;
+    static float const epsilon = 1.0e-4f;
+    float det = forward ?
+        forward->a * forward->d - forward->b * forward->c : 1.0f;
+    if (radius < 0.0f || det == 0.0f)
+        return;
+    if (path->subpaths.size == 0)
+        ci_path_move_to(path, forward, vx, vy);
+    point_1 = ci_affine_apply(inverse,
+        path->points.data[path->points.size - 1]);
+    vertex = ci_xy_make(vx, vy);
+    point_2 = ci_xy_make(x, y);
+    edge_1 = ci_normalized(ci_xy_sub(point_1, vertex));
+    edge_2 = ci_normalized(ci_xy_sub(point_2, vertex));
+    sine = (float)fabs((double)ci_dot(ci_perpendicular(edge_1), edge_2));
+    if (sine < epsilon) {
+        ci_path_line_to(path, forward, vx, vy);
+        return;
     }
+    offset = ci_xy_scale(radius / sine, ci_xy_add(edge_1, edge_2));
+    center = ci_xy_add(vertex, offset);
+    angle_1 = ci_direction(ci_xy_sub(
+        ci_xy_scale(ci_dot(offset, edge_1), edge_1), offset));
+    angle_2 = ci_direction(ci_xy_sub(
+        ci_xy_scale(ci_dot(offset, edge_2), edge_2), offset));
+    reverse = (int)ci_floorf((angle_2 - angle_1) / 3.14159265f) & 1;
+    ci_path_arc(path, forward, center.x, center.y, radius,
+        angle_1, angle_2, reverse);
 }
 
-void ci_canvas_ellipse(ci_canvas_t *ctx,
+static void ci_path_ellipse(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward,
     float x, float y, float radius_x, float radius_y,
     float rotation, float start_angle, float end_angle,
     int counter_clockwise)
@@ -2888,10 +5548,7 @@ void ci_canvas_ellipse(ci_canvas_t *ctx,
     float span = ci_fmodf(end_angle, tau) - from;
     float cos_rot = ci_cosf(rotation);
     float sin_rot = ci_sinf(rotation);
-    ci_xy_t ellipse_1;
-    float ex, ey;
-    int steps, step;
-    float segment, alpha;
+    ci_xy_t axis_1, axis_2, ellipse_1;
     if (radius_x < 0.0f || radius_y < 0.0f)
         return;
     if ((end_angle - start_angle) * winding >= tau)
@@ -2899,55 +5556,30 @@ void ci_canvas_ellipse(ci_canvas_t *ctx,
     else if (span * winding < 0.0f)
         span += tau * winding;
     /* point on the ellipse: rotate( rx*cos(t), ry*sin(t) ) + center */
-    ex = ci_cosf(from);
-    ey = ci_sinf(from);
-    ellipse_1 = ci_xy_make(
-        radius_x * ex * cos_rot - radius_y * ey * sin_rot,
-        radius_x * ex * sin_rot + radius_y * ey * cos_rot);
-    ci_canvas_line_to(ctx, x + ellipse_1.x, y + ellipse_1.y);
+    axis_1 = ci_xy_make(radius_x * cos_rot, radius_x * sin_rot);
+    axis_2 = ci_xy_make(-radius_y * sin_rot, radius_y * cos_rot);
+    ellipse_1 = ci_xy_add(ci_xy_scale(ci_cosf(from), axis_1),
+        ci_xy_scale(ci_sinf(from), axis_2));
+    ci_path_line_to(path, forward, x + ellipse_1.x, y + ellipse_1.y);
     if (span == 0.0f)
         return;
-    steps = (int)CI_MAX(1.0f,
-        ci_roundf(16.0f / tau * span * winding));
-    segment = span / (float)steps;
-    alpha = 4.0f / 3.0f * ci_tanf(0.25f * segment);
-    for (step = 0; step < steps; ++step) {
-        float angle = from + (float)(step + 1) * segment;
-        float ca = ci_cosf(angle);
-        float sa = ci_sinf(angle);
-        /* tangent on the ellipse: rotate( -rx*sin(t), ry*cos(t) ) */
-        ci_xy_t tangent_1 = ci_xy_make(
-            -radius_x * ey * cos_rot - radius_y * ex * sin_rot,
-            -radius_x * ey * sin_rot + radius_y * ex * cos_rot);
-        ci_xy_t ellipse_2 = ci_xy_make(
-            radius_x * ca * cos_rot - radius_y * sa * sin_rot,
-            radius_x * ca * sin_rot + radius_y * sa * cos_rot);
-        ci_xy_t tangent_2 = ci_xy_make(
-            -radius_x * sa * cos_rot - radius_y * ca * sin_rot,
-            -radius_x * sa * sin_rot + radius_y * ca * cos_rot);
-        ci_xy_t pt1 = ci_xy_add(ci_xy_make(x, y), ellipse_1);
-        ci_xy_t pt2 = ci_xy_add(ci_xy_make(x, y), ellipse_2);
-        ci_xy_t c1 = ci_xy_add(pt1, ci_xy_scale(alpha, tangent_1));
-        ci_xy_t c2 = ci_xy_sub(pt2, ci_xy_scale(alpha, tangent_2));
-        ci_canvas_bezier_curve_to(ctx,
-            c1.x, c1.y, c2.x, c2.y, pt2.x, pt2.y);
-        ellipse_1 = ellipse_2;
-        ex = ca;
-        ey = sa;
-    }
+    ci_path_sweep(path, forward, ci_xy_make(x, y),
+        axis_1, axis_2, from, span);
 }
 
-void ci_canvas_rectangle(ci_canvas_t *ctx,
+static void ci_path_rectangle(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward,
     float x, float y, float w, float h)
 {
-    ci_canvas_move_to(ctx, x, y);
-    ci_canvas_line_to(ctx, x + w, y);
-    ci_canvas_line_to(ctx, x + w, y + h);
-    ci_canvas_line_to(ctx, x, y + h);
-    ci_canvas_close_path(ctx);
+    ci_path_move_to(path, forward, x, y);
+    ci_path_line_to(path, forward, x + w, y);
+    ci_path_line_to(path, forward, x + w, y + h);
+    ci_path_line_to(path, forward, x, y + h);
+    ci_path_close(path);
 }
 
-void ci_canvas_round_rectangle(ci_canvas_t *ctx,
+static void ci_path_round_rectangle(ci_bezier_path_t *path,
+    ci_affine_matrix_t const *forward, ci_affine_matrix_t const *inverse,
     float x, float y, float w, float h,
     float const *radii, int radii_count)
 {
@@ -3003,12 +5635,85 @@ void ci_canvas_round_rectangle(ci_canvas_t *ctx,
     /* Trace rounded rectangle path:
        top edge -> UR arc -> right edge -> LR arc ->
        bottom edge -> LL arc -> left edge -> UL arc */
-    ci_canvas_move_to(ctx, x + r[0], y);
-    ci_canvas_arc_to(ctx, x + w, y,     x + w, y + h, r[1]);
-    ci_canvas_arc_to(ctx, x + w, y + h, x,     y + h, r[2]);
-    ci_canvas_arc_to(ctx, x,     y + h, x,     y,     r[3]);
-    ci_canvas_arc_to(ctx, x,     y,     x + w, y,     r[0]);
-    ci_canvas_close_path(ctx);
+    ci_path_move_to(path, forward, x + r[0], y);
+    ci_path_arc_to(path, forward, inverse,
+        x + w, y,     x + w, y + h, r[1]);
+    ci_path_arc_to(path, forward, inverse,
+        x + w, y + h, x,     y + h, r[2]);
+    ci_path_arc_to(path, forward, inverse,
+        x,     y + h, x,     y,     r[3]);
+    ci_path_arc_to(path, forward, inverse,
+        x,     y,     x + w, y,     r[0]);
+    ci_path_close(path);
+}
+
+void ci_canvas_begin_path(ci_canvas_t *ctx) {
+    ci_path_clear(&ctx->path);
+}
+
+void ci_canvas_move_to(ci_canvas_t *ctx, float x, float y) {
+    ci_path_move_to(&ctx->path, &ctx->forward, x, y);
+}
+
+void ci_canvas_close_path(ci_canvas_t *ctx) {
+    ci_path_close(&ctx->path);
+}
+
+void ci_canvas_line_to(ci_canvas_t *ctx, float x, float y) {
+    ci_path_line_to(&ctx->path, &ctx->forward, x, y);
+}
+
+void ci_canvas_quadratic_curve_to(ci_canvas_t *ctx,
+    float cx, float cy, float x, float y)
+{
+    ci_path_quadratic_curve_to(&ctx->path, &ctx->forward, cx, cy, x, y);
+}
+
+void ci_canvas_bezier_curve_to(ci_canvas_t *ctx,
+    float c1x, float c1y, float c2x, float c2y,
+    float x, float y)
+{
+    ci_path_bezier_curve_to(&ctx->path, &ctx->forward,
+        c1x, c1y, c2x, c2y, x, y);
+}
+
+void ci_canvas_arc_to(ci_canvas_t *ctx,
+    float vx, float vy, float x, float y, float radius)
+{
+    ci_path_arc_to(&ctx->path, &ctx->forward, &ctx->inverse,
+        vx, vy, x, y, radius);
+}
+
+void ci_canvas_arc(ci_canvas_t *ctx,
+    float x, float y, float radius,
+    float start_angle, float end_angle,
+    int counter_clockwise)
+{
+    ci_path_arc(&ctx->path, &ctx->forward, x, y, radius,
+        start_angle, end_angle, counter_clockwise);
+}
+
+void ci_canvas_ellipse(ci_canvas_t *ctx,
+    float x, float y, float radius_x, float radius_y,
+    float rotation, float start_angle, float end_angle,
+    int counter_clockwise)
+{
+    ci_path_ellipse(&ctx->path, &ctx->forward, x, y, radius_x, radius_y,
+        rotation, start_angle, end_angle, counter_clockwise);
+}
+
+void ci_canvas_rectangle(ci_canvas_t *ctx,
+    float x, float y, float w, float h)
+{
+    ci_path_rectangle(&ctx->path, &ctx->forward, x, y, w, h);
+}
+
+void ci_canvas_round_rectangle(ci_canvas_t *ctx,
+    float x, float y, float w, float h,
+    float const *radii, int radii_count)
+{
+    ci_path_round_rectangle(&ctx->path, &ctx->forward, &ctx->inverse,
+        x, y, w, h, radii, radii_count);
 }
 
 /* ---- Drawing paths ---- */
@@ -3024,22 +5729,40 @@ void ci_canvas_fill(ci_canvas_t *ctx) {
 
 void ci_canvas_stroke(ci_canvas_t *ctx) {
     ci_path_to_lines(ctx, 1);
-    ci_stroke_lines(ctx);
-    ctx->backend->render(ctx, &ctx->stroke_brush);
+    ci_render_stroke(ctx);
 }
 
 void ci_canvas_clip(ci_canvas_t *ctx) {
-    ci_xy_t origin;
+    ci_xy_t origin, low, high;
+    ci_clip_cursor_t cursor;
+    ci_pixel_run_t const *clip;
     size_t part;
-    int y;
+    int y, top, bottom;
     float last, sum_1, sum_2;
     size_t index_1, index_2;
     origin = ci_xy_make(0.0f, 0.0f);
     ci_path_to_lines(ctx, 0);
-    ci_lines_to_runs(ctx, origin, 0);
+    if (ctx->clip_kind != CI_CLIP_RUNS &&
+        ci_lines_rectangle(ctx, &low, &high)) {
+        ctx->clip_low.x = CI_MAX(ctx->clip_low.x, low.x);
+        ctx->clip_low.y = CI_MAX(ctx->clip_low.y, low.y);
+        ctx->clip_high.x = CI_MIN(ctx->clip_high.x, high.x);
+        ctx->clip_high.y = CI_MIN(ctx->clip_high.y, high.y);
+        ctx->clip_kind = CI_CLIP_RECT;
+        return;
+    }
+    ci_lines_to_runs(ctx, origin, 1.0f, 0);
     part = ctx->runs.size;
-    ci_run_array_append(&ctx->runs,
-        ctx->mask.data, ctx->mask.size);
+    top = part ? ctx->runs.data[0].y : 0;
+    bottom = part ? ctx->runs.data[part - 1].y + 1 : 0;
+    ci_clip_start(ctx, &cursor, top, bottom);
+    top = cursor.y;
+    bottom = CI_MAX(cursor.bottom, top);
+    while ((clip = ci_clip_peek(ctx, &cursor)) != NULL) {
+        ci_run_array_push(&ctx->runs, *clip);
+        ++cursor.index;
+    }
+    ci_canvas_unshare(ctx, CI_SHARED_CLIP, 0);
     ci_run_array_clear(&ctx->mask);
     y = -1;
     last = 0.0f;
@@ -3081,6 +5804,20 @@ void ci_canvas_clip(ci_canvas_t *ctx) {
         }
         last = visibility;
     }
+    ctx->clip_kind = CI_CLIP_RUNS;
+    if (!ci_size_array_resize(&ctx->mask_rows,
+            (size_t)(bottom - top + 1))) {
+        ci_run_array_clear(&ctx->mask);
+        bottom = top;
+    }
+    ctx->clip_low = ci_xy_make(0.0f, (float)top);
+    ctx->clip_high = ci_xy_make((float)ctx->size_x, (float)bottom);
+    index_1 = 0;
+    for (y = top; y <= bottom && ctx->mask_rows.size; ++y) {
+        while (index_1 < ctx->mask.size && ctx->mask.data[index_1].y < y)
+            ++index_1;
+        ctx->mask_rows.data[y - top] = index_1;
+    }
 }
 
 int ci_canvas_is_point_in_path(ci_canvas_t *ctx,
@@ -3122,6 +5859,115 @@ int ci_canvas_is_point_in_path(ci_canvas_t *ctx,
     return winding != 0;
 }
 
+/* ---- Path objects ---- */
+
+ci_path2d_t *ci_path2d_create(void)
+{
+    ci_path2d_t *path = (ci_path2d_t *)calloc(1, sizeof(ci_path2d_t));
+    if (!path)
+        return NULL;
+    ci_bezier_path_init(&path->path);
+    ci_flatten_cache_init(&path->fill);
+    ci_flatten_cache_init(&path->stroke);
+    return path;
+}
+
+void ci_path2d_destroy(ci_path2d_t *path)
+{
+    if (!path)
+        return;
+    ci_bezier_path_free(&path->path);
+    ci_flatten_cache_free(&path->fill);
+    ci_flatten_cache_free(&path->stroke);
+    free(path);
+}
+
+void ci_path2d_move_to(ci_path2d_t *path, float x, float y)
+{
+    ci_path_move_to(&path->path, NULL, x, y);
+}
+
+void ci_path2d_close_path(ci_path2d_t *path)
+{
+    ci_path_close(&path->path);
+}
+
+void ci_path2d_line_to(ci_path2d_t *path, float x, float y)
+{
+    ci_path_line_to(&path->path, NULL, x, y);
+}
+
+void ci_path2d_quadratic_curve_to(ci_path2d_t *path,
+    float cx, float cy, float x, float y)
+{
+    ci_path_quadratic_curve_to(&path->path, NULL, cx, cy, x, y);
+}
+
+void ci_path2d_bezier_curve_to(ci_path2d_t *path,
+    float c1x, float c1y, float c2x, float c2y,
+    float x, float y)
+{
+    ci_path_bezier_curve_to(&path->path, NULL,
+        c1x, c1y, c2x, c2y, x, y);
+}
+
+void ci_path2d_arc_to(ci_path2d_t *path,
+    float vx, float vy, float x, float y, float radius)
+{
+    ci_path_arc_to(&path->path, NULL, NULL,
+        vx, vy, x, y, radius);
+}
+
+void ci_path2d_arc(ci_path2d_t *path,
+    float x, float y, float radius,
+    float start_angle, float end_angle,
+    int counter_clockwise)
+{
+    ci_path_arc(&path->path, NULL, x, y, radius,
+        start_angle, end_angle, counter_clockwise);
+}
+
+void ci_path2d_ellipse(ci_path2d_t *path,
+    float x, float y, float radius_x, float radius_y,
+    float rotation, float start_angle, float end_angle,
+    int counter_clockwise)
+{
+    ci_path_ellipse(&path->path, NULL, x, y, radius_x, radius_y,
+        rotation, start_angle, end_angle, counter_clockwise);
+}
+
+void ci_path2d_rectangle(ci_path2d_t *path,
+    float x, float y, float w, float h)
+{
+    ci_path_rectangle(&path->path, NULL, x, y, w, h);
+}
+
+void ci_path2d_round_rectangle(ci_path2d_t *path,
+    float x, float y, float w, float h,
+    float const *radii, int radii_count)
+{
+    ci_path_round_rectangle(&path->path, NULL, NULL,
+        x, y, w, h, radii, radii_count);
+}
+
+void ci_canvas_fill_path(ci_canvas_t *ctx, ci_path2d_t *path)
+{
+    if (!path)
+        return;
+    ci_cached_path_to_lines(ctx, &path->path, &ctx->forward,
+        &path->fill, 0, 1);
+    ctx->backend->render(ctx, &ctx->fill_brush);
+}
+
+void ci_canvas_stroke_path(ci_canvas_t *ctx, ci_path2d_t *path)
+{
+    if (!path)
+        return;
+    ci_cached_path_to_lines(ctx, &path->path, &ctx->forward,
+        &path->stroke, 1, 1);
+    ci_render_stroke(ctx);
+}
+
 /* ---- Drawing rectangles ---- */
 
 void ci_canvas_clear_rectangle(ci_canvas_t *ctx,
@@ -3194,83 +6040,91 @@ void ci_canvas_stroke_rectangle(ci_canvas_t *ctx,
         entry = ci_subpath_make(5, 1);
         ci_subpath_array_push(&ctx->lines.subpaths, entry);
     }
-    ci_stroke_lines(ctx);
-    ctx->backend->render(ctx, &ctx->stroke_brush);
+    ci_render_stroke(ctx);
 }
 
 /* ---- Text ---- */
 
+/* Copy the tables needed for text out of a TrueType font file into an
+   empty face and note where each one starts.  Without copying, the face
+   instead borrows the whole file and notes where its tables already
+   are.  Returns 0 and leaves the face empty if the font is unusable. */
+static int ci_font_face_load(ci_font_face_t *face,
+    unsigned char const *font, int bytes, int copying)
+{
+    int version, tables, index;
+    if (bytes < 6)
+        return 0;
+    version = ((int)font[0] << 24 | (int)font[1] << 16 |
+               (int)font[2] << 8  | (int)font[3]);
+    tables = (int)font[4] << 8 | (int)font[5];
+    if ((version != 0x00010000 && version != 0x74727565) ||
+        bytes < tables * 16 + 12)
+        return 0;
+    if (copying)
+        ci_uchar_array_append(&face->data,
+            font, (size_t)(tables * 16 + 12));
+    else {
+        face->data.data = (unsigned char *)font;
+        face->data.size = (size_t)bytes;
+    }
+    for (index = 0; index < tables; ++index) {
+        int tag = ci_signed_32(&face->data, index * 16 + 12);
+        int offset = ci_signed_32(&face->data, index * 16 + 20);
+        int span = ci_signed_32(&face->data, index * 16 + 24);
+        int place;
+        if (offset < 0 || span < 0 || bytes - offset < span) {
+            ci_font_face_free(face);
+            ci_font_face_init(face);
+            return 0;
+        }
+        place = copying ? (int)face->data.size : offset;
+        if (tag == 0x636d6170)
+            face->cmap = place;
+        else if (tag == 0x47504f53)
+            face->gpos = place;
+        else if (tag == 0x676c7966)
+            face->glyf = place;
+        else if (tag == 0x68656164)
+            face->head = place;
+        else if (tag == 0x68686561)
+            face->hhea = place;
+        else if (tag == 0x686d7478)
+            face->hmtx = place;
+        else if (tag == 0x6b65726e)
+            face->kern = place;
+        else if (tag == 0x6c6f6361)
+            face->loca = place;
+        else if (tag == 0x6d617870)
+            face->maxp = place;
+        else if (tag == 0x4f532f32)
+            face->os_2 = place;
+        else
+            continue;
+        if (copying)
+            ci_uchar_array_append(&face->data,
+                font + offset, (size_t)span);
+    }
+    if (!face->cmap || !face->glyf || !face->head || !face->hhea ||
+        !face->hmtx || !face->loca || !face->maxp || !face->os_2 ||
+        !ci_font_face_map(face) || !ci_font_face_kern(face)) {
+        ci_font_face_free(face);
+        ci_font_face_init(face);
+        return 0;
+    }
+    return 1;
+}
+
 int ci_canvas_set_font(ci_canvas_t *ctx,
     unsigned char const *font, int bytes, float size)
 {
     if (font && bytes) {
-        int version, tables, index;
-        ci_uchar_array_clear(&ctx->face.data);
-        ctx->face.cmap = 0;
-        ctx->face.glyf = 0;
-        ctx->face.gpos = 0;
-        ctx->face.head = 0;
-        ctx->face.hhea = 0;
-        ctx->face.hmtx = 0;
-        ctx->face.kern = 0;
-        ctx->face.loca = 0;
-        ctx->face.maxp = 0;
-        ctx->face.os_2 = 0;
-        if (bytes < 6)
-            return 0;
-        version = ((int)font[0] << 24 | (int)font[1] << 16 |
-                   (int)font[2] << 8  | (int)font[3]);
-        tables = (int)font[4] << 8 | (int)font[5];
-        if ((version != 0x00010000 && version != 0x74727565) ||
-            bytes < tables * 16 + 12)
-            return 0;
-        ci_uchar_array_append(&ctx->face.data,
-            font, (size_t)(tables * 16 + 12));
-        for (index = 0; index < tables; ++index) {
-            int tag = ci_signed_32(&ctx->face.data,
-                index * 16 + 12);
-            int offset = ci_signed_32(&ctx->face.data,
-                index * 16 + 20);
-            int span = ci_signed_32(&ctx->face.data,
-                index * 16 + 24);
-            int place;
-            if (bytes < offset + span) {
-                ci_uchar_array_clear(&ctx->face.data);
-                return 0;
-            }
-            place = (int)ctx->face.data.size;
-            if (tag == 0x636d6170)
-                ctx->face.cmap = place;
-            else if (tag == 0x47504f53)
-                ctx->face.gpos = place;
-            else if (tag == 0x676c7966)
-                ctx->face.glyf = place;
-            else if (tag == 0x68656164)
-                ctx->face.head = place;
-            else if (tag == 0x68686561)
-                ctx->face.hhea = place;
-            else if (tag == 0x686d7478)
-                ctx->face.hmtx = place;
-            else if (tag == 0x6b65726e)
-                ctx->face.kern = place;
-            else if (tag == 0x6c6f6361)
-                ctx->face.loca = place;
-            else if (tag == 0x6d617870)
-                ctx->face.maxp = place;
-            else if (tag == 0x4f532f32)
-                ctx->face.os_2 = place;
-            else
-                continue;
-            ci_uchar_array_append(&ctx->face.data,
-                font + offset, (size_t)span);
-        }
-        if (!ctx->face.cmap || !ctx->face.glyf ||
-            !ctx->face.head || !ctx->face.hhea ||
-            !ctx->face.hmtx || !ctx->face.loca ||
-            !ctx->face.maxp || !ctx->face.os_2) {
-            ci_uchar_array_clear(&ctx->face.data);
+        ci_canvas_unshare(ctx, CI_SHARED_FACE, 0);
+        ci_glyph_cache_evict(&ctx->glyph_cache, 0);
+        ci_font_face_free(&ctx->face);
+        ci_font_face_init(&ctx->face);
+        if (!ci_font_face_load(&ctx->face, font, bytes, 1))
             return 0;
-        }
     }
     if (ctx->face.data.size == 0)
         return 0;
@@ -3282,41 +6136,210 @@ int ci_canvas_set_font(ci_canvas_t *ctx,
     return 1;
 }
 
+static ci_font_t *ci_font_load(unsigned char const *font, int bytes,
+    int copying)
+{
+    ci_font_t *result;
+    if (!font || !bytes)
+        return NULL;
+    result = (ci_font_t *)calloc(1, sizeof(ci_font_t));
+    if (!result)
+        return NULL;
+    ci_font_face_init(&result->face);
+    if (!ci_font_face_load(&result->face, font, bytes, copying)) {
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+ci_font_t *ci_font_create(unsigned char const *font, int bytes)
+{
+    return ci_font_load(font, bytes, 1);
+}
+
+/* The bytes are read in place rather than copied, so the caller must
+   keep them alive and unchanged until the font is destroyed. */
+ci_font_t *ci_font_create_borrowed(unsigned char const *font, int bytes)
+{
+    return ci_font_load(font, bytes, 0);
+}
+
+#if defined(CANVAS_ITY_MMAP)
+/* Map a font file read-only and borrow its bytes.  The mapping is
+   released when the font is destroyed. */
+ci_font_t *ci_font_map_file(char const *path)
+{
+    ci_font_t *result = NULL;
+    struct stat info;
+    int file;
+    if (!path || (file = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(file, &info) == 0 &&
+        info.st_size > 0 && info.st_size <= 0x7fffffff) {
+        size_t bytes = (size_t)info.st_size;
+        void *mapping = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE,
+            file, 0);
+        if (mapping != MAP_FAILED) {
+            result = ci_font_load((unsigned char const *)mapping,
+                (int)bytes, 0);
+            if (result) {
+                result->mapping = mapping;
+                result->mapping_size = bytes;
+            } else
+                munmap(mapping, bytes);
+        }
+    }
+    close(file);
+    return result;
+}
+#endif
+
+void ci_font_destroy(ci_font_t *font)
+{
+    if (!font)
+        return;
+    ci_font_face_free(&font->face);
+#if defined(CANVAS_ITY_MMAP)
+    if (font->mapping)
+        munmap(font->mapping, font->mapping_size);
+#endif
+    free(font);
+}
+
+int ci_canvas_set_font_object(ci_canvas_t *ctx,
+    ci_font_t const *font, float size)
+{
+    if (!font)
+        return 0;
+    ci_canvas_unshare(ctx, CI_SHARED_FACE, 0);
+    ci_glyph_cache_evict(&ctx->glyph_cache, 0);
+    ci_font_face_free(&ctx->face);
+    ctx->face = font->face;
+    ctx->face.borrowed = 1;
+    return ci_canvas_set_font(ctx, NULL, 0, size);
+}
+
+void ci_canvas_set_glyph_cache_limit(ci_canvas_t *ctx, int bytes)
+{
+    if (bytes < 0)
+        return;
+    ctx->glyph_cache.limit = (size_t)bytes;
+    ci_glyph_cache_evict(&ctx->glyph_cache, (size_t)bytes);
+}
+
 void ci_canvas_fill_text(ci_canvas_t *ctx,
     char const *text, float x, float y, float max_width)
 {
-    ci_text_to_lines(ctx, text, ci_xy_make(x, y), max_width, 0);
-    ctx->backend->render(ctx, &ctx->fill_brush);
+    ci_canvas_fill_text_layout(ctx, ci_canvas_shape(ctx, text),
+        x, y, max_width);
 }
 
 void ci_canvas_stroke_text(ci_canvas_t *ctx,
     char const *text, float x, float y, float max_width)
 {
-    ci_text_to_lines(ctx, text, ci_xy_make(x, y), max_width, 1);
-    ci_stroke_lines(ctx);
-    ctx->backend->render(ctx, &ctx->stroke_brush);
+    ci_canvas_stroke_text_layout(ctx, ci_canvas_shape(ctx, text),
+        x, y, max_width);
+}
+
+/* Add each of the texts at its position to the lines, or with caching
+   to the placed runs, so that they can be drawn together. */
+static int ci_texts_to_lines(ci_canvas_t *ctx, char const *const *texts,
+    float const *positions, int count, int caching)
+{
+    int index;
+    ci_text_begin(ctx);
+    for (index = 0; index < count; ++index)
+        if (!ci_text_to_lines(ctx, ci_canvas_shape(ctx, texts[index]),
+                ci_xy_make(positions[2 * index], positions[2 * index + 1]),
+                1.0e30f, 0, caching))
+            return 0;
+    return 1;
+}
+
+/* Fill many texts with the same style in one pass over the canvas.
+   Where texts overlap they are blended once, as the glyphs of a single
+   text would be. */
+void ci_canvas_fill_text_batch(ci_canvas_t *ctx,
+    char const *const *texts, float const *positions, int count)
+{
+    if (!texts || !positions || count <= 0)
+        return;
+    if (ci_glyph_runs_usable(ctx) &&
+        ci_texts_to_lines(ctx, texts, positions, count, 1)) {
+        ci_place_glyph_runs(ctx);
+        ci_render_runs(ctx, &ctx->fill_brush);
+        return;
+    }
+    ci_texts_to_lines(ctx, texts, positions, count, 0);
+    ctx->backend->render(ctx, &ctx->fill_brush);
 }
 
 float ci_canvas_measure_text(ci_canvas_t *ctx,
     char const *text)
 {
-    int hmetrics, width, index, prev_glyph;
-    if (ctx->face.data.size == 0 || !text)
+    return ci_text_layout_measure(ci_canvas_shape(ctx, text));
+}
+
+ci_text_layout_t *ci_text_layout_create(ci_font_t const *font,
+    float size, char const *text)
+{
+    ci_text_layout_t *layout;
+    ci_font_face_t face;
+    if (!font || !text)
+        return NULL;
+    layout = (ci_text_layout_t *)calloc(1, sizeof(ci_text_layout_t));
+    if (!layout)
+        return NULL;
+    ci_int_array_init(&layout->glyphs);
+    ci_int_array_init(&layout->places);
+    face = font->face;
+    face.scale = size / (float)ci_unsigned_16(&face.data, face.head + 18);
+    if (!ci_shape_text(&face, text, layout)) {
+        ci_text_layout_destroy(layout);
+        return NULL;
+    }
+    return layout;
+}
+
+void ci_text_layout_destroy(ci_text_layout_t *layout)
+{
+    if (!layout)
+        return;
+    ci_int_array_free(&layout->glyphs);
+    ci_int_array_free(&layout->places);
+    free(layout);
+}
+
+float ci_text_layout_measure(ci_text_layout_t const *layout)
+{
+    if (!layout || !layout->places.size)
         return 0.0f;
-    hmetrics = ci_unsigned_16(&ctx->face.data,
-        ctx->face.hhea + 34);
-    width = 0;
-    prev_glyph = -1;
-    for (index = 0; text[index]; ) {
-        int glyph = ci_character_to_glyph(ctx, text, &index);
-        int entry = glyph < hmetrics - 1 ? glyph : hmetrics - 1;
-        if (prev_glyph >= 0)
-            width += ci_kern_pair_value(ctx, prev_glyph, glyph);
-        width += ci_unsigned_16(&ctx->face.data,
-            ctx->face.hmtx + entry * 4);
-        prev_glyph = glyph;
+    return (float)layout->places.data[layout->places.size - 1] *
+        layout->scale;
+}
+
+void ci_canvas_fill_text_layout(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, float x, float y, float max_width)
+{
+    ci_text_begin(ctx);
+    if (ci_glyph_runs_usable(ctx) &&
+        ci_text_to_lines(ctx, layout, ci_xy_make(x, y), max_width, 0, 1)) {
+        ci_place_glyph_runs(ctx);
+        ci_render_runs(ctx, &ctx->fill_brush);
+        return;
     }
-    return (float)width * ctx->face.scale;
+    ci_text_begin(ctx);
+    ci_text_to_lines(ctx, layout, ci_xy_make(x, y), max_width, 0, 0);
+    ctx->backend->render(ctx, &ctx->fill_brush);
+}
+
+void ci_canvas_stroke_text_layout(ci_canvas_t *ctx,
+    ci_text_layout_t const *layout, float x, float y, float max_width)
+{
+    ci_text_begin(ctx);
+    ci_text_to_lines(ctx, layout, ci_xy_make(x, y), max_width, 1, 0);
+    ci_render_stroke(ctx);
 }
 
 /* ---- Images ---- */
@@ -3326,22 +6349,13 @@ void ci_canvas_draw_image(ci_canvas_t *ctx,
     int width, int height, int stride,
     float x, float y, float to_width, float to_height)
 {
-    ci_paint_brush_t temp;
     ci_subpath_data_t entry;
     ci_affine_matrix_t saved_fwd, saved_inv;
     if (!image || width <= 0 || height <= 0 ||
         to_width == 0.0f || to_height == 0.0f)
         return;
-    /* swap fill_brush and image_brush */
-    temp = ctx->fill_brush;
-    ctx->fill_brush = ctx->image_brush;
-    ctx->image_brush = temp;
-    ci_canvas_set_pattern(ctx, CI_FILL_STYLE,
+    ci_paint_brush_set_pattern(&ctx->image_brush,
         image, width, height, stride, CI_REPEAT);
-    /* swap back */
-    temp = ctx->fill_brush;
-    ctx->fill_brush = ctx->image_brush;
-    ctx->image_brush = temp;
     ci_xy_array_clear(&ctx->lines.points);
     ci_subpath_array_clear(&ctx->lines.subpaths);
     ci_xy_array_push(&ctx->lines.points,
@@ -3476,24 +6490,25 @@ void ci_canvas_save(ci_canvas_t *ctx) {
     state->shadow_blur = ctx->shadow_blur;
     state->line_width = ctx->line_width;
     state->miter_limit = ctx->miter_limit;
-    ci_float_array_init(&state->line_dash);
-    ci_float_array_copy(&state->line_dash, &ctx->line_dash);
-    ci_paint_brush_init(&state->fill_brush);
-    ci_paint_brush_copy(&state->fill_brush, &ctx->fill_brush);
-    ci_paint_brush_init(&state->stroke_brush);
-    ci_paint_brush_copy(&state->stroke_brush, &ctx->stroke_brush);
-    ci_run_array_init(&state->mask);
-    ci_run_array_copy(&state->mask, &ctx->mask);
-    ci_font_face_init(&state->face);
-    ci_font_face_copy(&state->face, &ctx->face);
+    /* share arrays — the canvas borrows them from here on */
+    state->line_dash = ctx->line_dash;
+    state->fill_brush = ctx->fill_brush;
+    state->stroke_brush = ctx->stroke_brush;
+    state->clip_kind = ctx->clip_kind;
+    state->clip_low = ctx->clip_low;
+    state->clip_high = ctx->clip_high;
+    state->mask = ctx->mask;
+    state->mask_rows = ctx->mask_rows;
+    state->face = ctx->face;
+    state->shared = ctx->shared;
+    ctx->shared = CI_SHARED_ALL;
     state->saves = ctx->saves;
     /* null out arrays that save state does not own */
     state->bitmap = NULL;
     state->size_x = 0;
     state->size_y = 0;
     ci_float_array_init(&state->shadow);
-    ci_xy_array_init(&state->path.points);
-    ci_subpath_array_init(&state->path.subpaths);
+    ci_bezier_path_init(&state->path);
     ci_line_path_init(&state->lines);
     ci_line_path_init(&state->scratch);
     ci_run_array_init(&state->runs);
@@ -3523,27 +6538,35 @@ void ci_canvas_restore(ci_canvas_t *ctx) {
     ctx->shadow_blur = state->shadow_blur;
     ctx->line_width = state->line_width;
     ctx->miter_limit = state->miter_limit;
-    /* swap dynamic arrays — transfer ownership */
-    ci_float_array_free(&ctx->line_dash);
+    /* take back the saved arrays, freeing only those the canvas owns */
+    if (!(ctx->shared & CI_SHARED_LINE_DASH))
+        ci_float_array_free(&ctx->line_dash);
     ctx->line_dash = state->line_dash;
-    ci_float_array_init(&state->line_dash);
-    ci_paint_brush_free(&ctx->fill_brush);
+    if (!(ctx->shared & CI_SHARED_FILL))
+        ci_paint_brush_free(&ctx->fill_brush);
     ctx->fill_brush = state->fill_brush;
-    ci_paint_brush_init(&state->fill_brush);
-    ci_paint_brush_free(&ctx->stroke_brush);
+    if (!(ctx->shared & CI_SHARED_STROKE))
+        ci_paint_brush_free(&ctx->stroke_brush);
     ctx->stroke_brush = state->stroke_brush;
-    ci_paint_brush_init(&state->stroke_brush);
-    ci_run_array_free(&ctx->mask);
+    ctx->clip_kind = state->clip_kind;
+    ctx->clip_low = state->clip_low;
+    ctx->clip_high = state->clip_high;
+    if (!(ctx->shared & CI_SHARED_CLIP)) {
+        ci_run_array_free(&ctx->mask);
+        ci_size_array_free(&ctx->mask_rows);
+    }
     ctx->mask = state->mask;
-    ci_run_array_init(&state->mask);
-    ci_font_face_free(&ctx->face);
+    ctx->mask_rows = state->mask_rows;
+    if (ctx->face.data.data != state->face.data.data)
+        ci_glyph_cache_evict(&ctx->glyph_cache, 0);
+    if (!(ctx->shared & CI_SHARED_FACE))
+        ci_font_face_free(&ctx->face);
     ctx->face = state->face;
-    ci_font_face_init(&state->face);
+    ctx->shared = state->shared;
     ctx->saves = state->saves;
     state->saves = NULL;
     /* free the save state shell */
-    ci_xy_array_free(&state->path.points);
-    ci_subpath_array_free(&state->path.subpaths);
+    ci_bezier_path_free(&state->path);
     ci_xy_array_free(&state->lines.points);
     ci_subpath_array_free(&state->lines.subpaths);
     ci_run_array_free(&state->runs);
@@ -60,5 +60,5 @@ void ci_wasm_set_text_baseline(ci_canvas_t *c, int v)
 EMSCRIPTEN_KEEPALIVE
 int ci_wasm_character_to_glyph(ci_canvas_t *c, char const *text, int *index)
 {
-    return ci_character_to_glyph(c, text, index);
+    return ci_character_to_glyph(&c->face, text, index);
 }
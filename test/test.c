@@ -19,6 +19,7 @@
 /* POSIX feature test macros - must precede all includes */
 #if !defined(_WIN32)
 #define _POSIX_C_SOURCE 199309L
+#define CANVAS_ITY_MMAP
 #endif
 
 #ifdef _WIN32
@@ -531,6 +532,111 @@ static void shadow_blur_composite(ci_canvas_t *ctx, float width, float height)
     ci_canvas_stroke(ctx);
 }
 
+static void shadow_blur_wide(ci_canvas_t *ctx, float width, float height)
+{
+    float x, y;
+    ci_canvas_set_shadow_color(ctx, 0.0f, 0.0f, 0.0f, 1.0f);
+    ctx->shadow_offset_x = 3.5f;
+    ctx->shadow_offset_y = 6.25f;
+    for (y = 0.0f; y < 2.0f; y += 1.0f)
+        for (x = 0.0f; x < 2.0f; x += 1.0f)
+        {
+            ci_canvas_set_shadow_blur(ctx, (y * 2.0f + x) * 16.0f + 16.0f);
+            ci_canvas_set_linear_gradient(ctx, CI_FILL_STYLE,
+                                          x * 0.5f * width, 0.0f,
+                                          (x + 0.5f) * 0.5f * width, 0.0f);
+            ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 0.0f, 1.0f, 0.5f, 0.0f, 1.0f);
+            ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 1.0f, 0.0f, 0.5f, 1.0f, 0.25f);
+            ci_canvas_fill_rectangle(ctx, (x + 0.25f) * 0.5f * width,
+                                     (y + 0.25f) * 0.5f * height,
+                                     0.2f * width, 0.2f * height);
+        }
+}
+
+static void shadow_cache(ci_canvas_t *ctx, float width, float height)
+{
+    float radii[1];
+    int x, y;
+    radii[0] = 0.03f * width;
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.9f, 0.9f, 1.0f, 1.0f);
+    ci_canvas_set_shadow_color(ctx, 0.0f, 0.0f, 0.0f, 0.6f);
+    ctx->shadow_offset_y = 3.0f;
+    ci_canvas_set_shadow_blur(ctx, 6.0f);
+    ci_canvas_set_shadow_cache_limit(ctx, 16384);
+    for (y = 0; y < 4; ++y)
+        for (x = 0; x < 4; ++x)
+        {
+            if (y == 2)
+                ci_canvas_set_shadow_blur(ctx, 20.0f);
+            if (y == 3)
+                ci_canvas_set_shadow_cache_limit(ctx, 0);
+            ci_canvas_set_transform(ctx, 1.0f, 0.0f, 0.0f, 1.0f,
+                                    (float)x * 0.25f * width,
+                                    (float)y * 0.25f * height);
+            ci_canvas_begin_path(ctx);
+            ci_canvas_round_rectangle(ctx, 0.05f * width, 0.05f * height,
+                                      0.15f * width, 0.12f * height,
+                                      radii, 1);
+            ci_canvas_fill(ctx);
+        }
+}
+
+static void shadow_cache_rounding(ci_canvas_t *ctx, float width,
+    float height)
+{
+    /* Shadows of one shape moved by whole pixels, by 1/256 pixel, which
+       rounds to the same 1/64 pixel steps and reuses the mask, and by
+       3/64 pixel, which does not.  The bar shows how many masks are
+       kept: two. */
+    float nudges[4];
+    int index;
+    nudges[0] = 0.0f;
+    nudges[1] = 0.0f;
+    nudges[2] = 1.0f / 256.0f;
+    nudges[3] = 3.0f / 64.0f;
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.9f, 0.9f, 1.0f, 1.0f);
+    ci_canvas_set_shadow_color(ctx, 0.0f, 0.0f, 0.0f, 0.6f);
+    ctx->shadow_offset_y = 4.0f;
+    ci_canvas_set_shadow_blur(ctx, 8.0f);
+    for (index = 0; index < 4; ++index)
+        ci_canvas_fill_rectangle(ctx, 16.0f + (float)(index * 60) +
+                                 nudges[index], 40.0f + nudges[index],
+                                 40.0f, 0.5f * height);
+    ci_canvas_set_shadow_color(ctx, 0.0f, 0.0f, 0.0f, 0.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_fill_rectangle(ctx, 0.05f * width, 0.85f * height,
+                             (float)ctx->shadow_cache.masks.size * 0.2f * width,
+                             0.05f * height);
+}
+
+static void shadow_brush(ci_canvas_t *ctx, float width, float height)
+{
+    unsigned char checker[256];
+    int index;
+    for (index = 0; index < 256; ++index)
+        checker[index] = (unsigned char)(
+            ((index >> 2 & 1) ^ (index >> 5 & 1)) * 255);
+    ci_canvas_set_shadow_color(ctx, 0.0f, 0.0f, 0.5f, 1.0f);
+    ctx->shadow_offset_x = 6.0f;
+    ctx->shadow_offset_y = 6.0f;
+    ci_canvas_set_shadow_blur(ctx, 4.0f);
+    ci_canvas_set_linear_gradient(ctx, CI_FILL_STYLE, 0.1f * width, 0.0f,
+                                  0.9f * width, 0.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f);
+    ci_canvas_fill_rectangle(ctx, 0.1f * width, 0.05f * height,
+                             0.8f * width, 0.25f * height);
+    ci_canvas_set_pattern(ctx, CI_FILL_STYLE, checker, 8, 8, 32, CI_REPEAT);
+    ci_canvas_scale(ctx, 4.0f, 4.0f);
+    ci_canvas_fill_rectangle(ctx, 0.025f * width, 0.0875f * height,
+                             0.2f * width, 0.0625f * height);
+    ci_canvas_set_transform(ctx, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+    ci_canvas_set_shadow_blur(ctx, 0.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.2f, 0.8f, 0.2f, 0.75f);
+    ci_canvas_fill_rectangle(ctx, 0.1f * width, 0.7f * height,
+                             0.8f * width, 0.2f * height);
+}
+
 static void test_line_width(ci_canvas_t *ctx, float width, float height)
 {
     float step;
@@ -1545,6 +1651,84 @@ static void stroke_long(ci_canvas_t *ctx, float width, float height)
     ci_canvas_stroke(ctx);
 }
 
+static void stroke_hairline(ci_canvas_t *ctx, float width, float height)
+{
+    float dash[2];
+    int index, step;
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_begin_path(ctx);
+    for (step = 0; step < 16; ++step)
+    {
+        ci_canvas_move_to(ctx, ((float)(step) + 0.5f) / 16.0f * width, 0.0f);
+        ci_canvas_line_to(ctx, ((float)(step) + 0.5f) / 16.0f * width, height);
+        ci_canvas_move_to(ctx, 0.0f, ((float)(step) + 0.3f) / 16.0f * height);
+        ci_canvas_line_to(ctx, width, ((float)(step) + 0.3f) / 16.0f * height);
+    }
+    ci_canvas_set_line_width(ctx, 0.25f);
+    ci_canvas_stroke(ctx);
+    ci_canvas_set_line_width(ctx, 1.0f);
+    for (index = 0; index < 3; ++index)
+    {
+        ctx->line_cap = (ci_cap_style)(index);
+        ctx->line_join = (ci_join_style)(index);
+        ci_canvas_set_color(ctx, CI_STROKE_STYLE,
+                            index == 0 ? 0.8f : 0.0f, index == 1 ? 0.6f : 0.0f,
+                            index == 2 ? 0.8f : 0.0f, 1.0f);
+        ci_canvas_begin_path(ctx);
+        for (step = 0; step < 24; ++step)
+            ci_canvas_line_to(ctx, ((float)(step) + 1.0f) / 26.0f * width,
+                              (0.2f + 0.25f * (float)(index) +
+                               ((step * 7 + index) % 5) * 0.03f) * height);
+        ci_canvas_stroke(ctx);
+    }
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    dash[0] = 6.0f;
+    dash[1] = 3.0f;
+    ci_canvas_set_line_dash(ctx, dash, 2);
+    ci_canvas_transform(ctx, 1.0f, 0.2f, -0.4f, 0.8f, 0.3f * width, 0.05f * height);
+    ci_canvas_set_line_width(ctx, 0.9f);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_arc(ctx, 0.3f * width, 0.35f * height, 0.25f * width,
+                  0.0f, 6.28318531f, 0);
+    ci_canvas_stroke(ctx);
+}
+
+static void stroke_culled(ci_canvas_t *ctx, float width, float height)
+{
+    float dash[2];
+    int step;
+    ci_canvas_begin_path(ctx);
+    ci_canvas_rectangle(ctx, 0.1f * width, 0.0f, 0.8f * width, height);
+    ci_canvas_clip(ctx);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.2f, 0.4f, 0.8f, 1.0f);
+    ci_canvas_set_line_width(ctx, 12.0f);
+    ci_canvas_set_miter_limit(ctx, 20.0f);
+    ctx->fill_rule = CI_FILL_EVENODD;
+    ci_canvas_begin_path(ctx);
+    for (step = 0; step < 10; ++step)
+    {
+        float angle = (float)(step) * 0.62831853f;
+        float radius = (step & 1) ? 0.45f * width : 3.0f * width;
+        ci_canvas_line_to(ctx, 0.5f * width + radius * (float)cos((double)angle),
+                          0.5f * height + radius * (float)sin((double)angle));
+    }
+    ci_canvas_close_path(ctx);
+    ci_canvas_stroke(ctx);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.8f, 0.1f, 0.1f, 1.0f);
+    ci_canvas_set_line_width(ctx, 0.05f);
+    ctx->line_cap = CI_CAP_SQUARE;
+    dash[0] = 0.3f;
+    dash[1] = 0.1f;
+    ci_canvas_set_line_dash(ctx, dash, 2);
+    ci_canvas_translate(ctx, -30.0f * width, 0.0f);
+    ci_canvas_scale(ctx, 0.1f * width, 0.1f * height);
+    ci_canvas_begin_path(ctx);
+    for (step = 0; step < 4000; ++step)
+        ci_canvas_line_to(ctx, (float)(step) * 0.1f,
+                          5.0f + 3.0f * (float)sin((double)(step) * 0.37));
+    ci_canvas_stroke(ctx);
+}
+
 static void test_clip(ci_canvas_t *ctx, float width, float height)
 {
     float radius = CI_MINF(width, height) * 0.5f;
@@ -1768,6 +1952,54 @@ static void clip_evenodd(ci_canvas_t *ctx, float width, float height)
     ci_canvas_fill_rectangle(ctx, 0.0f, 0.0f, width, height);
 }
 
+static void clip_rectangle(ci_canvas_t *ctx, float width, float height)
+{
+    /* Rectangular clips on and off the pixel grid, nested, restored, and
+       followed by a general clip, with a copy operation that paints the
+       whole of each clip. */
+    int step;
+    ci_canvas_scale(ctx, width / 256.0f, height / 256.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.2f, 0.2f, 0.2f, 1.0f);
+    ci_canvas_fill_rectangle(ctx, 0.0f, 0.0f, 256.0f, 256.0f);
+    ci_canvas_save(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_rectangle(ctx, 16.25f, 16.5f, 100.5f, 100.25f);
+    ci_canvas_clip(ctx);
+    for (step = 0; step < 4; ++step) {
+        ci_canvas_save(ctx);
+        ci_canvas_begin_path(ctx);
+        ci_canvas_rectangle(ctx, 8.0f + 24.3f * (float)step,
+            8.0f + 24.3f * (float)step, 48.7f, 48.7f);
+        ci_canvas_clip(ctx);
+        ci_canvas_set_color(ctx, CI_FILL_STYLE,
+            0.25f * (float)step, 0.5f, 1.0f - 0.25f * (float)step, 1.0f);
+        ci_canvas_fill_rectangle(ctx, 0.0f, 0.0f, 256.0f, 256.0f);
+        ci_canvas_restore(ctx);
+    }
+    ci_canvas_restore(ctx);
+    ci_canvas_save(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_rectangle(ctx, 248.5f, 136.0f, -108.0f, 104.5f);
+    ci_canvas_clip(ctx);
+    ctx->global_composite_operation = CI_SOURCE_COPY;
+    ci_canvas_begin_path(ctx);
+    ci_canvas_arc(ctx, 160.0f, 160.0f, 40.0f, 0.0f, 6.28318531f, 0);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 1.0f, 0.8f, 0.0f, 0.75f);
+    ci_canvas_fill(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_arc(ctx, 220.0f, 220.0f, 48.0f, 0.0f, 6.28318531f, 0);
+    ci_canvas_clip(ctx);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 1.0f, 0.0f, 0.4f, 1.0f);
+    ci_canvas_fill_rectangle(ctx, 0.0f, 0.0f, 256.0f, 256.0f);
+    ci_canvas_restore(ctx);
+    ci_canvas_rotate(ctx, 0.3f);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_rectangle(ctx, 40.0f, 130.0f, 60.0f, 60.0f);
+    ci_canvas_clip(ctx);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 1.0f, 0.5f, 1.0f);
+    ci_canvas_fill_rectangle(ctx, 0.0f, 0.0f, 256.0f, 256.0f);
+}
+
 static void is_point_in_path_evenodd(ci_canvas_t *ctx, float width, float height)
 {
     /* Test is_point_in_path with evenodd on concentric rectangles.
@@ -1798,6 +2030,99 @@ static void is_point_in_path_evenodd(ci_canvas_t *ctx, float width, float height
     }
 }
 
+static void test_path2d(ci_canvas_t *ctx, float width, float height)
+{
+    /* One path object filled and stroked in a grid, translated so its
+       cached lines are moved, then rotated and widened so they are made
+       again, and finally extended so they are dropped; the current path
+       must survive all of it. */
+    static float const radii[] = { 4.0f, 10.0f };
+    ci_path2d_t *path = ci_path2d_create();
+    int index;
+    if (!path)
+        return;
+    ci_path2d_move_to(path, 8.0f, 40.0f);
+    ci_path2d_line_to(path, 24.0f, 8.0f);
+    ci_path2d_quadratic_curve_to(path, 40.0f, 0.0f, 52.0f, 16.0f);
+    ci_path2d_bezier_curve_to(path, 64.0f, 32.0f, 40.0f, 40.0f, 56.0f, 56.0f);
+    ci_path2d_arc_to(path, 8.0f, 56.0f, 8.0f, 40.0f, 12.0f);
+    ci_path2d_close_path(path);
+    ci_path2d_arc(path, 32.0f, 32.0f, 6.0f, 0.0f, 6.28318531f, 1);
+    ci_path2d_ellipse(path, 48.0f, 10.0f, 6.0f, 3.0f, 0.5f,
+        0.0f, 4.0f, 0);
+    ci_canvas_scale(ctx, width / 256.0f, height / 256.0f);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_move_to(ctx, 200.0f, 200.0f);
+    ci_canvas_line_to(ctx, 250.0f, 250.0f);
+    ci_canvas_line_to(ctx, 200.0f, 250.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.2f, 0.4f, 0.8f, 1.0f);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.9f, 0.5f, 0.1f, 1.0f);
+    ci_canvas_set_line_width(ctx, 2.0f);
+    for (index = 0; index < 6; ++index) {
+        ci_canvas_save(ctx);
+        ci_canvas_translate(ctx, (float)(index % 3) * 64.0f + 4.0f,
+            (float)(index / 3) * 64.0f + 4.0f);
+        if (index == 4) {
+            ci_canvas_translate(ctx, 32.0f, 32.0f);
+            ci_canvas_rotate(ctx, 0.5f);
+            ci_canvas_translate(ctx, -32.0f, -32.0f);
+        }
+        if (index == 5)
+            ci_canvas_set_line_width(ctx, 5.0f);
+        ci_canvas_fill_path(ctx, path);
+        ci_canvas_stroke_path(ctx, path);
+        ci_canvas_restore(ctx);
+    }
+    ci_path2d_round_rectangle(path, 4.0f, 4.0f, 56.0f, 56.0f, radii, 2);
+    ci_path2d_rectangle(path, 20.0f, 20.0f, 24.0f, 24.0f);
+    ci_canvas_set_fill_rule(ctx, CI_FILL_EVENODD);
+    ci_canvas_translate(ctx, 4.0f, 132.0f);
+    ci_canvas_fill_path(ctx, path);
+    ci_canvas_translate(ctx, 64.0f, 0.0f);
+    ci_canvas_stroke_path(ctx, path);
+    ci_canvas_fill_path(ctx, NULL);
+    ci_canvas_set_transform(ctx, width / 256.0f, 0.0f, 0.0f,
+        height / 256.0f, 0.0f, 0.0f);
+    ci_canvas_fill(ctx);
+    ci_path2d_destroy(path);
+    ci_path2d_destroy(NULL);
+}
+
+static void path_reuse(ci_canvas_t *ctx, float width, float height)
+{
+    /* One path filled, stroked at two widths, hit tested, extended and
+       clipped to in turn, so each step must see the path as it is then
+       and not the lines left over from an earlier step. */
+    int index;
+    ci_canvas_scale(ctx, width / 256.0f, height / 256.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.2f, 0.4f, 0.8f, 1.0f);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.9f, 0.5f, 0.1f, 1.0f);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_move_to(ctx, 32.0f, 128.0f);
+    ci_canvas_bezier_curve_to(ctx, 32.0f, 0.0f, 224.0f, 0.0f, 224.0f, 128.0f);
+    ci_canvas_quadratic_curve_to(ctx, 128.0f, 192.0f, 32.0f, 128.0f);
+    ci_canvas_fill(ctx);
+    ci_canvas_set_line_width(ctx, 12.0f);
+    ci_canvas_stroke(ctx);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.1f, 0.1f, 0.1f, 1.0f);
+    ci_canvas_set_line_width(ctx, 2.0f);
+    ci_canvas_stroke(ctx);
+    for (index = 0; index < 64; ++index) {
+        float x = 16.0f + (float)(index % 8) * 32.0f;
+        float y = 16.0f + (float)(index / 8) * 24.0f;
+        int inside = ci_canvas_is_point_in_path(ctx, x, y);
+        ci_canvas_set_color(ctx, CI_FILL_STYLE,
+            1.0f - (float)inside, (float)inside, 0.0f, 1.0f);
+        ci_canvas_fill_rectangle(ctx, x - 2.0f, y - 2.0f, 4.0f, 4.0f);
+    }
+    ci_canvas_rectangle(ctx, 96.0f, 160.0f, 64.0f, 80.0f);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.5f, 0.2f, 0.6f, 0.5f);
+    ci_canvas_fill(ctx);
+    ci_canvas_clip(ctx);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.9f, 0.9f, 0.2f, 0.5f);
+    ci_canvas_fill_rectangle(ctx, 0.0f, 96.0f, 256.0f, 112.0f);
+}
+
 static void test_clear_rectangle(ci_canvas_t *ctx, float width, float height)
 {
     float y, x;
@@ -2016,6 +2341,285 @@ static void test_measure_text(ci_canvas_t *ctx, float width, float height)
     ci_canvas_fill_text(ctx, "s", place, 0.2f * height, 1.0e30f);
 }
 
+static void test_font_object(ci_canvas_t *ctx, float width, float height)
+{
+    /* One loaded font shared by this canvas and a second one, with the
+       second's pixels copied over, then outliving a save and restore. */
+    ci_font_t *font = ci_font_create(font_a.data, (int)font_a.size);
+    ci_canvas_t *other = ci_canvas_create(128, 64);
+    unsigned char pixels[128 * 64 * 4];
+    if (!font || !other ||
+        ci_font_create(font_a.data, 5) ||
+        ci_canvas_set_font_object(ctx, 0, 12.0f)) {
+        ci_font_destroy(font);
+        ci_canvas_destroy(other);
+        return;
+    }
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.5f, 1.0f);
+    ci_canvas_set_font_object(ctx, font, 0.2f * height);
+    ci_canvas_save(ctx);
+    ci_canvas_set_font(ctx, font_b.data, (int)font_b.size, 0.2f * height);
+    ci_canvas_fill_text(ctx, "CE", 0.1f * width, 0.25f * height, 1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_fill_text(ctx, "Cats", 0.1f * width, 0.5f * height, 1.0e30f);
+    ci_canvas_set_font_object(other, font, 40.0f);
+    ci_canvas_set_color(other, CI_FILL_STYLE, 0.6f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_fill_text(other, "Cats", 8.0f, 48.0f, 1.0e30f);
+    ci_canvas_get_image_data(other, pixels, 128, 64, 128 * 4, 0, 0);
+    ci_canvas_put_image_data(ctx, pixels, 128, 64, 128 * 4,
+        (int)(0.4f * width), (int)(0.6f * height));
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.1f * height);
+    ci_canvas_fill_text(ctx, "Cats", 0.1f * width, 0.95f * height, 1.0e30f);
+    ci_canvas_destroy(other);
+    ci_font_destroy(font);
+}
+
+static void test_font_borrowed(ci_canvas_t *ctx, float width, float height)
+{
+    /* Fonts reading their tables in place from the caller's bytes must
+       draw just as copied ones do. */
+    ci_font_t *borrowed = ci_font_create_borrowed(font_a.data, (int)font_a.size);
+    ci_font_t *copied = ci_font_create(font_a.data, (int)font_a.size);
+    ci_font_t *other = ci_font_create_borrowed(font_c.data, (int)font_c.size);
+#if defined(CANVAS_ITY_MMAP)
+    if (ci_font_map_file("no such font file.ttf"))
+        return;
+#endif
+    if (!borrowed || !copied || !other ||
+        ci_font_create_borrowed(font_a.data, 12)) {
+        ci_font_destroy(borrowed);
+        ci_font_destroy(copied);
+        ci_font_destroy(other);
+        return;
+    }
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_set_font_object(ctx, borrowed, 0.25f * height);
+    ci_canvas_fill_text(ctx, "Cats", 0.1f * width, 0.3f * height, 1.0e30f);
+    ci_canvas_set_font_object(ctx, copied, 0.25f * height);
+    ci_canvas_fill_text(ctx, "Cats", 0.1f * width, 0.6f * height, 1.0e30f);
+    ci_canvas_set_font_object(ctx, other, 0.2f * height);
+    ci_canvas_fill_text(ctx, "CE\xc3\x8d", 0.1f * width, 0.9f * height, 1.0e30f);
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.1f * height);
+    ci_font_destroy(borrowed);
+    ci_font_destroy(copied);
+    ci_font_destroy(other);
+}
+
+static void test_font_cmap(ci_canvas_t *ctx, float width, float height)
+{
+    /* Characters mapped through the direct table, through the ranges
+       above it, and through a format 0 table, drawn only if each maps to
+       the glyph the font's cmap gives it. */
+    char const *samples[] = { "C", "\xcc\x81", "\xf4\x8f\xbf\xbd",
+        "\xe2\x82\xac", "\xf0\x90\x80\x80" };
+    int const expected[] = { 3, 12, 13, 0, 0 };
+    int sample, index;
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
+    for (sample = 0; sample < 5; ++sample) {
+        index = 0;
+        if (ci_character_to_glyph(&ctx->face, samples[sample], &index) !=
+            expected[sample])
+            return;
+    }
+    ci_canvas_fill_text(ctx, "C\xcc\x81" "a\xf4\x8f\xbf\xbd\xe2\x82\xac",
+        0.1f * width, 0.4f * height, 1.0e30f);
+    ci_canvas_set_font(ctx, font_c.data, (int)font_c.size, 0.2f * height);
+    index = 0;
+    if (ci_character_to_glyph(&ctx->face, "\xe2\x82\xac", &index) != 0)
+        return;
+    ci_canvas_fill_text(ctx, "CE\xc3\x8d\xe2\x82\xac",
+        0.1f * width, 0.8f * height, 1.0e30f);
+}
+
+static void test_glyph_cache(ci_canvas_t *ctx, float width, float height)
+{
+    /* The same text drawn with outlines decoded fresh, cached, evicted
+       under a tight cap, uncached, and after switching fonts and back,
+       must look the same every time. */
+    int limits[] = { 1 << 20, 1 << 20, 600, 0 };
+    int row;
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.15f * height);
+    for (row = 0; row < 4; ++row) {
+        ci_canvas_set_glyph_cache_limit(ctx, limits[row]);
+        ci_canvas_fill_text(ctx, "Cats * Cats", 0.05f * width,
+            (0.15f + 0.17f * (float)row) * height, 1.0e30f);
+    }
+    ci_canvas_set_glyph_cache_limit(ctx, 1 << 20);
+    ci_canvas_save(ctx);
+    ci_canvas_set_font(ctx, font_c.data, (int)font_c.size, 0.15f * height);
+    ci_canvas_fill_text(ctx, "CE\xc3\x8d", 0.55f * width, 0.83f * height,
+        1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_fill_text(ctx, "Cats", 0.05f * width, 0.83f * height,
+        1.0e30f);
+    ci_canvas_set_font(ctx, font_c.data, (int)font_c.size, 0.1f * height);
+    ci_canvas_fill_text(ctx, "CE\xc3\x8d", 0.55f * width, 0.97f * height,
+        1.0e30f);
+}
+
+static void test_glyph_cache_limit(ci_canvas_t *ctx, float width,
+    float height)
+{
+    /* Outlines fill the cap when stroked, then filling keeps coverage
+       too, and the two together must stay within the cap.  A red bar
+       shows where they went over it. */
+    ci_glyph_cache_t const *cache = &ctx->glyph_cache;
+    int row, over = 0;
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.12f * height);
+    ci_canvas_set_glyph_cache_limit(ctx, 4096);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.0f, 0.3f, 0.0f, 1.0f);
+    ci_canvas_stroke_text(ctx, "Jackdaws love my big sphinx of quartz",
+        0.02f * width, 0.15f * height, 1.0e30f);
+    over |= cache->bytes + ci_glyph_coverage_bytes(cache) > cache->limit;
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+    for (row = 0; row < 4; ++row) {
+        ci_canvas_fill_text(ctx, row & 1 ? "my big sphinx" : "of quartz",
+            (0.05f + 0.013f * (float)row) * width,
+            (0.32f + 0.15f * (float)row) * height, 1.0e30f);
+        over |= cache->bytes + ci_glyph_coverage_bytes(cache) >
+            cache->limit;
+    }
+    if (over) {
+        ci_canvas_set_color(ctx, CI_FILL_STYLE, 1.0f, 0.0f, 0.0f, 1.0f);
+        ci_canvas_fill_rectangle(ctx, 0.0f, 0.92f * height, width,
+            0.08f * height);
+    }
+}
+
+static void test_glyph_coverage(ci_canvas_t *ctx, float width,
+    float height)
+{
+    /* Cached glyph coverage reused at creeping sub-pixel offsets, past
+       the canvas edges, under rectangular and curved clips, when rotated,
+       and without the cache for comparison. */
+    int step;
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.12f * height);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.5f, 0.75f);
+    for (step = 0; step < 6; ++step)
+        ci_canvas_fill_text(ctx, "Cats",
+            (-0.1f + 0.2f * (float)step + 0.013f * (float)step) * width,
+            (0.1f + 0.003f * (float)step) * height, 1.0e30f);
+    ci_canvas_set_glyph_cache_limit(ctx, 0);
+    ci_canvas_fill_text(ctx, "Cats * Cats", 0.05f * width, 0.25f * height,
+        1.0e30f);
+    ci_canvas_set_glyph_cache_limit(ctx, 1 << 20);
+    ci_canvas_fill_text(ctx, "Cats * Cats", 0.05f * width, 0.4f * height,
+        1.0e30f);
+    ci_canvas_save(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_rectangle(ctx, 0.1f * width, 0.42f * height,
+        0.5f * width, 0.12f * height);
+    ci_canvas_clip(ctx);
+    ci_canvas_fill_text(ctx, "Cats * Cats", 0.05f * width, 0.55f * height,
+        1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_save(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_arc(ctx, 0.5f * width, 0.66f * height, 0.12f * height,
+        0.0f, 6.28318531f, 0);
+    ci_canvas_clip(ctx);
+    ci_canvas_fill_text(ctx, "Cats * Cats", 0.05f * width, 0.7f * height,
+        1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_translate(ctx, 0.5f * width, 0.9f * height);
+    ci_canvas_rotate(ctx, -0.2f);
+    ci_canvas_fill_text(ctx, "Cats", 0.0f, 0.0f, 1.0e30f);
+    ci_canvas_fill_text(ctx, "Cats", -0.45f * width, 0.1f * height,
+        1.0e30f);
+}
+
+static void test_text_layout(ci_canvas_t *ctx, float width, float height)
+{
+    /* One shaped string measured, then filled and stroked with each
+       alignment and squeezed, matching the plain text calls; drawing it
+       while another font is current must do nothing. */
+    static ci_align_style const aligns[] = {
+        CI_ALIGN_LEFTWARD, CI_ALIGN_CENTER, CI_ALIGN_RIGHTWARD };
+    ci_font_t *font = ci_font_create(font_a.data, (int)font_a.size);
+    ci_text_layout_t *layout =
+        ci_text_layout_create(font, 0.15f * height, "Cats * Cats");
+    int row;
+    if (!layout || ci_text_layout_create(NULL, 12.0f, "Cats") ||
+        ci_text_layout_create(font, 12.0f, NULL) ||
+        ci_text_layout_measure(NULL) != 0.0f) {
+        ci_text_layout_destroy(layout);
+        ci_font_destroy(font);
+        return;
+    }
+    ci_canvas_set_font_object(ctx, font, 0.15f * height);
+    if (ci_text_layout_measure(layout) !=
+        ci_canvas_measure_text(ctx, "Cats * Cats")) {
+        ci_text_layout_destroy(layout);
+        ci_font_destroy(font);
+        return;
+    }
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.5f, 1.0f);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.6f, 0.0f, 0.0f, 1.0f);
+    for (row = 0; row < 3; ++row) {
+        ctx->text_align = aligns[row];
+        ci_canvas_fill_text_layout(ctx, layout, 0.5f * width,
+            (0.15f + 0.15f * (float)row) * height, 1.0e30f);
+    }
+    ctx->text_align = CI_ALIGN_LEFTWARD;
+    ci_canvas_stroke_text_layout(ctx, layout, 0.05f * width,
+        0.65f * height, 1.0e30f);
+    ci_canvas_fill_text_layout(ctx, layout, 0.05f * width,
+        0.8f * height, 0.5f * width);
+    ci_canvas_fill_text(ctx, "Cats * Cats", 0.55f * width,
+        0.8f * height, 0.4f * width);
+    ci_canvas_set_font(ctx, font_b.data, (int)font_b.size, 0.15f * height);
+    ci_canvas_fill_text_layout(ctx, layout, 0.05f * width,
+        0.95f * height, 1.0e30f);
+    ci_text_layout_destroy(layout);
+    ci_font_destroy(font);
+}
+
+static void test_fill_text_batch(ci_canvas_t *ctx, float width,
+    float height)
+{
+    /* Labels filled in one pass: a grid drawn in reading order and then
+       in reverse, with an empty and a missing text, the same with the
+       glyph cache off, and overlapping translucent labels blended once
+       where they cross. */
+    static char const *const texts[] = {
+        "Cats", "*", "", "Cats", NULL, "* Cats", "C", "ats" };
+    char const *reversed[8];
+    float positions[16], shifted[16];
+    int index;
+    for (index = 0; index < 8; ++index) {
+        positions[2 * index] = (0.02f + 0.25f * (float)(index % 4)) * width;
+        positions[2 * index + 1] = (0.1f + 0.12f * (float)(index / 4)) *
+            height;
+        reversed[7 - index] = texts[index];
+        shifted[2 * (7 - index)] = positions[2 * index];
+        shifted[2 * (7 - index) + 1] = positions[2 * index + 1] +
+            0.27f * height;
+    }
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.1f * height);
+    ci_canvas_set_linear_gradient(ctx, CI_FILL_STYLE,
+        0.0f, 0.0f, width, 0.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 0.5f, 1.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 1.0f, 0.6f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_fill_text_batch(ctx, texts, positions, 8);
+    ci_canvas_fill_text_batch(ctx, reversed, shifted, 8);
+    ci_canvas_fill_text_batch(ctx, texts, positions, 0);
+    ci_canvas_fill_text_batch(ctx, NULL, positions, 8);
+    ci_canvas_set_glyph_cache_limit(ctx, 0);
+    for (index = 0; index < 8; ++index)
+        positions[2 * index + 1] += 0.54f * height;
+    ci_canvas_fill_text_batch(ctx, texts, positions, 4);
+    ci_canvas_set_glyph_cache_limit(ctx, 1 << 20);
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.4f, 0.0f, 0.5f);
+    for (index = 0; index < 4; ++index) {
+        positions[2 * index] = (0.05f + 0.1f * (float)index) * width;
+        positions[2 * index + 1] = (0.85f + 0.03f * (float)index) * height;
+    }
+    ci_canvas_fill_text_batch(ctx, texts + 3, positions, 4);
+}
+
 /* ======== KERNING TEST HELPERS ======== */
 
 static unsigned char *make_kerned_font(
@@ -2191,9 +2795,9 @@ static void test_text_kerning(ci_canvas_t *ctx, float width, float height)
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     ci_canvas_fill_text(ctx, "Canvas", 0.05f * width, 0.3f * height,
         1.0e30f);
     kerned_font = make_kerned_font(font_a.data, (int)font_a.size,
@@ -2216,9 +2820,9 @@ static void test_text_kerning_measure(ci_canvas_t *ctx,
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     w_normal = ci_canvas_measure_text(ctx, "CaCaCa");
     ci_canvas_fill_text(ctx, "CaCaCa", 0.05f * width, 0.25f * height,
         1.0e30f);
@@ -2508,9 +3112,9 @@ static void test_text_kerning_aat(ci_canvas_t *ctx,
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     ci_canvas_fill_text(ctx, "Canvas", 0.05f * width, 0.3f * height,
         1.0e30f);
     kerned_font = make_aat_kerned_font(font_a.data, (int)font_a.size,
@@ -2533,9 +3137,9 @@ static void test_text_kerning_aat_measure(ci_canvas_t *ctx,
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     w_normal = ci_canvas_measure_text(ctx, "CaCaCa");
     ci_canvas_fill_text(ctx, "CaCaCa", 0.05f * width, 0.25f * height,
         1.0e30f);
@@ -2568,9 +3172,9 @@ static void test_text_kerning_gpos_fmt1(ci_canvas_t *ctx,
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     ci_canvas_fill_text(ctx, "Canvas", 0.05f * width, 0.3f * height,
         1.0e30f);
     kerned_font = make_gpos_fmt1_font(font_a.data, (int)font_a.size,
@@ -2592,9 +3196,9 @@ static void test_text_kerning_gpos_fmt2(ci_canvas_t *ctx,
     ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
     ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 0.2f * height);
     idx = 0;
-    glyph_c = ci_character_to_glyph(ctx, "C", &idx);
+    glyph_c = ci_character_to_glyph(&ctx->face, "C", &idx);
     idx = 0;
-    glyph_a = ci_character_to_glyph(ctx, "a", &idx);
+    glyph_a = ci_character_to_glyph(&ctx->face, "a", &idx);
     ci_canvas_fill_text(ctx, "Canvas", 0.05f * width, 0.3f * height,
         1.0e30f);
     kerned_font = make_gpos_fmt2_font(font_a.data, (int)font_a.size,
@@ -2754,6 +3358,50 @@ static void test_save_restore(ci_canvas_t *ctx, float width, float height)
     ci_canvas_save(ctx);
 }
 
+static void save_restore_nested(ci_canvas_t *ctx, float width, float height)
+{
+    /* Each level of nested saves changes a different part of the state
+       and draws with it; the levels below must see theirs unchanged. */
+    static float const dashes[] = { 12.0f, 6.0f };
+    unsigned char pattern[4 * 4 * 4];
+    int index;
+    for (index = 0; index < 4 * 4 * 4; ++index)
+        pattern[index] = (unsigned char)((index >> 2 ^ index >> 4) & 1 ?
+            255 : (index & 3) == 3 ? 255 : 64);
+    ci_canvas_scale(ctx, width / 256.0f, height / 256.0f);
+    ci_canvas_set_font(ctx, font_a.data, (int)font_a.size, 24.0f);
+    ci_canvas_set_linear_gradient(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 256.0f, 0.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f);
+    ci_canvas_set_color(ctx, CI_STROKE_STYLE, 0.0f, 0.5f, 0.0f, 1.0f);
+    ci_canvas_set_line_width(ctx, 4.0f);
+    ci_canvas_save(ctx);
+    ci_canvas_set_line_dash(ctx, dashes, 2);
+    ci_canvas_add_color_stop(ctx, CI_FILL_STYLE, 0.5f, 1.0f, 1.0f, 0.0f, 1.0f);
+    ci_canvas_save(ctx);
+    ci_canvas_begin_path(ctx);
+    ci_canvas_arc(ctx, 128.0f, 96.0f, 80.0f, 0.0f, 6.28318531f, 0);
+    ci_canvas_clip(ctx);
+    ci_canvas_set_pattern(ctx, CI_STROKE_STYLE, pattern, 4, 4, 16, CI_REPEAT);
+    ci_canvas_save(ctx);
+    ci_canvas_set_font(ctx, font_b.data, (int)font_b.size, 32.0f);
+    ci_canvas_fill_text(ctx, "CE", 96.0f, 72.0f, 1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_fill_rectangle(ctx, 32.0f, 96.0f, 192.0f, 24.0f);
+    ci_canvas_stroke_rectangle(ctx, 64.0f, 40.0f, 128.0f, 112.0f);
+    ci_canvas_fill_text(ctx, "Cats", 96.0f, 156.0f, 1.0e30f);
+    ci_canvas_restore(ctx);
+    ci_canvas_fill_rectangle(ctx, 16.0f, 180.0f, 224.0f, 16.0f);
+    ci_canvas_stroke_rectangle(ctx, 16.0f, 176.0f, 224.0f, 24.0f);
+    ci_canvas_restore(ctx);
+    ci_canvas_fill_rectangle(ctx, 16.0f, 212.0f, 224.0f, 16.0f);
+    ci_canvas_stroke_rectangle(ctx, 16.0f, 208.0f, 224.0f, 24.0f);
+    ci_canvas_fill_text(ctx, "* Cats", 8.0f, 252.0f, 1.0e30f);
+    ci_canvas_save(ctx);
+    ci_canvas_save(ctx);
+    ci_canvas_set_color(ctx, CI_FILL_STYLE, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
 static void example_button(ci_canvas_t *ctx, float width, float height)
 {
     float left, right, top, bottom, mid_x, mid_y;
@@ -3057,95 +3705,113 @@ static test_entry const tests[] = {
     { 0xc99ddee7, 256, 256, scale_uniform, "scale_uniform" },
     { 0xe93d3c6f, 256, 256, scale_non_uniform, "scale_non_uniform" },
     { 0x05a0e377, 256, 256, test_rotate, "rotate" },
-    { 0x36e7fa56, 256, 256, test_translate, "translate" },
+    { 0x691ccd1b, 256, 256, test_translate, "translate" },
     { 0xcfae3e4f, 256, 256, test_transform, "transform" },
     { 0x98f5594a, 256, 256, transform_fill, "transform_fill" },
-    { 0x822964b0, 256, 256, transform_stroke, "transform_stroke" },
+    { 0xb5c02771, 256, 256, transform_stroke, "transform_stroke" },
     { 0xb7056a3a, 256, 256, test_set_transform, "set_transform" },
     { 0x8f6dd6c3, 256, 256, test_global_alpha, "global_alpha" },
     { 0x98a0609d, 256, 256, test_global_composite_operation, "global_composite_operation" },
     { 0x9def5b00, 256, 256, shadow_color, "shadow_color" },
     { 0x8294edd8, 256, 256, shadow_offset, "shadow_offset" },
-    { 0xcdeba51c, 256, 256, shadow_offset_offscreen, "shadow_offset_offscreen" },
+    { 0x1bb11a40, 256, 256, shadow_offset_offscreen, "shadow_offset_offscreen" },
     { 0x5b542224, 256, 256, shadow_blur, "shadow_blur" },
     { 0xd6c150e6, 256, 256, shadow_blur_offscreen, "shadow_blur_offscreen" },
-    { 0x5affc092, 256, 256, shadow_blur_composite, "shadow_blur_composite" },
-    { 0x1720e9b2, 256, 256, test_line_width, "line_width" },
-    { 0xf8d2bb0d, 256, 256, line_width_angular, "line_width_angular" },
-    { 0x7bda8673, 256, 256, test_line_cap, "line_cap" },
+    { 0x4442b892, 256, 256, shadow_blur_composite, "shadow_blur_composite" },
+    { 0x3f06bf39, 256, 256, shadow_brush, "shadow_brush" },
+    { 0x7a3ce4ac, 256, 256, shadow_blur_wide, "shadow_blur_wide" },
+    { 0x3cacc6b8, 256, 256, shadow_cache, "shadow_cache" },
+    { 0x7fe985e2, 256, 256, shadow_cache_rounding, "shadow_cache_rounding" },
+    { 0x6abedfe4, 256, 256, test_line_width, "line_width" },
+    { 0xcaba3545, 256, 256, line_width_angular, "line_width_angular" },
+    { 0xc9cad5c8, 256, 256, test_line_cap, "line_cap" },
     { 0x53639198, 256, 256, line_cap_offscreen, "line_cap_offscreen" },
-    { 0x8f49c41d, 256, 256, test_line_join, "line_join" },
-    { 0xca27ce8c, 256, 256, line_join_offscreen, "line_join_offscreen" },
+    { 0xf0b66834, 256, 256, test_line_join, "line_join" },
+    { 0x85670f32, 256, 256, line_join_offscreen, "line_join_offscreen" },
     { 0xe68273e2, 256, 256, test_miter_limit, "miter_limit" },
     { 0x27c38a8a, 256, 256, line_dash_offset, "line_dash_offset" },
     { 0x129f9595, 256, 256, test_line_dash, "line_dash" },
     { 0x88a74152, 256, 256, line_dash_closed, "line_dash_closed" },
-    { 0x064f194d, 256, 256, line_dash_overlap, "line_dash_overlap" },
-    { 0xf7259c0f, 256, 256, line_dash_offscreen, "line_dash_offscreen" },
-    { 0xeb4338e8, 256, 256, test_color, "color" },
-    { 0x6dc35a07, 256, 256, test_linear_gradient, "linear_gradient" },
-    { 0x418fe678, 256, 256, test_radial_gradient, "radial_gradient" },
-    { 0xd5dc2c85, 256, 256, test_conic_gradient, "conic_gradient" },
+    { 0x6a7a60a0, 256, 256, line_dash_overlap, "line_dash_overlap" },
+    { 0x05489c71, 256, 256, line_dash_offscreen, "line_dash_offscreen" },
+    { 0xfeec1eb6, 256, 256, test_color, "color" },
+    { 0x5f5be28c, 256, 256, test_linear_gradient, "linear_gradient" },
+    { 0x2fcb9480, 256, 256, test_radial_gradient, "radial_gradient" },
+    { 0x38eda0ca, 256, 256, test_conic_gradient, "conic_gradient" },
     { 0x3eda353a, 256, 256, conic_gradient_rect, "conic_gradient_rect" },
     { 0x67aada11, 256, 256, test_color_stop, "color_stop" },
-    { 0xc6c721d6, 256, 256, test_pattern, "pattern" },
+    { 0x5d6927ff, 256, 256, test_pattern, "pattern" },
     { 0xb0b391cd, 256, 256, test_begin_path, "begin_path" },
     { 0xf79ed394, 256, 256, test_move_to, "move_to" },
     { 0xe9602309, 256, 256, test_close_path, "close_path" },
     { 0x3160ace7, 256, 256, test_line_to, "line_to" },
-    { 0xb6176812, 256, 256, test_quadratic_curve_to, "quadratic_curve_to" },
-    { 0x5f523029, 256, 256, test_bezier_curve_to, "bezier_curve_to" },
-    { 0x1f847aaf, 256, 256, test_arc_to, "arc_to" },
-    { 0x26457553, 256, 256, test_arc, "arc" },
-    { 0x5f042c5d, 256, 256, test_ellipse, "ellipse" },
-    { 0x3c8a0970, 256, 256, test_ellipse_rotated, "ellipse_rotated" },
+    { 0xf6404716, 256, 256, test_quadratic_curve_to, "quadratic_curve_to" },
+    { 0x1d04a286, 256, 256, test_bezier_curve_to, "bezier_curve_to" },
+    { 0x7a43a544, 256, 256, test_arc_to, "arc_to" },
+    { 0xf59e03a9, 256, 256, test_arc, "arc" },
+    { 0x780a7657, 256, 256, test_ellipse, "ellipse" },
+    { 0x4a81159e, 256, 256, test_ellipse_rotated, "ellipse_rotated" },
     { 0x7520990c, 256, 256, test_rectangle, "rectangle" },
-    { 0x7290ed64, 256, 256, test_round_rect, "round_rect" },
-    { 0x407aa93b, 256, 256, test_round_rect_clamped, "round_rect_clamped" },
+    { 0x8e397d6c, 256, 256, test_round_rect, "round_rect" },
+    { 0x296d3fe6, 256, 256, test_round_rect_clamped, "round_rect_clamped" },
     { 0xf1d774dc, 256, 256, test_fill, "fill" },
     { 0x5e6e6b75, 256, 256, fill_rounding, "fill_rounding" },
     { 0xf0cf6566, 256, 256, fill_converging, "fill_converging" },
-    { 0x3692d10e, 256, 256, fill_zone_plate, "fill_zone_plate" },
+    { 0xb180d2eb, 256, 256, fill_zone_plate, "fill_zone_plate" },
     { 0x2003f926, 256, 256, test_stroke, "stroke" },
-    { 0xc44fc157, 256, 256, stroke_wide, "stroke_wide" },
-    { 0x691cfe49, 256, 256, stroke_inner_join, "stroke_inner_join" },
+    { 0xbfa54b6e, 256, 256, stroke_wide, "stroke_wide" },
+    { 0xe5aaef7b, 256, 256, stroke_inner_join, "stroke_inner_join" },
     { 0xc0bd9324, 256, 256, stroke_spiral, "stroke_spiral" },
     { 0x3b2dae15, 256, 256, stroke_long, "stroke_long" },
-    { 0xa7e06559, 256, 256, test_clip, "clip" },
+    { 0x27479e42, 256, 256, stroke_hairline, "stroke_hairline" },
+    { 0xbc2866ba, 256, 256, stroke_culled, "stroke_culled" },
+    { 0x61c8c0ef, 256, 256, test_clip, "clip" },
     { 0x31e6112b, 256, 256, clip_winding, "clip_winding" },
-    { 0xc2188d67, 256, 256, test_is_point_in_path, "is_point_in_path" },
+    { 0xaf25a63d, 256, 256, test_is_point_in_path, "is_point_in_path" },
     { 0x6505bdc9, 256, 256, is_point_in_path_offscreen, "is_point_in_path_offscreen" },
-    { 0x3a3803eb, 256, 256, fill_evenodd, "fill_evenodd" },
+    { 0x4343d4e3, 256, 256, fill_evenodd, "fill_evenodd" },
     { 0x130d5578, 256, 256, fill_evenodd_star, "fill_evenodd_star" },
-    { 0x64454d62, 256, 256, clip_evenodd, "clip_evenodd" },
+    { 0x5b3c9e3c, 256, 256, clip_evenodd, "clip_evenodd" },
+    { 0xa370f2e1, 256, 256, clip_rectangle, "clip_rectangle" },
     { 0xec607e9e, 256, 256, is_point_in_path_evenodd, "is_point_in_path_evenodd" },
+    { 0xcf2979ee, 256, 256, test_path2d, "path2d" },
+    { 0x8e75a628, 256, 256, path_reuse, "path_reuse" },
     { 0x5e792c96, 256, 256, test_clear_rectangle, "clear_rectangle" },
     { 0x286e96fa, 256, 256, test_fill_rectangle, "fill_rectangle" },
     { 0xc2b0803d, 256, 256, test_stroke_rectangle, "stroke_rectangle" },
-    { 0xe6c4d9c7, 256, 256, test_text_align, "text_align" },
-    { 0x72cb6b06, 256, 256, test_text_baseline, "text_baseline" },
-    { 0x4d41daa2, 256, 256, test_font, "font" },
-    { 0x70e3232d, 256, 256, test_fill_text, "fill_text" },
-    { 0xed6477c8, 256, 256, test_stroke_text, "stroke_text" },
-    { 0x32d1ee3b, 256, 256, test_measure_text, "measure_text" },
-    { 0x2c895307, 256, 256, test_text_kerning, "text_kerning" },
-    { 0xd9969c18, 256, 256, test_text_kerning_measure, "text_kerning_measure" },
-    { 0x2c895307, 256, 256, test_text_kerning_aat, "text_kerning_aat" },
-    { 0xd9969c18, 256, 256, test_text_kerning_aat_measure, "text_kerning_aat_measure" },
-    { 0x2c895307, 256, 256, test_text_kerning_gpos_fmt1, "text_kerning_gpos_fmt1" },
-    { 0x2c895307, 256, 256, test_text_kerning_gpos_fmt2, "text_kerning_gpos_fmt2" },
+    { 0x49b4f59a, 256, 256, test_text_align, "text_align" },
+    { 0xc9694a9f, 256, 256, test_text_baseline, "text_baseline" },
+    { 0xc4bb4c8e, 256, 256, test_font, "font" },
+    { 0x457face7, 256, 256, test_font_object, "font_object" },
+    { 0x34ba75d6, 256, 256, test_font_borrowed, "font_borrowed" },
+    { 0x954eee1b, 256, 256, test_font_cmap, "font_cmap" },
+    { 0xd45a690d, 256, 256, test_glyph_cache, "glyph_cache" },
+    { 0x391b6936, 256, 256, test_glyph_cache_limit, "glyph_cache_limit" },
+    { 0xf45c3afb, 256, 256, test_glyph_coverage, "glyph_coverage" },
+    { 0x060b7af1, 256, 256, test_text_layout, "text_layout" },
+    { 0x42da7cb3, 256, 256, test_fill_text_batch, "fill_text_batch" },
+    { 0xc12deb25, 256, 256, test_fill_text, "fill_text" },
+    { 0xe210e8f9, 256, 256, test_stroke_text, "stroke_text" },
+    { 0x58846ef9, 256, 256, test_measure_text, "measure_text" },
+    { 0xd20a3dd6, 256, 256, test_text_kerning, "text_kerning" },
+    { 0x7b848469, 256, 256, test_text_kerning_measure, "text_kerning_measure" },
+    { 0xd20a3dd6, 256, 256, test_text_kerning_aat, "text_kerning_aat" },
+    { 0x7b848469, 256, 256, test_text_kerning_aat_measure, "text_kerning_aat_measure" },
+    { 0xd20a3dd6, 256, 256, test_text_kerning_gpos_fmt1, "text_kerning_gpos_fmt1" },
+    { 0xd20a3dd6, 256, 256, test_text_kerning_gpos_fmt2, "text_kerning_gpos_fmt2" },
     { 0x78cb460c, 256, 256, test_draw_image, "draw_image" },
     { 0xb530077b, 256, 256, draw_image_matted, "draw_image_matted" },
     { 0xaf04e7a2, 256, 256, test_get_image_data, "get_image_data" },
     { 0x5acae0b6, 256, 256, test_put_image_data, "put_image_data" },
     { 0xb6e854b1, 256, 256, test_save_restore, "save_restore" },
-    { 0x62bc9606, 256, 256, example_button, "example_button" },
-    { 0x92731a7b, 256, 256, example_smiley, "example_smiley" },
-    { 0xe2f1e1de, 256, 256, example_knot, "example_knot" },
-    { 0xc02d01ea, 256, 256, example_icon, "example_icon" },
-    { 0xa1607c4a, 256, 256, example_illusion, "example_illusion" },
-    { 0x7c861f87, 256, 256, example_star, "example_star" },
-    { 0x429ca194, 256, 256, example_neon, "example_neon" }
+    { 0xdfd10b3e, 256, 256, save_restore_nested, "save_restore_nested" },
+    { 0xad173e9f, 256, 256, example_button, "example_button" },
+    { 0xcb213c0b, 256, 256, example_smiley, "example_smiley" },
+    { 0x9c39e009, 256, 256, example_knot, "example_knot" },
+    { 0x787b7470, 256, 256, example_icon, "example_icon" },
+    { 0x32a1024e, 256, 256, example_illusion, "example_illusion" },
+    { 0x440bf73b, 256, 256, example_star, "example_star" },
+    { 0x2f291381, 256, 256, example_neon, "example_neon" }
 };
 
 static int glob_match(char const *pattern, char const *name)